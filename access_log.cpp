@@ -0,0 +1,143 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access_log.h"
+#include "logging.h"
+
+constexpr size_t access_log::batch_entries;
+constexpr std::chrono::seconds access_log::max_batch_age;
+constexpr char access_log::file_name[];
+
+uint64_t path_hash(const char *path, size_t length) noexcept
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i != length; ++i)
+	{
+		hash ^= static_cast<unsigned char>(path[i]);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+access_log &access_log::instance()
+{
+	static access_log *object = new access_log;
+	return *object;
+}
+
+bool access_log::open(const char *name) noexcept
+{
+	int descriptor = ::open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (descriptor == -1)
+	{
+		LOG_CERROR("failed to open the access log, requests will not be logged");
+		return false;
+	}
+
+	struct stat statbuf;
+	if (fstat(descriptor, &statbuf) == -1)
+	{
+		LOG_CERROR("failed to stat the access log, requests will not be logged");
+		close(descriptor);
+		return false;
+	}
+
+	if (statbuf.st_size == 0)
+	{
+		access_log_header header;
+		memcpy(header.magic, access_log_magic, sizeof(header.magic));
+		header.version = access_log_version;
+		header.entry_size = sizeof(access_log_entry);
+		header.reserved = 0;
+
+		if (write(descriptor, &header, sizeof(header)) != sizeof(header))
+		{
+			LOG_CERROR("failed to write header of the access log, requests will not be logged");
+			close(descriptor);
+			return false;
+		}
+	}
+
+	fd = descriptor;
+	async_logger::instance().add_flush_hook(&access_log::write_stale_batches);
+	return true;
+}
+
+void access_log::write_batch(batch &pending) noexcept
+{
+	if (!pending.count)
+		return;
+
+	const char *data = reinterpret_cast<const char *>(pending.entries);
+	size_t size = pending.count * sizeof(access_log_entry);
+	pending.count = 0;
+
+	while (size)
+	{
+		ssize_t written = write(fd, data, size);
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_CERROR("failed to write a batch of the access log, its entries are lost");
+			return;
+		}
+		data += written;
+		size -= written;
+	}
+}
+
+access_log::batch::batch()
+{
+	access_log &log = access_log::instance();
+	std::lock_guard<std::mutex> lock(log.batches_mutex);
+	log.batches.push_back(this);
+}
+
+access_log::batch::~batch()
+{
+	access_log &log = access_log::instance();
+	{
+		std::lock_guard<std::mutex> lock(log.batches_mutex);
+		log.batches.erase(std::find(log.batches.begin(), log.batches.end(), this));
+	}
+	log.write_batch(*this);
+}
+
+void access_log::write_stale_batches(bool last_round) noexcept
+{
+	// a thread gone quiet would otherwise hold its entries until it logs again, and lose them on exit
+	access_log &log = access_log::instance();
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(log.batches_mutex);
+	for (batch *pending: log.batches)
+	{
+		std::lock_guard<std::mutex> batch_lock(pending->mutex);
+		if (pending->count && (last_round || now - pending->first_at > max_batch_age))
+			log.write_batch(*pending);
+	}
+}
+
+void access_log::append(const access_log_entry &entry) noexcept
+{
+	if (fd == -1)
+		return;
+
+	static thread_local batch pending;
+	std::lock_guard<std::mutex> lock(pending.mutex);
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (!pending.count)
+		pending.first_at = now;
+
+	pending.entries[pending.count++] = entry;
+
+	if (pending.count == batch_entries || now - pending.first_at > max_batch_age)
+		write_batch(pending);
+}
@@ -0,0 +1,93 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+enum class access_phase : size_t
+{
+	receive = 0,		// from accept to the received request
+	parse = 1,		// parsing of the request
+	open = 2,		// open of the file and its metadata
+	send = 3		// status line, headers and body
+};
+
+constexpr size_t access_phases_count = 4;
+
+struct access_log_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t reserved;
+};
+
+struct access_log_entry
+{
+	uint64_t timestamp_ns;				// realtime, when the response was finished
+	uint64_t path_hash;				// FNV-1a of the requested address
+	uint64_t bytes_sent;
+	uint8_t address[16];				// IPv4 addresses take the first four bytes
+	uint16_t port;
+	uint16_t status;
+	uint8_t family;					// AF_INET or AF_INET6
+	uint8_t reserved[3];
+	uint32_t phase_us[access_phases_count];
+};
+
+static_assert(sizeof(access_log_header) == 16, "access log header must stay 16 bytes");
+static_assert(sizeof(access_log_entry) == 64, "access log entries must stay 64 bytes");
+
+constexpr char access_log_magic[4] = { 'F', 'A', 'C', 'L' };
+constexpr uint32_t access_log_version = 1;
+
+uint64_t path_hash(const char *path, size_t length) noexcept;
+
+class access_log final
+{
+private:
+	static constexpr size_t batch_entries = 256;
+	static constexpr std::chrono::seconds max_batch_age{ 1 };
+
+	struct batch
+	{
+		// filled by the owning thread, written out by it when full or at thread exit, and by the flusher
+		// of async_logger when stale or at process exit, hence the mutex
+		std::mutex mutex;
+		access_log_entry entries[batch_entries];
+		size_t count = 0;
+		std::chrono::steady_clock::time_point first_at;
+		batch();
+		~batch();
+	};
+
+	int fd = -1;
+
+	std::mutex batches_mutex;
+	std::vector<batch *> batches;		// of every living thread that logged a request
+
+	access_log() = default;
+
+	void write_batch(batch &pending) noexcept;
+	static void write_stale_batches(bool last_round) noexcept;
+public:
+	static constexpr char file_name[] = "the_server_access.bin";
+
+	static access_log &instance();
+	access_log(const access_log &) = delete;
+	access_log &operator=(const access_log &) = delete;
+
+	bool open(const char *name) noexcept;
+
+	bool enabled() const noexcept
+	{
+		return (fd != -1);
+	}
+
+	void append(const access_log_entry &entry) noexcept;
+};
+
+#endif
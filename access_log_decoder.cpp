@@ -0,0 +1,120 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <iostream>
+#include <fstream>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <boost/program_options.hpp>
+
+#include "access_log.h"
+
+namespace
+{
+	std::string format_address(const access_log_entry &entry)
+	{
+		char text[INET6_ADDRSTRLEN] = { 0 };
+		if (!inet_ntop(entry.family == AF_INET6 ? AF_INET6 : AF_INET, entry.address, text, sizeof(text)))
+			return "-";
+		return text;
+	}
+
+	std::string format_timestamp(uint64_t timestamp_ns)
+	{
+		time_t seconds = timestamp_ns / 1000000000ull;
+		struct tm utc;
+		gmtime_r(&seconds, &utc);
+
+		char text[64];
+		size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+		snprintf(text + length, sizeof(text) - length, ".%06lluZ",
+				static_cast<unsigned long long>(timestamp_ns % 1000000000ull / 1000));
+		return text;
+	}
+
+	void print_entry(const access_log_entry &entry, bool csv)
+	{
+		char hash[17];
+		snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(entry.path_hash));
+
+		const uint32_t *phases = entry.phase_us;
+		if (csv)
+		{
+			std::cout << format_timestamp(entry.timestamp_ns) << ',' << format_address(entry) << ',' << entry.port
+				<< ',' << hash << ',' << entry.status << ',' << entry.bytes_sent
+				<< ',' << phases[0] << ',' << phases[1] << ',' << phases[2] << ',' << phases[3] << '\n';
+		}
+		else
+		{
+			std::cout << format_timestamp(entry.timestamp_ns) << ' ' << format_address(entry) << ':' << entry.port
+				<< " path#" << hash << ' ' << entry.status << ' ' << entry.bytes_sent << " bytes"
+				<< " receive " << phases[0] << "us parse " << phases[1] << "us open " << phases[2]
+				<< "us send " << phases[3] << "us\n";
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string path;
+	bool csv = false;
+
+	try
+	{
+		boost::program_options::options_description options("Decodes the binary access log of the server");
+		options.add_options()
+			("file,f", boost::program_options::value<std::string>(&path)->default_value(access_log::file_name),
+				"Access log to decode")
+			("csv,c", boost::program_options::bool_switch(&csv), "Print CSV instead of text lines");
+
+		boost::program_options::positional_options_description positional;
+		positional.add("file", 1);
+
+		boost::program_options::variables_map map;
+		boost::program_options::store(boost::program_options::command_line_parser(argc, argv)
+				.options(options).positional(positional).run(), map);
+		boost::program_options::notify(map);
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Command-line arguments error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	std::ifstream log{ path, std::ios::binary };
+	if (!log)
+	{
+		std::cerr << "Failed to open " << path << "\n";
+		return EXIT_FAILURE;
+	}
+
+	access_log_header header;
+	if (!log.read(reinterpret_cast<char *>(&header), sizeof(header))
+			|| memcmp(header.magic, access_log_magic, sizeof(header.magic)) != 0)
+	{
+		std::cerr << path << " is not an access log of the server\n";
+		return EXIT_FAILURE;
+	}
+	if (header.version != access_log_version || header.entry_size != sizeof(access_log_entry))
+	{
+		std::cerr << path << " has version " << header.version << " with " << header.entry_size
+			<< " bytes per entry, this decoder reads version " << access_log_version << "\n";
+		return EXIT_FAILURE;
+	}
+
+	if (csv)
+		std::cout << "timestamp,client,port,path_hash,status,bytes,receive_us,parse_us,open_us,send_us\n";
+
+	access_log_entry entry;
+	while (log.read(reinterpret_cast<char *>(&entry), sizeof(entry)))
+		print_entry(entry, csv);
+
+	if (log.gcount() != 0)
+		std::cerr << "Trailing " << log.gcount() << " bytes of a partial entry are ignored\n";
+
+	return EXIT_SUCCESS;
+}
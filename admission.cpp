@@ -0,0 +1,109 @@
+#include <cerrno>
+#include <algorithm>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "logging.h"
+#include "statistics.h"
+
+constexpr int admission_control::recheck_interval_ms;
+constexpr size_t admission_control::reserved_descriptors;
+constexpr char admission_control::rejection[];
+
+namespace
+{
+	size_t derived_connections_limit(size_t limit_of_file_descriptors) noexcept
+	{
+		// a connection may hold its socket and the file it sends
+		if (limit_of_file_descriptors <= 2 * admission_control::reserved_descriptors)
+			return limit_of_file_descriptors ? limit_of_file_descriptors / 2 : 512;
+		return (limit_of_file_descriptors - admission_control::reserved_descriptors) / 2;
+	}
+}
+
+admission_control::admission_control(size_t limit_of_file_descriptors, size_t max_connections, size_t max_queued,
+		size_t resume_percent) noexcept :
+	connections_high{ max_connections ? max_connections : derived_connections_limit(limit_of_file_descriptors) },
+	connections_low{ connections_high * std::min<size_t>(resume_percent, 100) / 100 },
+	queued_high{ max_queued },
+	queued_low{ max_queued * std::min<size_t>(resume_percent, 100) / 100 }
+{
+	open_reserve();
+}
+
+admission_control::~admission_control()
+{
+	if (reserve_fd != -1)
+		close(reserve_fd);
+}
+
+void admission_control::open_reserve() noexcept
+{
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (reserve_fd == -1)
+	{
+		LOG_CERROR("failed to open the reserve descriptor, connections over the descriptor limit stay pending");
+	}
+}
+
+bool admission_control::overloaded(size_t live_connections, size_t queued_tasks) noexcept
+{
+	if (!shedding && (live_connections >= connections_high || (queued_high && queued_tasks >= queued_high)))
+	{
+		shedding = true;
+		std::clog << "Overloaded with " << live_connections << " connections and " << queued_tasks
+			<< " queued tasks, shedding new connections" << std::endl;
+	}
+	else if (shedding && live_connections <= connections_low && (!queued_high || queued_tasks <= queued_low))
+	{
+		shedding = false;
+		std::clog << "Load is down to " << live_connections << " connections and " << queued_tasks
+			<< " queued tasks, accepting again" << std::endl;
+	}
+	return shedding;
+}
+
+bool admission_control::reject_one(int master_socket) noexcept
+{
+	int fd = accept4(master_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1 && (errno == EMFILE || errno == ENFILE) && reserve_fd != -1)
+	{
+		// out of descriptors: the reserve one makes room for this accept alone
+		close(reserve_fd);
+		reserve_fd = -1;
+		fd = accept4(master_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+			open_reserve();
+	}
+	if (fd == -1)
+		return false;
+
+	// whatever of the request has arrived is read, so the close is less likely to reset the 503 away
+	char discarded[1024];
+	if (recv(fd, discarded, sizeof(discarded), MSG_DONTWAIT) == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		close(fd);
+	}
+	else
+	{
+		send(fd, rejection, sizeof(rejection) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(fd);
+	}
+	count_statistic(statistic::connections_shed);
+
+	if (reserve_fd == -1)
+		open_reserve();
+	return true;
+}
+
+size_t admission_control::reject_pending(int master_socket, size_t at_most) noexcept
+{
+	size_t rejected = 0;
+	while (rejected < at_most && reject_one(master_socket))
+		++rejected;
+	return rejected;
+}
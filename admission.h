@@ -0,0 +1,49 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <cstddef>
+
+class admission_control final
+{
+	// consulted by the accepting thread before every accept: above the high watermark of live connections or
+	// queued tasks new connections are shed, until both are back below the low one
+public:
+	static constexpr int recheck_interval_ms = 10;		// of the paused listener
+	static constexpr size_t reserved_descriptors = 64;	// for listeners, logs, inotify and popen
+
+	// the whole response to a shed connection, sent without reading the request
+	static constexpr char rejection[] = "HTTP/1.0 503 Service Unavailable\r\nServer: Bolbot-CPPserver/10.0\r\n"
+		"Retry-After: 1\r\nContent-Length: 0\r\n\r\n";
+private:
+	const size_t connections_high;
+	const size_t connections_low;
+	const size_t queued_high;			// 0 for no limit of the queue
+	const size_t queued_low;
+	bool shedding = false;
+	int reserve_fd = -1;				// given up for an accept when the process is out of descriptors
+
+	void open_reserve() noexcept;
+	bool reject_one(int master_socket) noexcept;
+public:
+	// connection and queue limits of 0 are derived from the descriptor limit and left off respectively
+	admission_control(size_t limit_of_file_descriptors, size_t max_connections, size_t max_queued,
+			size_t resume_percent) noexcept;
+	~admission_control();
+
+	admission_control(const admission_control &) = delete;
+	admission_control &operator=(const admission_control &) = delete;
+
+	size_t get_connections_high() const noexcept
+	{
+		return connections_high;
+	}
+
+	// with hysteresis; the transitions are logged, not every shed connection
+	bool overloaded(size_t live_connections, size_t queued_tasks) noexcept;
+
+	// accepts pending connections, at most the given number, and answers each with the prebuilt 503;
+	// the reserve descriptor lets it do so even when accept fails for lack of descriptors
+	size_t reject_pending(int master_socket, size_t at_most) noexcept;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <new>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+class arena final
+{
+	// bump allocator for one request and its response: nothing is freed before reset, and the blocks taken
+	// beyond the inline one are kept for the next request, so a connection in steady state never calls malloc
+public:
+	static constexpr size_t inline_size = 4096;
+	static constexpr size_t block_size = 16384;
+private:
+	struct block
+	{
+		block *next;
+		size_t size;			// usable bytes after the header
+	};
+
+	alignas(std::max_align_t) char inline_block[inline_size];
+	char *position = inline_block;
+	char *end = inline_block + inline_size;
+	block *blocks = nullptr;		// every block taken so far, kept in the order they are used
+	block *current = nullptr;		// the block of position, nullptr for the inline one
+
+	void *allocate_in_next_block(size_t size, size_t alignment)
+	{
+		// a kept block too small for this allocation is skipped until the next reset
+		block *&link = current ? current->next : blocks;
+		block *candidate = link;
+		while (candidate && candidate->size < size + alignment)
+			candidate = candidate->next;
+
+		if (!candidate)
+		{
+			size_t bytes = sizeof(block) + size + alignment;
+			if (bytes < block_size)
+				bytes = block_size;
+			candidate = static_cast<block *>(::operator new(bytes));
+			candidate->size = bytes - sizeof(block);
+			candidate->next = link;
+			link = candidate;
+		}
+
+		current = candidate;
+		position = reinterpret_cast<char *>(candidate + 1);
+		end = position + candidate->size;
+		return allocate(size, alignment);
+	}
+public:
+	arena() noexcept = default;
+	arena(const arena &) = delete;
+	arena &operator=(const arena &) = delete;
+
+	~arena()
+	{
+		while (blocks)
+		{
+			block *next = blocks->next;
+			::operator delete(blocks);
+			blocks = next;
+		}
+	}
+
+	void *allocate(size_t size, size_t alignment)
+	{
+		uintptr_t aligned = (reinterpret_cast<uintptr_t>(position) + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+		if (aligned + size > reinterpret_cast<uintptr_t>(end))
+			return allocate_in_next_block(size, alignment);
+		position = reinterpret_cast<char *>(aligned + size);
+		return reinterpret_cast<void *>(aligned);
+	}
+
+	// everything allocated so far is dead: the strings and vectors using it must be gone or never read again
+	void reset() noexcept
+	{
+		position = inline_block;
+		end = inline_block + inline_size;
+		current = nullptr;
+	}
+};
+
+template <typename T>
+class arena_allocator
+{
+	// deallocate is a no-op, the memory comes back on the reset of the arena
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	arena *memory;
+
+	explicit arena_allocator(arena &owner) noexcept : memory{ &owner }
+	{}
+
+	template <typename U>
+	arena_allocator(const arena_allocator<U> &other) noexcept : memory{ other.memory }
+	{}
+
+	T *allocate(size_t count)
+	{
+		return static_cast<T *>(memory->allocate(count * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *, size_t) noexcept
+	{}
+
+	template <typename U>
+	bool operator==(const arena_allocator<U> &other) const noexcept
+	{
+		return memory == other.memory;
+	}
+
+	template <typename U>
+	bool operator!=(const arena_allocator<U> &other) const noexcept
+	{
+		return memory != other.memory;
+	}
+};
+
+using arena_string = std::basic_string<char, std::char_traits<char>, arena_allocator<char>>;
+
+template <typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+
+#endif
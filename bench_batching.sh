@@ -0,0 +1,29 @@
+#!/bin/sh
+# burst of 10k connections per second against the server, with accept and dequeue batching off and at the defaults
+# usage: ./bench_batching.sh BUILD_DIRECTORY [SECONDS]
+build=$(cd "${1:-.}" && pwd) || exit 1
+seconds=${2:-10}
+directory=$(mktemp -d) || exit 1
+trap 'rm -rf "$directory"' EXIT
+echo '<html>batching</html>' > "$directory/index.html"
+
+for batching in "--accept-batch 1 --dequeue-batch 1" ""
+do
+	echo "server options: ${batching:-defaults}"
+	rm -f "$directory"/*.log
+	# the server daemonizes, its pid is only known from its log
+	(cd "$directory" && exec "$build/final" -h 127.0.0.1 -p 12345 -d "$directory" $batching)
+	sleep 1
+	pid=$(sed -n 's/^Master process id //p' "$directory"/*.log | head -n 1)
+	if [ -z "$pid" ]
+	then
+		echo "the server did not start" >&2
+		exit 1
+	fi
+	"$build/final_bench" -h 127.0.0.1 -p 12345 -t 2 -c 64 -r 10000 -d "$seconds"
+	kill "$pid"
+	while kill -0 "$pid" 2>/dev/null
+	do
+		sleep 0.1
+	done
+done
@@ -0,0 +1,197 @@
+#include <ctime>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "compression_cache.h"
+#include "statistics.h"
+
+constexpr size_t compression_cache::entry_overhead;
+constexpr char compression_cache::encoding[];
+
+bool is_compressible(const std::string &mime_type) noexcept
+{
+	std::string type = mime_type.substr(0, mime_type.find(';'));
+	return type.compare(0, 5, "text/") == 0 || type.find("javascript") != std::string::npos
+		|| type.find("json") != std::string::npos || type.find("xml") != std::string::npos;
+}
+
+bool gzip_compress(const std::string &source, std::string &destination)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// 16 over the window bits asks zlib for the gzip header and trailer
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	destination.resize(deflateBound(&stream, source.size()));
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(source.data()));
+	stream.avail_in = source.size();
+	stream.next_out = reinterpret_cast<Bytef *>(&destination[0]);
+	stream.avail_out = destination.size();
+
+	int result = deflate(&stream, Z_FINISH);
+	destination.resize(stream.total_out);
+	deflateEnd(&stream);
+	return result == Z_STREAM_END;
+}
+
+compression_cache::compression_cache(size_t capacity_bytes) noexcept : capacity{ capacity_bytes }
+{}
+
+compression_cache &compression_cache::instance()
+{
+	static compression_cache *object = new compression_cache(server_compression_cache_mb << 20);
+	return *object;
+}
+
+std::string compression_cache::key_of(const std::string &path, const file_metadata &original)
+{
+	std::string key = path;
+	key += '\0';
+	key += original.etag;
+	key += '\0';
+	key += encoding;
+	return key;
+}
+
+bool compression_cache::applies(const file_metadata &original) const noexcept
+{
+	return enabled() && original.size >= server_compression_min_size && original.size <= capacity / 4
+		&& is_compressible(original.mime_type);
+}
+
+std::shared_ptr<const compressed_variant> compression_cache::find(const std::string &path, const file_metadata &original)
+{
+	std::string key = key_of(path, original);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = entries.find(key);
+	if (found == entries.end())
+		return nullptr;
+
+	recency.splice(recency.begin(), recency, found->second);
+	return found->second->variant;
+}
+
+void compression_cache::store_locked(std::string key, std::shared_ptr<const compressed_variant> variant)
+{
+	size_t cost = key.size() + variant->data.size() + entry_overhead;
+
+	auto found = entries.find(key);
+	if (found != entries.end())
+	{
+		used -= found->second->cost;
+		recency.erase(found->second);
+		entries.erase(found);
+	}
+
+	// variants of older versions of a file are never looked up again and age out from the tail
+	while (!recency.empty() && used + cost > capacity)
+	{
+		used -= recency.back().cost;
+		entries.erase(recency.back().key);
+		recency.pop_back();
+	}
+
+	recency.push_front(entry{ key, std::move(variant), cost });
+	entries.emplace(std::move(key), recency.begin());
+	used += cost;
+}
+
+std::shared_ptr<const compressed_variant> compression_cache::compress(const std::string &path, const file_metadata &original)
+{
+	std::string key = key_of(path, original);
+	std::promise<std::shared_ptr<const compressed_variant>> promise;
+	std::shared_future<std::shared_ptr<const compressed_variant>> pending;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = entries.find(key);
+		if (found != entries.end())
+			return found->second->variant;
+
+		auto compressed = compressing.find(key);
+		if (compressed != compressing.end())
+			pending = compressed->second;
+		else
+			compressing.emplace(key, promise.get_future().share());
+	}
+
+	if (pending.valid())
+	{
+		// the key holds the ETag, so the result is of the very same version of the file
+		std::shared_ptr<const compressed_variant> variant = pending.get();
+		count_statistic(statistic::compression_coalesced);
+		return variant;
+	}
+
+	std::shared_ptr<const compressed_variant> variant;
+	try
+	{
+		variant = load(path, original);
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		compressing.erase(key);
+		promise.set_exception(std::current_exception());
+		throw;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (variant)
+			store_locked(key, variant);
+		compressing.erase(key);
+	}
+	promise.set_value(variant);
+	return variant;
+}
+
+std::shared_ptr<const compressed_variant> compression_cache::load(const std::string &path, const file_metadata &original)
+{
+	open_file file(path.data());
+	if (!file)
+		return nullptr;
+
+	// the path may name another file by now, or the file may be written meanwhile: only the version of
+	// original is compressed, any other would be cached and served under its ETag
+	struct stat statbuf;
+	if (fstat(file, &statbuf) == -1 || !file_metadata_cache::matches(original, statbuf))
+		return nullptr;
+
+	std::string source(original.size, '\0');
+	size_t done = 0;
+	while (done < source.size())
+	{
+		ssize_t got = pread(file, &source[done], source.size() - done, done);
+		if (got <= 0)
+			break;
+		done += got;
+	}
+	if (done != source.size() || fstat(file, &statbuf) == -1 || !file_metadata_cache::matches(original, statbuf))
+		return nullptr;
+
+	struct timespec cpu_started, cpu_finished;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_started);
+
+	std::shared_ptr<compressed_variant> variant = std::make_shared<compressed_variant>();
+	variant->metadata = original;
+	variant->original_size = original.size;
+
+	std::string compressed;
+	if (gzip_compress(source, compressed) && compressed.size() < source.size())
+	{
+		variant->data = std::move(compressed);
+		variant->metadata.size = variant->data.size();
+		variant->metadata.content_encoding = encoding;
+		// the compressed bytes are another representation and need their own strong ETag
+		variant->metadata.etag.insert(variant->metadata.etag.size() - 1, std::string("-") + encoding);
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_finished);
+	count_statistic(statistic::compressions);
+	count_statistic(statistic::compression_cpu_us, (cpu_finished.tv_sec - cpu_started.tv_sec) * 1000000
+			+ (cpu_finished.tv_nsec - cpu_started.tv_nsec) / 1000);
+	return variant;
+}
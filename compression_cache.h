@@ -0,0 +1,73 @@
+#ifndef __COMPRESSION_CACHE_H__
+#define __COMPRESSION_CACHE_H__
+
+#include <list>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "file_wrapper.h"
+
+struct compressed_variant
+{
+	file_metadata metadata;			// of the compressed bytes, with the MIME type and Last-Modified of the original
+	size_t original_size;
+	std::string data;			// empty when compression did not pay off, the original is then sent as is
+};
+
+// text, JavaScript, JSON, XML and SVG; images, archives and media are compressed already
+bool is_compressible(const std::string &mime_type) noexcept;
+
+// gzip format of the whole source, false when zlib fails
+bool gzip_compress(const std::string &source, std::string &destination);
+
+class compression_cache final
+{
+	// keyed by path, ETag (inode, size and mtime) and encoding; least recently used variants go above the memory cap
+private:
+	static constexpr size_t entry_overhead = 256;
+	static constexpr char encoding[] = "gzip";
+
+	struct entry
+	{
+		std::string key;
+		std::shared_ptr<const compressed_variant> variant;
+		size_t cost;
+	};
+
+	std::mutex mutex;
+	std::list<entry> recency;			// most recently used first
+	std::unordered_map<std::string, std::list<entry>::iterator> entries;
+	// single flight: concurrent misses of one variant wait for a single compression
+	std::unordered_map<std::string, std::shared_future<std::shared_ptr<const compressed_variant>>> compressing;
+	const size_t capacity;
+	size_t used = 0;
+
+	explicit compression_cache(size_t capacity_bytes) noexcept;
+
+	static std::string key_of(const std::string &path, const file_metadata &original);
+	void store_locked(std::string key, std::shared_ptr<const compressed_variant> variant);
+	std::shared_ptr<const compressed_variant> load(const std::string &path, const file_metadata &original);
+public:
+	static compression_cache &instance();
+	compression_cache(const compression_cache &) = delete;
+	compression_cache &operator=(const compression_cache &) = delete;
+
+	bool enabled() const noexcept
+	{
+		return capacity != 0;
+	}
+
+	// compressible, not smaller than the threshold and small enough to leave room for other variants
+	bool applies(const file_metadata &original) const noexcept;
+
+	std::shared_ptr<const compressed_variant> find(const std::string &path, const file_metadata &original);
+
+	// reads and compresses the file, counting the CPU time, unless another thread is at it already;
+	// nullptr when the file no longer matches original
+	std::shared_ptr<const compressed_variant> compress(const std::string &path, const file_metadata &original);
+};
+
+#endif
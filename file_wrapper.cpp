@@ -1,19 +1,22 @@
+#include <algorithm>
+#include <cstring>
+
 #include "file_wrapper.h"
+#include "statistics.h"
 
 void checked_pclose(FILE *closable) noexcept
 {
+	int descriptor = fileno(closable);
+
 	if (pclose(closable) == -1)
 	{
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
 			LOG_CERROR("failed to pclose the popened file");
 		}
 
-		int descriptor = fileno(closable);
 		if (descriptor != -1)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "File with descriptor " << descriptor << " wasn't pclosed in proper way.\n";
+			log_record{} << "File with descriptor " << descriptor << " wasn't pclosed in proper way.\n";
 		}
 	}
 }
@@ -29,7 +32,6 @@ std::string popen_reader(const char *command)
 	if (!source)
 	{
 		checked_pclose(source);
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("failed to popen the file");
 		return std::string{};
 	}
@@ -41,7 +43,6 @@ std::string popen_reader(const char *command)
 	if (!fgets(buffer, buffer_size, source/*.get()*/))
 	{
 		checked_pclose(source);
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("fgets failed so popen_reader returns \"\" (empty result)");
 		return std::string{};
 	}
@@ -50,3 +51,217 @@ std::string popen_reader(const char *command)
 
 	return std::string{ buffer };
 }
+
+constexpr size_t file_metadata_cache::shards_count;
+
+namespace
+{
+	// kept in sibling_lookups for a sibling looked for and not found
+	const std::shared_ptr<const file_metadata> &missing_sibling()
+	{
+		static std::shared_ptr<const file_metadata> *object =
+			new std::shared_ptr<const file_metadata>(std::make_shared<file_metadata>());
+		return *object;
+	}
+}
+
+file_metadata_cache::file_metadata_cache(size_t capacity) noexcept :
+	entries_per_shard{ std::max<size_t>(capacity / shards_count, 1) }
+{}
+
+file_metadata_cache &file_metadata_cache::instance()
+{
+	static file_metadata_cache *object = new file_metadata_cache(server_metadata_cache_entries);
+	return *object;
+}
+
+void file_metadata_cache::describe(file_metadata &metadata, const struct stat &statbuf)
+{
+	metadata.device = statbuf.st_dev;
+	metadata.inode = statbuf.st_ino;
+	metadata.size = statbuf.st_size;
+	metadata.modified = statbuf.st_mtim;
+
+	metadata.last_modified = time_t_to_string(statbuf.st_mtim.tv_sec);
+
+	char etag[64];
+	snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", static_cast<unsigned long long>(statbuf.st_ino),
+			static_cast<unsigned long long>(statbuf.st_size),
+			static_cast<unsigned long long>(statbuf.st_mtim.tv_sec) * 1000000000ull + statbuf.st_mtim.tv_nsec);
+	metadata.etag = etag;
+}
+
+bool file_metadata_cache::matches(const file_metadata &metadata, const struct stat &statbuf) noexcept
+{
+	return metadata.inode == statbuf.st_ino && metadata.device == statbuf.st_dev
+		&& metadata.size == static_cast<size_t>(statbuf.st_size)
+		&& metadata.modified.tv_sec == statbuf.st_mtim.tv_sec && metadata.modified.tv_nsec == statbuf.st_mtim.tv_nsec;
+}
+
+std::shared_ptr<const file_metadata> file_metadata_cache::load(const char *path, const struct stat &statbuf)
+{
+	std::shared_ptr<file_metadata> metadata = std::make_shared<file_metadata>();
+	describe(*metadata, statbuf);
+
+	std::string command = "file ";
+	command += path;
+	command += " --brief --mime";
+	metadata->mime_type = popen_reader(command.data());
+	if (!metadata->mime_type.empty() && metadata->mime_type.back() == '\n')
+	{
+		metadata->mime_type.pop_back();
+	}
+
+	return metadata;
+}
+
+std::shared_ptr<const file_metadata> file_metadata_cache::find_locked(shard &owner, const std::string &path,
+		const struct stat &statbuf)
+{
+	auto found = owner.entries.find(path);
+	if (found == owner.entries.end() || !matches(*found->second, statbuf))
+		return nullptr;
+
+	count_statistic(statistic::metadata_hits);
+	return found->second;
+}
+
+void file_metadata_cache::store_locked(shard &owner, const std::string &path, std::shared_ptr<const file_metadata> loaded)
+{
+	if (owner.entries.size() >= entries_per_shard && !owner.entries.count(path))
+	{
+		owner.entries.erase(owner.entries.begin());
+	}
+	owner.entries[path] = std::move(loaded);
+}
+
+std::shared_ptr<const file_metadata> file_metadata_cache::lookup(const std::string &path)
+{
+	struct stat statbuf;
+	if (stat(path.data(), &statbuf) == -1 || !S_ISREG(statbuf.st_mode))
+	{
+		return nullptr;
+	}
+	return lookup(path, statbuf);
+}
+
+std::shared_ptr<const file_metadata> file_metadata_cache::lookup(const char *path)
+{
+	struct stat statbuf;
+	if (stat(path, &statbuf) == -1 || !S_ISREG(statbuf.st_mode))
+	{
+		return nullptr;
+	}
+
+	return lookup(reused_key(path, strlen(path)), statbuf);
+}
+
+std::shared_ptr<const file_metadata> file_metadata_cache::lookup(const std::string &path, const struct stat &statbuf)
+{
+	shard &owner = shards[std::hash<std::string>{}(path) % shards_count];
+	// made by the leader only: the shared state of a promise is allocated, a hit must not pay for it
+	std::unique_ptr<std::promise<std::shared_ptr<const file_metadata>>> promise;
+	pending_load pending;
+	bool leading = false;
+	{
+		std::lock_guard<std::mutex> lock(owner.mutex);
+		std::shared_ptr<const file_metadata> cached = find_locked(owner, path, statbuf);
+		if (cached)
+			return cached;
+
+		auto loading = owner.loading.find(path);
+		if (loading != owner.loading.end())
+		{
+			pending = loading->second;
+		}
+		else
+		{
+			promise.reset(new std::promise<std::shared_ptr<const file_metadata>>);
+			pending = promise->get_future().share();
+			owner.loading.emplace(path, pending);
+			leading = true;
+		}
+	}
+
+	if (!leading)
+	{
+		// another thread is loading the same path; its result does only if the file has not changed since
+		std::shared_ptr<const file_metadata> loaded = pending.get();
+		if (loaded && matches(*loaded, statbuf))
+		{
+			count_statistic(statistic::metadata_coalesced);
+			return loaded;
+		}
+	}
+
+	// loaded outside the lock, the popen of file takes milliseconds
+	count_statistic(statistic::metadata_misses);
+	std::shared_ptr<const file_metadata> loaded;
+	try
+	{
+		loaded = load(path.data(), statbuf);
+	}
+	catch (...)
+	{
+		if (leading)
+		{
+			std::lock_guard<std::mutex> lock(owner.mutex);
+			owner.loading.erase(path);
+			promise->set_exception(std::current_exception());
+		}
+		throw;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(owner.mutex);
+		store_locked(owner, path, loaded);
+		if (leading)
+			owner.loading.erase(path);
+	}
+	if (leading)
+		promise->set_value(loaded);
+	return loaded;
+}
+
+std::shared_ptr<const file_metadata> file_metadata_cache::lookup_encoded(const char *path, const file_metadata &original,
+		precompressed_coding coding)
+{
+	std::shared_ptr<const file_metadata> known = std::atomic_load(&original.siblings.found[static_cast<size_t>(coding)]);
+	if (known)
+	{
+		count_statistic(statistic::metadata_hits);
+		return known == missing_sibling() ? nullptr : known;
+	}
+
+	struct stat statbuf;
+	bool found = stat(path, &statbuf) == 0;
+	return lookup_encoded(found ? &statbuf : nullptr, original, coding);
+}
+
+std::shared_ptr<const file_metadata> file_metadata_cache::lookup_encoded(const struct stat *statbuf,
+		const file_metadata &original, precompressed_coding coding)
+{
+	std::shared_ptr<const file_metadata> &slot = original.siblings.found[static_cast<size_t>(coding)];
+	std::shared_ptr<const file_metadata> known = std::atomic_load(&slot);
+	if (!statbuf || !S_ISREG(statbuf->st_mode))
+	{
+		if (known != missing_sibling())
+			std::atomic_store(&slot, missing_sibling());
+		return nullptr;
+	}
+	if (known && known != missing_sibling() && matches(*known, *statbuf))
+	{
+		count_statistic(statistic::metadata_hits);
+		return known;
+	}
+
+	// described from the stat alone, too cheap to be worth a single flight
+	count_statistic(statistic::metadata_misses);
+	std::shared_ptr<file_metadata> loaded = std::make_shared<file_metadata>();
+	describe(*loaded, *statbuf);
+	loaded->mime_type = original.mime_type;
+	loaded->content_encoding = coding == precompressed_coding::brotli ? "br" : "gzip";
+	std::shared_ptr<const file_metadata> described = std::move(loaded);
+	std::atomic_store(&slot, described);
+	return described;
+}
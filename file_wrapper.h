@@ -3,6 +3,9 @@
 
 #include <string>
 #include <memory>
+#include <mutex>
+#include <future>
+#include <unordered_map>
 
 #include <cstdio>
 #include <sys/types.h>
@@ -16,87 +19,140 @@ void checked_pclose(FILE *closable) noexcept;
 
 std::string popen_reader(const char *command);
 
-class open_file final
+enum class precompressed_coding : size_t
 {
-private:
-	std::string address;
-	int fd;
+	brotli = 0,
+	gzip = 1
+};
+
+constexpr size_t precompressed_codings_count = 2;
+
+struct file_metadata;
+
+struct sibling_lookups
+{
+	// precompressed siblings of one version of a file, by precompressed_coding: nullptr until looked up, then the
+	// sibling or the missing marker; accessed with std::atomic_*, a copy starts empty as it is of another entry
+	mutable std::shared_ptr<const file_metadata> found[precompressed_codings_count];
 
-	class file_properties
+	sibling_lookups() noexcept = default;
+	sibling_lookups(const sibling_lookups &) noexcept
+	{}
+	sibling_lookups &operator=(const sibling_lookups &) noexcept
 	{
-	private:
-		size_t size;
-		std::string mime_type;
-		std::string last_modified;
-	public:
-		file_properties(const char *path)
-		{
-			struct stat statbuf;
-			if (stat(path, &statbuf) == -1)
-			{
-				std::lock_guard<std::mutex> lock(cerr_mutex);
-				LOG_CERROR("error of stat, file_properties will remain empty values");
-				return;
-			}
+		return *this;
+	}
+};
 
-			size = statbuf.st_size;
+struct file_metadata
+{
+	dev_t device;
+	ino_t inode;
+	size_t size;
+	struct timespec modified;
+	std::string mime_type;
+	std::string last_modified;
+	std::string etag;				// strong, from inode, size and mtime
+	std::string content_encoding;			// only for a precompressed sibling, which keeps the MIME type of the original
+	sibling_lookups siblings;			// so a version of the file looks for each of its siblings once
+};
 
-			std::string command = "file ";
-			command += path;
-			command += " --brief --mime";
-			mime_type = popen_reader(command.data());
-			if (mime_type.back() == '\n')
-			{
-				mime_type.pop_back();
-			}
+class file_metadata_cache final
+{
+	// every lookup stats the path; the popen of file and the formatting run only when inode, size or mtime change
+private:
+	static constexpr size_t shards_count = 16;
 
-			time_t last_modified_seconds_since_epoch = statbuf.st_mtim.tv_sec;
-			last_modified = time_t_to_string(last_modified_seconds_since_epoch);
-		}
+	using pending_load = std::shared_future<std::shared_ptr<const file_metadata>>;
 
-		size_t get_size() const noexcept
-		{
-			return size;
-		}
-		std::string get_mime_type() const
-		{
-			return mime_type;
-		}
-		std::string get_last_modified() const
-		{
-			return last_modified;
-		}
+	struct shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string, std::shared_ptr<const file_metadata>> entries;
+		std::unordered_map<std::string, pending_load> loading;		// single flight: one load per path at a time
 	};
 
-	std::unique_ptr<file_properties> properties{ nullptr };
+	shard shards[shards_count];
+	size_t entries_per_shard;
+
+	explicit file_metadata_cache(size_t capacity) noexcept;
+
+	static void describe(file_metadata &metadata, const struct stat &statbuf);
+	static std::shared_ptr<const file_metadata> load(const char *path, const struct stat &statbuf);
+
+	std::shared_ptr<const file_metadata> find_locked(shard &owner, const std::string &path, const struct stat &statbuf);
+	void store_locked(shard &owner, const std::string &path, std::shared_ptr<const file_metadata> loaded);
+public:
+	static file_metadata_cache &instance();
+	file_metadata_cache(const file_metadata_cache &) = delete;
+
+	// whether the stat is of the very file version the metadata describes
+	static bool matches(const file_metadata &metadata, const struct stat &statbuf) noexcept;
+	file_metadata_cache &operator=(const file_metadata_cache &) = delete;
+
+	// nullptr when the path is missing or is not a regular file
+	std::shared_ptr<const file_metadata> lookup(const std::string &path);
+	std::shared_ptr<const file_metadata> lookup(const char *path);
+
+	// for a regular file stat'ed by the caller already
+	std::shared_ptr<const file_metadata> lookup(const std::string &path, const struct stat &statbuf);
+
+	// a precompressed sibling (file.br, file.gz) of original, described without the popen of file; found or not,
+	// it is kept with original and stat'ed no more, so until the original changes its sibling is assumed not to
+	std::shared_ptr<const file_metadata> lookup_encoded(const char *path, const file_metadata &original,
+			precompressed_coding coding);
+
+	// for a sibling stat'ed by the caller already, nullptr when there is none; checked against what is kept
+	std::shared_ptr<const file_metadata> lookup_encoded(const struct stat *statbuf, const file_metadata &original,
+			precompressed_coding coding);
+};
+
+class open_file final
+{
+private:
+	std::string address;
+	int fd;
+
+	std::shared_ptr<const file_metadata> properties;
 	bool get_file_properties() noexcept
 	{
 		try
 		{
-			properties.reset(new file_properties(address.data()));
+			properties = file_metadata_cache::instance().lookup(address);
 		}
 		catch (std::exception &e)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "Failed to get properties of the file "
+			log_record{} << "Failed to get properties of the file "
 				<< address << ": " << e.what() << "\n";
 			return false;
 		}
 		catch (...)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
-			std::cerr << "Unknown error while getting properties of file " << address << "\n";
+			log_record{} << "Unknown error while getting properties of file " << address << "\n";
 			return false;
 		}
-		return true;
+		return (properties != nullptr);
 	}
 public:
 	open_file(const char *path) : address{ path }, fd{ open(path, O_RDONLY) }
 	{}
 
+	// metadata already looked up for the path, so no properties are loaded after the open and the path
+	// is not kept; without metadata the path is no regular file and is not opened at all
+	open_file(const char *path, std::shared_ptr<const file_metadata> metadata) :
+		fd{ metadata ? open(path, O_RDONLY) : -1 }, properties{ std::move(metadata) }
+	{}
+
 	open_file(const open_file &) = delete;
 	open_file &operator=(const open_file &) = delete;
 
+	open_file(open_file &&other) noexcept : address{ std::move(other.address) }, fd{ other.fd },
+		properties{ std::move(other.properties) }
+	{
+		other.fd = -1;
+	}
+	open_file &operator=(open_file &&) = delete;
+
 	~open_file()
 	{
 		if (fd == -1)
@@ -105,9 +161,8 @@ public:
 		}
 		if (close(fd) == -1)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
 			LOG_CERROR("failed to close the opened file");
-			std::cerr << "File with descriptor " << fd << " wasn't properly closed.\n";
+			log_record{} << "File with descriptor " << fd << " wasn't properly closed.\n";
 		}
 	}
 
@@ -135,7 +190,7 @@ public:
 				return 0;
 			}
 		}
-		return properties->get_size();
+		return properties->size;
 	}
 
 	std::string mime_type()
@@ -152,7 +207,7 @@ public:
 				return "";
 			}
 		}
-		return properties->get_mime_type();
+		return properties->mime_type;
 	}
 
 	std::string last_modified()
@@ -169,13 +224,26 @@ public:
 				return "";
 			}
 		}
-		return properties->get_last_modified();
+		return properties->last_modified;
 	}
 
-	std::string location() const
+	std::string etag()
 	{
-		return address;
+		if (fd == -1)
+		{
+			return "";
+		}
+
+		if (!properties)
+		{
+			if (!get_file_properties())
+			{
+				return "";
+			}
+		}
+		return properties->etag;
 	}
+
 };
 
 
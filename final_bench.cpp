@@ -0,0 +1,652 @@
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <boost/program_options.hpp>
+
+#include "phase_timing.h"
+
+namespace
+{
+	struct bench_target
+	{
+		std::string path;
+		unsigned weight;
+		std::string request;
+	};
+
+	struct bench_settings
+	{
+		std::string host = "127.0.0.1";
+		std::string port = "12345";
+		unsigned threads = 2;
+		unsigned connections = 16;
+		double duration = 10;
+		double rate = 0;				// requests per second of all the connections, 0 sends as fast as answered
+		bool keep_alive = false;
+		std::vector<bench_target> targets;
+		std::string json;
+	};
+
+	struct bench_results
+	{
+		// latencies in nanoseconds, corrected ones counted from the scheduled send time
+		phase_histogram corrected;
+		phase_histogram uncorrected;
+		uint64_t completed = 0;
+		uint64_t errors = 0;
+		uint64_t connects = 0;
+		uint64_t bytes = 0;
+		uint64_t status_classes[6] = {};		// unparsable status lines land in the first one
+
+		void merge(const bench_results &other) noexcept
+		{
+			corrected.merge(other.corrected);
+			uncorrected.merge(other.uncorrected);
+			completed += other.completed;
+			errors += other.errors;
+			connects += other.connects;
+			bytes += other.bytes;
+			for (size_t i = 0; i != 6; ++i)
+				status_classes[i] += other.status_classes[i];
+		}
+	};
+
+	enum class connection_phase
+	{
+		idle,
+		connecting,
+		writing,
+		reading
+	};
+
+	struct bench_connection
+	{
+		int fd = -1;
+		connection_phase phase = connection_phase::idle;
+		const std::string *request = nullptr;
+		size_t written = 0;
+		std::string head;
+		bool head_done = false;
+		bool persistent = false;
+		int status = 0;
+		int64_t content_length = -1;
+		uint64_t received = 0;
+		int64_t scheduled_ns = 0;
+		int64_t sent_ns = 0;
+		int64_t next_due_ns = 0;
+	};
+
+	int64_t now_ns() noexcept
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	bool ascii_iequals(const std::string &text, size_t position, const char *expected)
+	{
+		for (size_t i = 0; expected[i]; ++i, ++position)
+		{
+			if (position >= text.size() || tolower(static_cast<unsigned char>(text[position])) != expected[i])
+				return false;
+		}
+		return true;
+	}
+
+	void parse_head(bench_connection &connection)
+	{
+		const std::string &head = connection.head;
+		size_t space = head.find(' ');
+		connection.status = (space == std::string::npos) ? 0 : atoi(head.data() + space + 1);
+
+		// HTTP/1.0 connections stay open only when the server says so
+		for (size_t line = head.find("\r\n"); line != std::string::npos; line = head.find("\r\n", line + 2))
+		{
+			size_t start = line + 2;
+			if (ascii_iequals(head, start, "content-length:"))
+				connection.content_length = atoll(head.data() + start + 15);
+			else if (ascii_iequals(head, start, "connection:"))
+				connection.persistent = (head.find("eep-alive", start) < head.find("\r\n", start));
+		}
+	}
+
+	class bench_worker final
+	{
+	private:
+		const bench_settings &settings;
+		const struct addrinfo &address;
+		std::vector<bench_connection> connections;
+		std::vector<unsigned> cumulative_weights;
+		std::minstd_rand random;
+		int epoll_fd = -1;
+		int64_t interval_ns = 0;
+		char buffer[65536];
+	public:
+		bench_results results;
+
+		bench_worker(const bench_settings &s, const struct addrinfo &a, size_t count, size_t first_index) :
+			settings{ s }, address{ a }, connections(count), random(static_cast<unsigned>(first_index + 1))
+		{
+			unsigned total = 0;
+			for (const bench_target &i: settings.targets)
+				cumulative_weights.push_back(total += i.weight);
+
+			if (settings.rate > 0)
+				interval_ns = static_cast<int64_t>(1e9 * settings.connections / settings.rate);
+
+			// connections of all the workers are staggered over one interval, so the load is smooth
+			int64_t started = now_ns();
+			for (size_t i = 0; i != count; ++i)
+				connections[i].next_due_ns = started + interval_ns * (first_index + i) / settings.connections;
+		}
+		bench_worker(const bench_worker &) = delete;
+		bench_worker &operator=(const bench_worker &) = delete;
+
+		~bench_worker()
+		{
+			for (bench_connection &i: connections)
+			{
+				if (i.fd != -1)
+					close(i.fd);
+			}
+			if (epoll_fd != -1)
+				close(epoll_fd);
+		}
+
+		void run(int64_t deadline_ns)
+		{
+			epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+			if (epoll_fd == -1)
+			{
+				perror("epoll_create1");
+				return;
+			}
+
+			struct epoll_event events[64];
+			int64_t now = now_ns();
+			while (now < deadline_ns)
+			{
+				int64_t next_due = deadline_ns;
+				for (bench_connection &i: connections)
+				{
+					if (i.phase != connection_phase::idle)
+						continue;
+					if (interval_ns == 0 || i.next_due_ns <= now)
+						start_request(i, now);
+					else
+						next_due = std::min(next_due, i.next_due_ns);
+				}
+
+				int timeout = static_cast<int>(std::min<int64_t>((next_due - now + 999999) / 1000000, 10));
+				int ready = epoll_wait(epoll_fd, events, 64, std::max(timeout, 0));
+				if (ready == -1 && errno != EINTR)
+				{
+					perror("epoll_wait");
+					return;
+				}
+
+				for (int i = 0; i < ready; ++i)
+					advance(*static_cast<bench_connection *>(events[i].data.ptr));
+
+				now = now_ns();
+			}
+		}
+	private:
+		void watch(bench_connection &connection, uint32_t events, int operation)
+		{
+			struct epoll_event event;
+			event.events = events;
+			event.data.ptr = &connection;
+			if (epoll_ctl(epoll_fd, operation, connection.fd, &event) == -1)
+				fail(connection);
+		}
+
+		void start_request(bench_connection &connection, int64_t now)
+		{
+			size_t choice = std::upper_bound(cumulative_weights.begin(), cumulative_weights.end(),
+					random() % cumulative_weights.back()) - cumulative_weights.begin();
+
+			connection.request = &settings.targets[choice].request;
+			connection.written = 0;
+			connection.head.clear();
+			connection.head_done = false;
+			connection.persistent = false;
+			connection.status = 0;
+			connection.content_length = -1;
+			connection.received = 0;
+			connection.scheduled_ns = interval_ns ? connection.next_due_ns : now;
+			connection.sent_ns = now;
+			connection.next_due_ns += interval_ns;
+
+			if (connection.fd != -1)
+			{
+				connection.phase = connection_phase::writing;
+				watch(connection, EPOLLOUT, EPOLL_CTL_MOD);
+				return;
+			}
+
+			connection.fd = socket(address.ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (connection.fd == -1)
+			{
+				fail(connection);
+				return;
+			}
+			int one = 1;
+			setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+			++results.connects;
+			if (connect(connection.fd, address.ai_addr, address.ai_addrlen) == -1 && errno != EINPROGRESS)
+			{
+				fail(connection);
+				return;
+			}
+			connection.phase = connection_phase::connecting;
+			watch(connection, EPOLLOUT, EPOLL_CTL_ADD);
+		}
+
+		void advance(bench_connection &connection)
+		{
+			if (connection.phase == connection_phase::connecting)
+			{
+				int error = 0;
+				socklen_t length = sizeof(error);
+				if (getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error)
+				{
+					fail(connection);
+					return;
+				}
+				connection.phase = connection_phase::writing;
+			}
+
+			if (connection.phase == connection_phase::writing)
+			{
+				const std::string &request = *connection.request;
+				ssize_t sent = send(connection.fd, request.data() + connection.written, request.size() - connection.written,
+						MSG_NOSIGNAL);
+				if (sent == -1)
+				{
+					if (errno != EAGAIN)
+						fail(connection);
+					return;
+				}
+				connection.written += sent;
+				if (connection.written != request.size())
+					return;
+
+				connection.phase = connection_phase::reading;
+				watch(connection, EPOLLIN, EPOLL_CTL_MOD);
+				return;
+			}
+
+			if (connection.phase == connection_phase::reading)
+				read_response(connection);
+		}
+
+		void read_response(bench_connection &connection)
+		{
+			while (true)
+			{
+				ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+				if (received == -1)
+				{
+					if (errno != EAGAIN)
+						fail(connection);
+					return;
+				}
+				if (received == 0)
+				{
+					// without Content-Length the body ends with the connection, error responses may even lack the blank line
+					if (!connection.head_done && connection.head.compare(0, 5, "HTTP/") == 0)
+					{
+						connection.head_done = true;
+						parse_head(connection);
+					}
+
+					if (connection.head_done && connection.content_length < 0)
+						complete(connection, false);
+					else
+						fail(connection);
+					return;
+				}
+
+				results.bytes += received;
+				size_t body = received;
+				if (!connection.head_done)
+				{
+					connection.head.append(buffer, received);
+					size_t end = connection.head.find("\r\n\r\n");
+					if (end == std::string::npos)
+					{
+						if (connection.head.size() > 16384)
+							fail(connection);
+						continue;
+					}
+					body = connection.head.size() - end - 4;
+					connection.head.resize(end + 2);
+					connection.head_done = true;
+					parse_head(connection);
+				}
+
+				connection.received += body;
+				if (connection.content_length >= 0 && connection.received >= static_cast<uint64_t>(connection.content_length))
+				{
+					complete(connection, settings.keep_alive && connection.persistent);
+					return;
+				}
+			}
+		}
+
+		void complete(bench_connection &connection, bool keep)
+		{
+			int64_t now = now_ns();
+			uint64_t corrected = now - connection.scheduled_ns;
+			uint64_t uncorrected = now - connection.sent_ns;
+
+			results.corrected.add(phase_histogram::bucket_of(corrected), 1);
+			results.corrected.set_maximum(corrected);
+			results.uncorrected.add(phase_histogram::bucket_of(uncorrected), 1);
+			results.uncorrected.set_maximum(uncorrected);
+			++results.completed;
+			++results.status_classes[(connection.status >= 100 && connection.status < 600) ? connection.status / 100 : 0];
+
+			if (!keep)
+			{
+				close(connection.fd);
+				connection.fd = -1;
+			}
+			connection.phase = connection_phase::idle;
+		}
+
+		void fail(bench_connection &connection)
+		{
+			++results.errors;
+			if (connection.fd != -1)
+			{
+				close(connection.fd);
+				connection.fd = -1;
+			}
+			connection.phase = connection_phase::idle;
+		}
+	};
+
+	std::vector<bench_target> parse_targets(const std::vector<std::string> &urls)
+	{
+		std::vector<bench_target> targets;
+		for (const std::string &i: urls)
+		{
+			// PATH or PATH:WEIGHT
+			bench_target target{ i, 1, "" };
+			size_t colon = i.rfind(':');
+			if (colon != std::string::npos && colon + 1 < i.size()
+					&& i.find_first_not_of("0123456789", colon + 1) == std::string::npos)
+			{
+				target.path = i.substr(0, colon);
+				target.weight = std::stoul(i.substr(colon + 1));
+			}
+			if (target.path.empty() || target.path[0] != '/')
+				throw std::invalid_argument("url " + i + " does not start with /");
+			if (target.weight)
+				targets.push_back(target);
+		}
+		return targets;
+	}
+
+	uint64_t parse_size(const std::string &text)
+	{
+		size_t end = 0;
+		uint64_t value = std::stoull(text, &end);
+		std::string suffix = text.substr(end);
+		if (suffix == "k" || suffix == "K")
+			value <<= 10;
+		else if (suffix == "m" || suffix == "M")
+			value <<= 20;
+		else if (!suffix.empty())
+			throw std::invalid_argument("size " + text + " has unknown suffix");
+		return value;
+	}
+
+	// SIZE:WEIGHT,... creates a file of every size in the served directory and adds it to the mix
+	void create_sized_targets(const std::string &sizes, const std::string &directory, std::vector<bench_target> &targets)
+	{
+		size_t position = 0;
+		while (position < sizes.size())
+		{
+			size_t comma = sizes.find(',', position);
+			std::string item = sizes.substr(position, comma - position);
+			position = (comma == std::string::npos) ? sizes.size() : comma + 1;
+
+			size_t colon = item.find(':');
+			std::string size_text = item.substr(0, colon);
+			unsigned weight = (colon == std::string::npos) ? 1 : std::stoul(item.substr(colon + 1));
+			uint64_t size = parse_size(size_text);
+
+			std::string name = "final_bench_" + size_text + ".bin";
+			std::ofstream file{ directory + "/" + name, std::ios::binary | std::ios::trunc };
+			std::string block(65536, 'x');
+			for (uint64_t left = size; left && file; left -= std::min<uint64_t>(left, block.size()))
+				file.write(block.data(), std::min<uint64_t>(left, block.size()));
+			if (!file)
+				throw std::runtime_error("failed to create " + directory + "/" + name);
+
+			if (weight)
+				targets.push_back(bench_target{ "/" + name, weight, "" });
+		}
+	}
+
+	double percentile_us(const phase_histogram &histogram, double fraction)
+	{
+		return histogram.percentile(fraction) / 1000.0;
+	}
+
+	const double reported_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const char *quantile_names[] = { "p50", "p90", "p99", "p99.9" };
+
+	void print_results(const bench_settings &settings, const bench_results &results, double elapsed)
+	{
+		std::printf("final_bench: %.1f s, %u threads, %u connections, keep-alive %s, ", elapsed, settings.threads,
+				settings.connections, settings.keep_alive ? "on" : "off");
+		if (settings.rate > 0)
+			std::printf("scheduled %.0f requests/s\n", settings.rate);
+		else
+			std::printf("closed loop without pacing\n");
+
+		std::printf("requests %llu (%.1f/s), errors %llu, connects %llu, %.2f MB/s\n",
+				static_cast<unsigned long long>(results.completed), results.completed / elapsed,
+				static_cast<unsigned long long>(results.errors), static_cast<unsigned long long>(results.connects),
+				results.bytes / elapsed / 1e6);
+		std::printf("statuses 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+				static_cast<unsigned long long>(results.status_classes[1]), static_cast<unsigned long long>(results.status_classes[2]),
+				static_cast<unsigned long long>(results.status_classes[3]), static_cast<unsigned long long>(results.status_classes[4]),
+				static_cast<unsigned long long>(results.status_classes[5]), static_cast<unsigned long long>(results.status_classes[0]));
+
+		const phase_histogram *histograms[] = { &results.corrected, &results.uncorrected };
+		const char *names[] = { "corrected", "uncorrected" };
+		std::printf("latency, us %12s %10s %10s %10s %10s\n", quantile_names[0], quantile_names[1], quantile_names[2],
+				quantile_names[3], "max");
+		for (size_t i = 0; i != 2; ++i)
+		{
+			if (i == 0 && settings.rate <= 0)
+				continue;
+			std::printf("%-16s", names[i]);
+			for (double quantile: reported_quantiles)
+				std::printf(" %10.1f", percentile_us(*histograms[i], quantile));
+			std::printf(" %10.1f\n", histograms[i]->max() / 1000.0);
+		}
+	}
+
+	void write_json(const bench_settings &settings, const bench_results &results, double elapsed)
+	{
+		std::ofstream file{ settings.json, std::ios::trunc };
+		if (!file)
+			throw std::runtime_error("failed to open " + settings.json);
+
+		file << "{\n\t\"duration_s\": " << elapsed << ",\n\t\"threads\": " << settings.threads
+			<< ",\n\t\"connections\": " << settings.connections << ",\n\t\"keep_alive\": " << (settings.keep_alive ? "true" : "false")
+			<< ",\n\t\"rate\": " << settings.rate << ",\n\t\"targets\": [";
+		for (size_t i = 0; i != settings.targets.size(); ++i)
+		{
+			file << (i ? ", " : "") << "{\"path\": \"" << settings.targets[i].path << "\", \"weight\": "
+				<< settings.targets[i].weight << "}";
+		}
+		file << "],\n\t\"requests\": " << results.completed << ",\n\t\"rps\": " << results.completed / elapsed
+			<< ",\n\t\"errors\": " << results.errors << ",\n\t\"connects\": " << results.connects
+			<< ",\n\t\"bytes\": " << results.bytes
+			<< ",\n\t\"statuses\": {\"1xx\": " << results.status_classes[1] << ", \"2xx\": " << results.status_classes[2]
+			<< ", \"3xx\": " << results.status_classes[3] << ", \"4xx\": " << results.status_classes[4]
+			<< ", \"5xx\": " << results.status_classes[5] << ", \"other\": " << results.status_classes[0] << "}";
+
+		// without a schedule there is nothing to correct against, both series are the same then
+		const phase_histogram *histograms[] = { &results.corrected, &results.uncorrected };
+		const char *names[] = { "latency_us", "uncorrected_latency_us" };
+		for (size_t i = 0; i != 2; ++i)
+		{
+			file << ",\n\t\"" << names[i] << "\": {";
+			for (size_t q = 0; q != 4; ++q)
+				file << "\"" << quantile_names[q] << "\": " << percentile_us(*histograms[i], reported_quantiles[q]) << ", ";
+			file << "\"max\": " << histograms[i]->max() / 1000.0 << "}";
+		}
+		file << ",\n\t\"corrected\": " << (settings.rate > 0 ? "true" : "false") << "\n}\n";
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bench_settings settings;
+	std::vector<std::string> urls;
+	std::string sizes;
+	std::string directory;
+
+	try
+	{
+		boost::program_options::options_description options("Closed-loop HTTP load generator for the server");
+		options.add_options()
+			("help", "Print this help")
+			("host,h", boost::program_options::value<std::string>(&settings.host)->default_value(settings.host), "Server address")
+			("port,p", boost::program_options::value<std::string>(&settings.port)->default_value(settings.port), "Server port")
+			("threads,t", boost::program_options::value<unsigned>(&settings.threads)->default_value(settings.threads),
+				"Threads, each with an epoll of its own")
+			("connections,c", boost::program_options::value<unsigned>(&settings.connections)->default_value(settings.connections),
+				"Concurrent connections, each with one request in flight")
+			("duration,d", boost::program_options::value<double>(&settings.duration)->default_value(settings.duration),
+				"Seconds to run")
+			("rate,r", boost::program_options::value<double>(&settings.rate)->default_value(settings.rate),
+				"Requests per second scheduled over all connections; latency is counted from the schedule, "
+				"which corrects coordinated omission (0 sends as fast as answered, uncorrected)")
+			("keep-alive,k", boost::program_options::bool_switch(&settings.keep_alive),
+				"Ask for persistent connections and reuse them when the server agrees")
+			("url,u", boost::program_options::value<std::vector<std::string>>(&urls)->composing(),
+				"PATH[:WEIGHT] to request, may repeat (default /index.html)")
+			("sizes,s", boost::program_options::value<std::string>(&sizes),
+				"SIZE[:WEIGHT],... files to create in --directory and add to the mix, e.g. 1k:70,64k:25,1m:5")
+			("directory", boost::program_options::value<std::string>(&directory), "Directory served by the server, for --sizes")
+			("json,j", boost::program_options::value<std::string>(&settings.json), "Also write the results as JSON to this file");
+
+		boost::program_options::variables_map map;
+		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), map);
+		boost::program_options::notify(map);
+
+		if (map.count("help"))
+		{
+			std::cout << options << "\n";
+			return EXIT_SUCCESS;
+		}
+
+		settings.targets = parse_targets(urls);
+		if (!sizes.empty())
+		{
+			if (directory.empty())
+				throw std::invalid_argument("--sizes needs --directory");
+			create_sized_targets(sizes, directory, settings.targets);
+		}
+		if (settings.targets.empty())
+			settings.targets.push_back(bench_target{ "/index.html", 1, "" });
+
+		if (!settings.threads || !settings.connections || settings.duration <= 0)
+			throw std::invalid_argument("threads, connections and duration must be positive");
+		settings.threads = std::min(settings.threads, settings.connections);
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Command-line arguments error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	for (bench_target &i: settings.targets)
+	{
+		i.request = "GET " + i.path + " HTTP/1.0\r\nHost: " + settings.host
+			+ (settings.keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\n\r\n");
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *address;
+	int gai_res = getaddrinfo(settings.host.data(), settings.port.data(), &hints, &address);
+	if (gai_res != 0)
+	{
+		std::cerr << "Failed to resolve " << settings.host << ":" << settings.port << ": " << gai_strerror(gai_res) << "\n";
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::unique_ptr<bench_worker>> workers;
+	for (unsigned i = 0, first = 0; i != settings.threads; ++i)
+	{
+		unsigned count = settings.connections / settings.threads + (i < settings.connections % settings.threads);
+		workers.emplace_back(new bench_worker(settings, *address, count, first));
+		first += count;
+	}
+
+	int64_t started = now_ns();
+	int64_t deadline = started + static_cast<int64_t>(settings.duration * 1e9);
+
+	std::vector<std::thread> threads;
+	for (auto &i: workers)
+		threads.emplace_back(&bench_worker::run, i.get(), deadline);
+	for (auto &i: threads)
+		i.join();
+
+	double elapsed = (now_ns() - started) / 1e9;
+	freeaddrinfo(address);
+
+	bench_results results;
+	for (auto &i: workers)
+		results.merge(i->results);
+
+	print_results(settings, results, elapsed);
+
+	if (!settings.json.empty())
+	{
+		try
+		{
+			write_json(settings, results, elapsed);
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << e.what() << "\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	return results.completed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
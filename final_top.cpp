@@ -0,0 +1,171 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <boost/program_options.hpp>
+
+#include "metrics_segment.h"
+
+namespace
+{
+	const char *lane_names[metrics_lanes_count] = { "latency", "bulk" };
+
+	// a sum goes down when a slot is left out as stale, which is no negative count
+	uint64_t increase_of(uint64_t previous, uint64_t current)
+	{
+		return current > previous ? current - previous : 0;
+	}
+
+	// upper bound in microseconds of the bucket holding the given fraction of the requests
+	uint64_t latency_percentile(const uint64_t (&buckets)[metrics_latency_buckets], uint64_t total, double fraction)
+	{
+		if (!total)
+			return 0;
+
+		uint64_t rank = static_cast<uint64_t>(fraction * total);
+		if (rank >= total)
+			rank = total - 1;
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i != metrics_latency_buckets; ++i)
+		{
+			seen += buckets[i];
+			if (seen > rank)
+				return 1ull << i;
+		}
+		return 1ull << (metrics_latency_buckets - 1);
+	}
+
+	void print_header()
+	{
+		std::printf("%8s %10s %8s %8s %8s %8s %6s %6s %6s", "rps", "MB/s", "p50 us", "p90 us", "p99 us",
+				"p999 us", "2xx", "4xx", "5xx");
+		for (const char *lane: lane_names)
+			std::printf(" %8s %8s", (std::string(lane) + " q").data(), "wait us");
+		std::printf(" %7s %7s %5s\n", "workers", "threads", "stale");
+	}
+
+	void print_interval(const metrics_figures &previous, const metrics_figures &current, double seconds)
+	{
+		uint64_t requests = increase_of(previous.requests, current.requests);
+
+		uint64_t latency[metrics_latency_buckets];
+		for (size_t i = 0; i != metrics_latency_buckets; ++i)
+			latency[i] = increase_of(previous.latency_us[i], current.latency_us[i]);
+
+		std::printf("%8.0f %10.2f %8llu %8llu %8llu %8llu %6llu %6llu %6llu", requests / seconds,
+				increase_of(previous.bytes_sent, current.bytes_sent) / seconds / 1e6,
+				static_cast<unsigned long long>(latency_percentile(latency, requests, 0.5)),
+				static_cast<unsigned long long>(latency_percentile(latency, requests, 0.9)),
+				static_cast<unsigned long long>(latency_percentile(latency, requests, 0.99)),
+				static_cast<unsigned long long>(latency_percentile(latency, requests, 0.999)),
+				static_cast<unsigned long long>(increase_of(previous.status_classes[1], current.status_classes[1])),
+				static_cast<unsigned long long>(increase_of(previous.status_classes[3], current.status_classes[3])),
+				static_cast<unsigned long long>(increase_of(previous.status_classes[4], current.status_classes[4])));
+
+		for (size_t i = 0; i != metrics_lanes_count; ++i)
+		{
+			uint64_t executed = increase_of(previous.executed[i], current.executed[i]);
+			uint64_t wait = executed ? increase_of(previous.total_wait_ns[i], current.total_wait_ns[i]) / executed / 1000 : 0;
+			std::printf(" %8llu %8llu", static_cast<unsigned long long>(current.depth[i]),
+					static_cast<unsigned long long>(wait));
+		}
+		std::printf(" %7u %7zu %5zu\n", current.workers, current.threads, current.stale);
+		std::fflush(stdout);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string name;
+	unsigned interval_ms = 1000;
+	unsigned count = 0;
+
+	try
+	{
+		boost::program_options::options_description options("Shows live figures of a running server from its metrics segment");
+		options.add_options()
+			("segment,s", boost::program_options::value<std::string>(&name)->default_value(metrics_segment::default_name),
+				"Metrics segment of the server, as given to its --metrics-segment")
+			("interval,i", boost::program_options::value<unsigned>(&interval_ms)->default_value(interval_ms),
+				"Milliseconds between the lines")
+			("count,n", boost::program_options::value<unsigned>(&count)->default_value(count),
+				"Lines to print before exiting, 0 runs until interrupted");
+
+		boost::program_options::variables_map map;
+		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), map);
+		boost::program_options::notify(map);
+
+		if (!interval_ms)
+			throw std::invalid_argument("interval must be positive");
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Command-line arguments error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	int descriptor = shm_open(name.data(), O_RDONLY, 0);
+	if (descriptor == -1)
+	{
+		std::cerr << "Failed to open metrics segment " << name << ": " << strerror(errno) << "\n";
+		return EXIT_FAILURE;
+	}
+
+	void *address = mmap(nullptr, sizeof(metrics_segment_layout), PROT_READ, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (address == MAP_FAILED)
+	{
+		std::cerr << "Failed to map metrics segment " << name << ": " << strerror(errno) << "\n";
+		return EXIT_FAILURE;
+	}
+
+	const metrics_segment_layout &segment = *static_cast<const metrics_segment_layout *>(address);
+	if (memcmp(segment.header.magic, metrics_segment_magic, sizeof(segment.header.magic)) != 0)
+	{
+		std::cerr << name << " is not a metrics segment of the server\n";
+		return EXIT_FAILURE;
+	}
+	if (segment.header.version != metrics_segment_version || segment.header.slots_count != metrics_slots_count
+			|| segment.header.slot_size != sizeof(metrics_slot))
+	{
+		std::cerr << name << " has version " << segment.header.version << ", this tool reads version "
+			<< metrics_segment_version << "\n";
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "Server process " << segment.header.pid << ", segment " << name << "\n";
+	print_header();
+
+	metrics_figures previous;
+	read_metrics(segment, previous);
+	auto previous_at = std::chrono::steady_clock::now();
+
+	for (unsigned printed = 0; !count || printed != count; ++printed)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+
+		metrics_figures current;
+		read_metrics(segment, current);
+		auto current_at = std::chrono::steady_clock::now();
+
+		if (printed && printed % 20 == 0)
+			print_header();
+		print_interval(previous, current, std::chrono::duration<double>(current_at - previous_at).count());
+
+		previous = current;
+		previous_at = current_at;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -1,3 +1,10 @@
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <initializer_list>
+
+#include <pthread.h>
+
 #include "logging.h"
 
 std::mutex cerr_mutex;
@@ -5,31 +12,77 @@ std::mutex cerr_mutex;
 std::string server_ip;
 std::string server_port;
 std::string server_directory;
+std::string server_worker_cpus;
+std::string server_listener_cpus;
+size_t server_bulk_threshold = 1 << 20;
+size_t server_bulk_share = 25;
+size_t server_min_workers = 0;
+size_t server_max_workers = 0;
+size_t server_scale_latency_ms = 50;
+size_t server_idle_timeout_ms = 30000;
+size_t server_accept_batch = 64;
+size_t server_dequeue_batch = 8;
+bool server_access_log = true;
+std::string server_status_path = "/__status";
+std::string server_admin_port;
+std::string server_metrics_segment = "/final_metrics";
+size_t server_metadata_cache_entries = 4096;
+bool server_precompressed = false;
+size_t server_compression_cache_mb = 0;
+size_t server_compression_min_size = 1024;
+size_t server_negative_ttl_ms = 1000;
+size_t server_negative_cache_entries = 16384;
+bool server_path_filter = false;
+bool server_path_index = false;
+size_t server_path_index_threads = 0;
+size_t server_connection_idle_ms = 10000;
+size_t server_header_timeout_ms = 30000;
+size_t server_min_send_rate = 1024;
+size_t server_send_grace_ms = 10000;
+size_t server_max_connections = 0;
+size_t server_max_queued = 4096;
+size_t server_resume_percent = 90;
+bool server_overload_pause = false;
 
 constexpr char log_redirector::log_file_out_name[];
 constexpr char log_redirector::log_file_err_name[];
 constexpr char log_redirector::log_file_log_name[];
 
+termination_signals_blocker::termination_signals_blocker() noexcept
+{
+	sigset_t blocked;
+	sigemptyset(&blocked);
+	for (int signal_number: { SIGINT, SIGHUP, SIGTERM, SIGQUIT, SIGUSR1, SIGUSR2 })
+		sigaddset(&blocked, signal_number);
+	pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+}
+
+termination_signals_blocker::~termination_signals_blocker()
+{
+	pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+
 void log_errno(const char *function, const char *file, size_t line, const char *message, int actual_errno) noexcept
 {
-	// cerr_mutex is locked before call to this function
-	std::cerr << "Error in " << function << " (" << file << ", line " << line << ")\n";
+	// the whole report is formatted into one record, so cerr_mutex is not needed around this call
+	log_record record;
+	record << "Error in " << function << " (" << file << ", line " << line << ")\n";
 
 	constexpr size_t buffer_size = 1024;
 	static thread_local char buffer[buffer_size] = { 0 };
 
-	std::cerr << "errno " << actual_errno << " means ";
+	record << "errno " << actual_errno << " means ";
 
 #if (!defined(_GNU_SOURCE) && defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L)
 
 	int strerror_res = strerror_r(actual_errno, buffer, buffer_size);
 	if (strerror_res != 0)
 	{
-		std::cerr << "(failed to decipher because of error with errno " << (strerror_res == -1 ? errno : strerror_res)  << ")\n";
+		record << "(failed to decipher because of error with errno " << (strerror_res == -1 ? errno : strerror_res)  << ")\n";
 	}
 	else
 	{
-		std::cerr << buffer << "\n";
+		record << buffer << "\n";
 	}
 
 #elif defined(_GNU_SOURCE)
@@ -37,20 +90,215 @@ void log_errno(const char *function, const char *file, size_t line, const char *
 	const char *strerror_res = strerror_r(actual_errno, buffer, buffer_size);
 	if (strerror_res)
 	{
-		std::cerr << strerror_res << "\n";
+		record << strerror_res << "\n";
 	}
 	else
 	{
-		std::cerr << "(failed to decipher)\n";
+		record << "(failed to decipher)\n";
 	}
 
 #else
 
-	std::cerr << "(alas impossible to report errno-provided errors)\n";
+	record << "(alas impossible to report errno-provided errors)\n";
 
 #endif	
 
-	std::cerr << "Therefore " << message << "\n\n";
+	record << "Therefore " << message << "\n\n";
+}
+
+log_record::~log_record()
+{
+	async_logger::instance().submit(text, length);
+}
+
+constexpr size_t log_record::capacity;
+constexpr size_t async_logger::ring_slots;
+constexpr std::chrono::milliseconds async_logger::flush_interval;
+
+void async_logger::log_ring::push(const char *text, size_t length) noexcept
+{
+	size_t current_tail = tail.load(std::memory_order_relaxed);
+	if (current_tail - head.load(std::memory_order_acquire) == ring_slots)
+	{
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	slot &destination = slots[current_tail % ring_slots];
+	destination.length = std::min(length, log_record::capacity);
+	memcpy(destination.text, text, destination.length);
+
+	tail.store(current_tail + 1, std::memory_order_release);
+}
+
+void async_logger::log_ring::drain(std::string &batch)
+{
+	size_t current_head = head.load(std::memory_order_relaxed);
+	size_t current_tail = tail.load(std::memory_order_acquire);
+
+	for (; current_head != current_tail; ++current_head)
+	{
+		const slot &source = slots[current_head % ring_slots];
+		batch.append(source.text, source.length);
+	}
+
+	head.store(current_head, std::memory_order_release);
+}
+
+async_logger::ring_holder::~ring_holder()
+{
+	if (ring)
+		ring->orphaned.store(true, std::memory_order_release);
+}
+
+async_logger &async_logger::instance()
+{
+	static async_logger *object = new async_logger;
+	return *object;
+}
+
+async_logger::log_ring *async_logger::local_ring()
+{
+	static thread_local ring_holder holder;
+
+	if (!holder.ring)
+	{
+		std::unique_ptr<log_ring> ring{ new log_ring };
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		rings.push_back(ring.get());
+		holder.ring = ring.release();
+	}
+	return holder.ring;
+}
+
+size_t async_logger::drain(std::string &batch)
+{
+	size_t dropped_now = 0;
+
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (auto it = rings.begin(); it != rings.end();)
+	{
+		log_ring *ring = *it;
+		bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+
+		ring->drain(batch);
+		dropped_now += ring->dropped.exchange(0, std::memory_order_relaxed);
+
+		if (orphaned)
+		{
+			delete ring;
+			it = rings.erase(it);
+		}
+		else
+			++it;
+	}
+
+	return dropped_now;
+}
+
+void async_logger::flushing_loop() noexcept
+{
+	try
+	{
+		std::string batch;
+		batch.reserve(ring_slots * log_record::capacity);
+
+		bool last_round = false;
+		while (!last_round)
+		{
+			{
+				std::unique_lock<std::mutex> lock(flusher_mutex);
+				flusher_condv.wait_for(lock, flush_interval, [this]() { return stop_flag; });
+				last_round = stop_flag;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(hooks_mutex);
+				for (void (*hook)(bool): hooks)
+					hook(last_round);
+			}
+
+			size_t dropped_now = drain(batch);
+			if (dropped_now)
+			{
+				dropped += dropped_now;
+				batch += "Asynchronous log dropped ";
+				batch += std::to_string(dropped_now);
+				batch += " records because of full buffers\n";
+			}
+
+			if (!batch.empty())
+			{
+				std::lock_guard<std::mutex> lock(cerr_mutex);
+				std::cerr.write(batch.data(), batch.size());
+				std::cerr.flush();
+				batch.clear();
+			}
+		}
+	}
+	catch (...)
+	{
+		running.store(false);
+	}
+}
+
+void async_logger::start() noexcept
+{
+	if (running.load())
+		return;
+
+	try
+	{
+		flusher = start_helper_thread(&async_logger::flushing_loop, this);
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lock(cerr_mutex);
+		std::cerr << "Failed to start asynchronous logging, errors are written synchronously\n";
+		return;
+	}
+
+	running.store(true);
+	std::atexit([]() { async_logger::instance().stop(); });
+}
+
+void async_logger::stop() noexcept
+{
+	// the flusher cannot join itself, nor wait for the mutex it may hold
+	if (!flusher.joinable() || std::this_thread::get_id() == flusher.get_id())
+		return;
+
+	running.store(false);
+	{
+		std::lock_guard<std::mutex> lock(flusher_mutex);
+		stop_flag = true;
+	}
+	flusher_condv.notify_all();
+	flusher.join();
+}
+
+void async_logger::add_flush_hook(void (*hook)(bool last_round))
+{
+	std::lock_guard<std::mutex> lock(hooks_mutex);
+	hooks.push_back(hook);
+}
+
+void async_logger::submit(const char *text, size_t length) noexcept
+{
+	if (running.load(std::memory_order_acquire))
+	{
+		try
+		{
+			local_ring()->push(text, length);
+			return;
+		}
+		catch (...)
+		{
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(cerr_mutex);
+	std::cerr.write(text, length);
 }
 
 time_t current_time_t() noexcept
@@ -58,39 +306,70 @@ time_t current_time_t() noexcept
 	return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 }
 
-std::string time_t_to_string(time_t seconds_since_epoch)
+bool format_http_date(time_t seconds_since_epoch, char *destination) noexcept
 {
+	static const char day_of_week[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char month[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
 	struct tm time_now;
-	tzset();
-	struct tm *ret_val = localtime_r(&seconds_since_epoch, &time_now);
-	if (ret_val != &time_now)
+	if (gmtime_r(&seconds_since_epoch, &time_now) != &time_now || time_now.tm_year + 1900 > 9999 || time_now.tm_year + 1900 < 0)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		LOG_CERROR("requested data-string will be empty due to fail of localtime_r");
-		return "";
+		destination[0] = '\0';
+		return false;
 	}
 
-	const char *day_of_week[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
-	const char *month[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-
-	constexpr size_t date_max_length = 512;
-	char date_string[date_max_length];
+	// written digit by digit, strftime consults the locale
+	auto two_digits = [](char *where, int value)
+	{
+		where[0] = '0' + value / 10;
+		where[1] = '0' + value % 10;
+	};
+	int year = time_now.tm_year + 1900;
+	memcpy(destination, day_of_week[time_now.tm_wday], 3);
+	memcpy(destination + 3, ", ", 2);
+	two_digits(destination + 5, time_now.tm_mday);
+	destination[7] = ' ';
+	memcpy(destination + 8, month[time_now.tm_mon], 3);
+	destination[11] = ' ';
+	two_digits(destination + 12, year / 100);
+	two_digits(destination + 14, year % 100);
+	destination[16] = ' ';
+	two_digits(destination + 17, time_now.tm_hour);
+	destination[19] = ':';
+	two_digits(destination + 20, time_now.tm_min);
+	destination[22] = ':';
+	two_digits(destination + 23, time_now.tm_sec);
+	memcpy(destination + 25, " GMT", 5);
+	return true;
+}
 
-	const char format_string[] = ", %d  %Y %T GMT";
-	size_t strftime_res = strftime(date_string, date_max_length, format_string, &time_now);
-	if (strftime_res == 0)
+std::string time_t_to_string(time_t seconds_since_epoch)
+{
+	char date[http_date_size + 1];
+	if (!format_http_date(seconds_since_epoch, date))
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		LOG_CERROR("requested data-string will be empty due to fail of strftime_res");
+		LOG_CERROR("requested data-string will be empty due to fail of gmtime_r");
 		return "";
 	}
+	return date;
+}
+
+time_t http_date_to_time_t(const char *date) noexcept
+{
+	struct tm parsed;
+	memset(&parsed, 0, sizeof(parsed));
 
-	std::string result;
-	result += day_of_week[time_now.tm_wday];
-	result += date_string;
-	constexpr size_t month_position = 8;
-	result.insert(month_position, month[time_now.tm_mon]);
+	const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &parsed);
+	if (!end || *end != '\0')
+		return -1;
 
-	return result;
+	return timegm(&parsed);
 }
 
+
+const std::string &reused_key(const char *data, size_t length)
+{
+	thread_local std::string key;
+	key.assign(data, length);
+	return key;
+}
@@ -6,9 +6,18 @@
 #include <fstream>
 #include <string>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include <cstdio>
 
 #include <cstring>
 #include <ctime>
+#include <csignal>
 
 extern std::mutex cerr_mutex;
 
@@ -16,9 +25,188 @@ extern std::mutex cerr_mutex;
 
 void log_errno(const char *function, const char *file, size_t line, const char *message, int actual_errno = errno) noexcept;
 
+class termination_signals_blocker final
+{
+	// the signals the server handles stay blocked in the calling thread while it lives, and in the threads it starts
+private:
+	sigset_t previous;
+public:
+	termination_signals_blocker() noexcept;
+	~termination_signals_blocker();
+	termination_signals_blocker(const termination_signals_blocker &) = delete;
+	termination_signals_blocker &operator=(const termination_signals_blocker &) = delete;
+};
+
+// a thread of the server's own upkeep: the signal handler calls exit(), whose atexit handlers join and lock
+// what such a thread may hold, so the signals are left to the threads serving requests
+template <typename... Arguments>
+std::thread start_helper_thread(Arguments &&... arguments)
+{
+	termination_signals_blocker blocked;
+	return std::thread(std::forward<Arguments>(arguments)...);
+}
+
+class log_record final
+{
+	// preformatted text of a single message, submitted to async_logger when the record is destroyed
+public:
+	static constexpr size_t capacity = 500;
+private:
+	char text[capacity];
+	size_t length = 0;
+
+	void append(const char *data, size_t size) noexcept
+	{
+		size = std::min(size, capacity - length);
+		memcpy(text + length, data, size);
+		length += size;
+	}
+public:
+	log_record() noexcept
+	{}
+	log_record(const log_record &) = delete;
+	log_record &operator=(const log_record &) = delete;
+	~log_record();
+
+	log_record &operator<<(const char *value) noexcept
+	{
+		append(value, strlen(value));
+		return *this;
+	}
+	log_record &operator<<(const std::string &value) noexcept
+	{
+		append(value.data(), value.size());
+		return *this;
+	}
+	log_record &operator<<(char value) noexcept
+	{
+		append(&value, 1);
+		return *this;
+	}
+	template <typename Integer>
+	typename std::enable_if<std::is_integral<Integer>::value && std::is_signed<Integer>::value, log_record &>::type
+	operator<<(Integer value) noexcept
+	{
+		char digits[24];
+		append(digits, std::max(snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(value)), 0));
+		return *this;
+	}
+	template <typename Integer>
+	typename std::enable_if<std::is_integral<Integer>::value && !std::is_signed<Integer>::value, log_record &>::type
+	operator<<(Integer value) noexcept
+	{
+		char digits[24];
+		append(digits, std::max(snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(value)), 0));
+		return *this;
+	}
+};
+
+// Singletons of the server, async_logger among them, are made with new on first use and never deleted: threads
+// still serving or recording while exit() runs the destructors of statics keep finding them intact.
+
+class async_logger final
+{
+private:
+	static constexpr size_t ring_slots = 256;
+	static constexpr std::chrono::milliseconds flush_interval{ 50 };
+
+	struct log_ring
+	{
+		// single producer (the owning thread), single consumer (the flusher)
+		struct slot
+		{
+			size_t length;
+			char text[log_record::capacity];
+		};
+
+		std::atomic<size_t> head{ 0 };
+		std::atomic<size_t> tail{ 0 };
+		std::atomic<size_t> dropped{ 0 };
+		std::atomic<bool> orphaned{ false };
+		slot slots[ring_slots];
+
+		void push(const char *text, size_t length) noexcept;
+		void drain(std::string &batch);
+	};
+
+	struct ring_holder
+	{
+		log_ring *ring = nullptr;
+		~ring_holder();
+	};
+
+	std::atomic<bool> running{ false };
+	std::atomic<size_t> dropped{ 0 };
+
+	std::mutex rings_mutex;
+	std::vector<log_ring *> rings;
+
+	std::mutex flusher_mutex;
+	std::condition_variable flusher_condv;
+	bool stop_flag = false;
+	std::thread flusher;
+
+	std::mutex hooks_mutex;
+	std::vector<void (*)(bool)> hooks;
+
+	async_logger() = default;
+
+	log_ring *local_ring();
+	size_t drain(std::string &batch);
+	void flushing_loop() noexcept;
+public:
+	static async_logger &instance();
+	async_logger(const async_logger &) = delete;
+	async_logger &operator=(const async_logger &) = delete;
+
+	void start() noexcept;
+	void stop() noexcept;
+
+	// run by the flusher every round, with true on the last one at exit; hooks are never removed
+	void add_flush_hook(void (*hook)(bool last_round));
+
+	void submit(const char *text, size_t length) noexcept;
+
+	size_t dropped_records() const noexcept
+	{
+		return dropped.load(std::memory_order_relaxed);
+	}
+};
+
 extern std::string server_ip;
 extern std::string server_port;
 extern std::string server_directory;
+extern std::string server_worker_cpus;
+extern std::string server_listener_cpus;
+extern size_t server_bulk_threshold;
+extern size_t server_bulk_share;
+extern size_t server_min_workers;
+extern size_t server_max_workers;
+extern size_t server_scale_latency_ms;
+extern size_t server_idle_timeout_ms;
+extern size_t server_accept_batch;
+extern size_t server_dequeue_batch;
+extern bool server_access_log;
+extern std::string server_status_path;
+extern std::string server_admin_port;
+extern std::string server_metrics_segment;
+extern size_t server_metadata_cache_entries;
+extern bool server_precompressed;
+extern size_t server_compression_cache_mb;
+extern size_t server_compression_min_size;
+extern size_t server_negative_ttl_ms;
+extern size_t server_negative_cache_entries;
+extern bool server_path_filter;
+extern bool server_path_index;
+extern size_t server_path_index_threads;
+extern size_t server_connection_idle_ms;
+extern size_t server_header_timeout_ms;
+extern size_t server_min_send_rate;
+extern size_t server_send_grace_ms;
+extern size_t server_max_connections;
+extern size_t server_max_queued;
+extern size_t server_resume_percent;
+extern bool server_overload_pause;
 
 class log_redirector final
 {
@@ -79,6 +267,19 @@ public:
 
 time_t current_time_t() noexcept;
 
+constexpr size_t http_date_size = 29;
+
+// IMF-fixdate, such as "Sun, 06 Nov 1994 08:49:37 GMT", NUL-terminated into http_date_size + 1 chars;
+// false, with an empty string, when the time is out of range
+bool format_http_date(time_t seconds_since_epoch, char *destination) noexcept;
+
 std::string time_t_to_string(time_t seconds_since_epoch);
 
+// -1 when the date is not in the IMF-fixdate format of time_t_to_string
+time_t http_date_to_time_t(const char *date) noexcept;
+
+// the bytes as a key for a map keyed by std::string, copied into a string the calling thread reuses,
+// so a lookup does not allocate; valid until the thread's next call
+const std::string &reused_key(const char *data, size_t length);
+
 #endif
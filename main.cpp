@@ -18,9 +18,10 @@ int main(int argc, char **argv)
 
 	daemonize();
 
-	int master_socket = get_listening_socket();
+	int master_socket = get_listening_socket(server_port);
+	int admin_socket = server_admin_port.empty() ? -1 : get_listening_socket(server_admin_port);
 
-	run_server_loop(master_socket);
+	run_server_loop(master_socket, admin_socket);
 
 	return 0;
 }
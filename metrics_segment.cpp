@@ -0,0 +1,274 @@
+#include <thread>
+
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics_segment.h"
+#include "logging.h"
+
+constexpr char metrics_segment::default_name[];
+constexpr std::chrono::milliseconds metrics_segment::publish_interval;
+
+namespace
+{
+	enum slot_state : uint32_t
+	{
+		slot_free = 0,
+		slot_owned = 1,
+		slot_parked = 2
+	};
+
+	void increase(std::atomic<uint64_t> &counter, uint64_t amount) noexcept
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	void begin_write(std::atomic<uint32_t> &sequence) noexcept
+	{
+		sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void end_write(std::atomic<uint32_t> &sequence) noexcept
+	{
+		sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	constexpr unsigned spins_per_round = 4096;
+	constexpr unsigned rounds_count = 16;
+
+	template <typename Copy>
+	bool read_consistently(const std::atomic<uint32_t> &sequence, Copy copy) noexcept
+	{
+		// a writer holds the sequence odd only for a few stores, but one killed meanwhile holds it odd for good:
+		// after a bounded number of attempts, with the CPU given up between rounds, the copy is reported stale
+		for (unsigned round = 0; round != rounds_count; ++round)
+		{
+			for (unsigned spin = 0; spin != spins_per_round; ++spin)
+			{
+				uint32_t before = sequence.load(std::memory_order_acquire);
+				if (before & 1)
+					continue;
+
+				copy();
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (sequence.load(std::memory_order_relaxed) == before)
+					return true;
+			}
+			std::this_thread::yield();
+		}
+		return false;
+	}
+
+	struct slot_holder
+	{
+		metrics_slot *slot = nullptr;
+
+		~slot_holder()
+		{
+			// counters stay in the segment, the next thread continues from them
+			if (slot)
+				slot->state.store(slot_parked, std::memory_order_release);
+		}
+	};
+
+	void remove_at_exit() noexcept
+	{
+		metrics_segment::instance().remove();
+	}
+}
+
+void read_metrics(const metrics_segment_layout &segment, metrics_figures &destination) noexcept
+{
+	destination = metrics_figures{};
+	const metrics_pool_area &pool = segment.pool;
+	metrics_figures pool_copy;
+	bool pool_read = read_consistently(pool.sequence, [&]()
+	{
+		pool_copy.workers = pool.workers.load(std::memory_order_relaxed);
+		for (size_t i = 0; i != metrics_lanes_count; ++i)
+		{
+			pool_copy.depth[i] = pool.depth[i].load(std::memory_order_relaxed);
+			pool_copy.executed[i] = pool.executed[i].load(std::memory_order_relaxed);
+			pool_copy.total_wait_ns[i] = pool.total_wait_ns[i].load(std::memory_order_relaxed);
+		}
+	});
+	// the copy holds the pool figures only, the slots are summed into it
+	if (pool_read)
+		destination = pool_copy;
+	else
+		++destination.stale;
+
+	for (const metrics_slot &slot: segment.slots)
+	{
+		uint32_t state = slot.state.load(std::memory_order_acquire);
+		if (state == slot_free)
+			continue;
+
+		metrics_figures copy;
+		bool read = read_consistently(slot.sequence, [&]()
+		{
+			copy.requests = slot.requests.load(std::memory_order_relaxed);
+			copy.bytes_sent = slot.bytes_sent.load(std::memory_order_relaxed);
+			for (size_t i = 0; i != metrics_status_classes; ++i)
+				copy.status_classes[i] = slot.status_classes[i].load(std::memory_order_relaxed);
+			for (size_t i = 0; i != metrics_latency_buckets; ++i)
+				copy.latency_us[i] = slot.latency_us[i].load(std::memory_order_relaxed);
+		});
+		if (!read)
+		{
+			++destination.stale;
+			continue;
+		}
+		if (state == slot_owned)
+			++destination.threads;
+
+		destination.requests += copy.requests;
+		destination.bytes_sent += copy.bytes_sent;
+		for (size_t i = 0; i != metrics_status_classes; ++i)
+			destination.status_classes[i] += copy.status_classes[i];
+		for (size_t i = 0; i != metrics_latency_buckets; ++i)
+			destination.latency_us[i] += copy.latency_us[i];
+	}
+}
+
+metrics_segment &metrics_segment::instance()
+{
+	static metrics_segment *object = new metrics_segment;
+	return *object;
+}
+
+bool metrics_segment::create(const char *segment_name) noexcept
+{
+	if (strlen(segment_name) >= sizeof(name))
+	{
+		log_record{} << "Name of the metrics segment is too long: " << segment_name << "\n";
+		return false;
+	}
+
+	// a segment left by a killed server is unlinked rather than truncated, readers still mapping it keep their pages
+	shm_unlink(segment_name);
+	int descriptor = shm_open(segment_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (descriptor == -1)
+	{
+		LOG_CERROR("failed to open the metrics segment, metrics will not be published");
+		return false;
+	}
+
+	if (ftruncate(descriptor, sizeof(metrics_segment_layout)) == -1)
+	{
+		LOG_CERROR("failed to size the metrics segment, metrics will not be published");
+		close(descriptor);
+		shm_unlink(segment_name);
+		return false;
+	}
+
+	void *address = mmap(nullptr, sizeof(metrics_segment_layout), PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (address == MAP_FAILED)
+	{
+		LOG_CERROR("failed to map the metrics segment, metrics will not be published");
+		shm_unlink(segment_name);
+		return false;
+	}
+
+	// the new segment is zeroed, which is the initial state of every counter and sequence
+	metrics_segment_layout *layout = static_cast<metrics_segment_layout *>(address);
+	layout->header.version = metrics_segment_version;
+	layout->header.slots_count = metrics_slots_count;
+	layout->header.slot_size = sizeof(metrics_slot);
+	layout->header.pid = getpid();
+	layout->header.started_at_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	// the magic goes last, readers attaching earlier reject the segment
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(layout->header.magic, metrics_segment_magic, sizeof(layout->header.magic));
+
+	strcpy(name, segment_name);
+	segment = layout;
+
+	if (std::atexit(remove_at_exit))
+		std::clog << "Failed to set removal of the metrics segment at exit" << std::endl;
+
+	return true;
+}
+
+void metrics_segment::remove() noexcept
+{
+	// the mapping stays, so threads still running keep writing into memory of their own
+	if (segment && name[0] && shm_unlink(name) == -1)
+	{
+		LOG_CERROR("failed to unlink the metrics segment");
+	}
+	name[0] = '\0';
+}
+
+metrics_slot *metrics_segment::local_slot() noexcept
+{
+	static thread_local slot_holder holder;
+
+	if (!holder.slot)
+	{
+		for (uint32_t wanted: { slot_parked, slot_free })
+		{
+			for (metrics_slot &slot: segment->slots)
+			{
+				uint32_t expected = wanted;
+				if (slot.state.load(std::memory_order_relaxed) == wanted
+						&& slot.state.compare_exchange_strong(expected, slot_owned, std::memory_order_acquire))
+				{
+					holder.slot = &slot;
+					return holder.slot;
+				}
+			}
+		}
+	}
+	return holder.slot;
+}
+
+void metrics_segment::publish_request(short status, uint64_t bytes, std::chrono::steady_clock::duration latency) noexcept
+{
+	if (!segment)
+		return;
+
+	metrics_slot *slot = local_slot();
+	if (!slot)
+		return;
+
+	uint64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+	size_t bucket = microseconds ? 64 - __builtin_clzll(microseconds) : 0;
+	if (bucket >= metrics_latency_buckets)
+		bucket = metrics_latency_buckets - 1;
+
+	begin_write(slot->sequence);
+	increase(slot->requests, 1);
+	increase(slot->bytes_sent, bytes);
+	if (status >= 100 && status < 600)
+		increase(slot->status_classes[status / 100 - 1], 1);
+	increase(slot->latency_us[bucket], 1);
+	end_write(slot->sequence);
+}
+
+void metrics_segment::publish_pool(uint32_t workers, const uint64_t (&depth)[metrics_lanes_count],
+		const uint64_t (&executed)[metrics_lanes_count], const uint64_t (&total_wait_ns)[metrics_lanes_count]) noexcept
+{
+	if (!segment)
+		return;
+
+	metrics_pool_area &pool = segment->pool;
+	begin_write(pool.sequence);
+	pool.workers.store(workers, std::memory_order_relaxed);
+	for (size_t i = 0; i != metrics_lanes_count; ++i)
+	{
+		pool.depth[i].store(depth[i], std::memory_order_relaxed);
+		pool.executed[i].store(executed[i], std::memory_order_relaxed);
+		pool.total_wait_ns[i].store(total_wait_ns[i], std::memory_order_relaxed);
+	}
+	end_write(pool.sequence);
+}
@@ -0,0 +1,108 @@
+#ifndef __METRICS_SEGMENT_H__
+#define __METRICS_SEGMENT_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// the segment is shared with other processes, so every atomic in it has to be address-free
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "metrics segment needs lock-free atomics");
+
+constexpr size_t metrics_slots_count = 256;
+constexpr size_t metrics_lanes_count = 2;		// latency and bulk lanes of the thread pool
+constexpr size_t metrics_status_classes = 5;		// 1xx to 5xx
+constexpr size_t metrics_latency_buckets = 32;		// bucket 0 is under 1 us, bucket i is [2^(i-1), 2^i) us
+
+struct metrics_segment_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t slots_count;
+	uint32_t slot_size;
+	uint64_t pid;
+	uint64_t started_at_ns;				// realtime
+};
+
+struct alignas(64) metrics_slot
+{
+	// seqlock: odd while the owning thread writes, readers retry until they see the same even value twice
+	std::atomic<uint32_t> sequence;
+	std::atomic<uint32_t> state;
+	std::atomic<uint64_t> requests;
+	std::atomic<uint64_t> bytes_sent;
+	std::atomic<uint64_t> status_classes[metrics_status_classes];
+	std::atomic<uint64_t> latency_us[metrics_latency_buckets];
+};
+
+struct alignas(64) metrics_pool_area
+{
+	// written by the accepting thread only, under the same seqlock protocol
+	std::atomic<uint32_t> sequence;
+	std::atomic<uint32_t> workers;
+	std::atomic<uint64_t> depth[metrics_lanes_count];
+	std::atomic<uint64_t> executed[metrics_lanes_count];
+	std::atomic<uint64_t> total_wait_ns[metrics_lanes_count];
+};
+
+struct metrics_segment_layout
+{
+	metrics_segment_header header;
+	metrics_pool_area pool;
+	metrics_slot slots[metrics_slots_count];
+};
+
+constexpr char metrics_segment_magic[4] = { 'F', 'M', 'S', 'G' };
+constexpr uint32_t metrics_segment_version = 1;
+
+// a consistent copy of the whole segment, summed over the slots
+struct metrics_figures
+{
+	uint64_t requests = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t status_classes[metrics_status_classes] = {};
+	uint64_t latency_us[metrics_latency_buckets] = {};
+	uint32_t workers = 0;
+	uint64_t depth[metrics_lanes_count] = {};
+	uint64_t executed[metrics_lanes_count] = {};
+	uint64_t total_wait_ns[metrics_lanes_count] = {};
+	size_t threads = 0;
+	size_t stale = 0;			// areas left out, their writer never finished the write it had begun
+};
+
+void read_metrics(const metrics_segment_layout &segment, metrics_figures &destination) noexcept;
+
+class metrics_segment final
+{
+private:
+	metrics_segment_layout *segment = nullptr;
+	char name[256] = {};
+
+	metrics_segment() = default;
+
+	metrics_slot *local_slot() noexcept;
+public:
+	static constexpr char default_name[] = "/final_metrics";
+	static constexpr std::chrono::milliseconds publish_interval{ 100 };
+
+	static metrics_segment &instance();
+	metrics_segment(const metrics_segment &) = delete;
+	metrics_segment &operator=(const metrics_segment &) = delete;
+
+	// creates the segment in /dev/shm and unlinks it at exit
+	bool create(const char *segment_name) noexcept;
+	void remove() noexcept;
+
+	bool enabled() const noexcept
+	{
+		return segment;
+	}
+
+	// each thread writes into a slot of its own, a slot of a finished thread is adopted by the next one
+	void publish_request(short status, uint64_t bytes, std::chrono::steady_clock::duration latency) noexcept;
+
+	void publish_pool(uint32_t workers, const uint64_t (&depth)[metrics_lanes_count],
+			const uint64_t (&executed)[metrics_lanes_count], const uint64_t (&total_wait_ns)[metrics_lanes_count]) noexcept;
+};
+
+#endif
@@ -0,0 +1,611 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <boost/program_options.hpp>
+
+#include "server.h"
+#include "path_index.h"
+
+namespace
+{
+	std::atomic<uint64_t> malloc_calls{ 0 };
+}
+
+// every malloc of the process is counted, so serving in steady state can be shown to call none
+extern "C"
+{
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t count, size_t size);
+	void *__libc_realloc(void *pointer, size_t size);
+
+	void *malloc(size_t size)
+	{
+		malloc_calls.fetch_add(1, std::memory_order_relaxed);
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t count, size_t size)
+	{
+		malloc_calls.fetch_add(1, std::memory_order_relaxed);
+		return __libc_calloc(count, size);
+	}
+
+	void *realloc(void *pointer, size_t size)
+	{
+		malloc_calls.fetch_add(1, std::memory_order_relaxed);
+		return __libc_realloc(pointer, size);
+	}
+}
+
+namespace
+{
+	// keeps a computed value alive without costing more than a register move
+	template <typename T>
+	inline void keep(const T &value)
+	{
+		asm volatile("" : : "g"(&value) : "memory");
+	}
+
+	struct micro_benchmark
+	{
+		const char *name;
+		std::function<void(size_t)> body;		// runs the operation the given number of times
+	};
+
+	struct micro_result
+	{
+		std::string name;
+		size_t iterations;
+		std::vector<double> samples_ns;			// per operation
+
+		double median() const
+		{
+			std::vector<double> sorted = samples_ns;
+			std::sort(sorted.begin(), sorted.end());
+			size_t middle = sorted.size() / 2;
+			return (sorted.size() % 2) ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+		}
+		double minimum() const
+		{
+			return *std::min_element(samples_ns.begin(), samples_ns.end());
+		}
+		double maximum() const
+		{
+			return *std::max_element(samples_ns.begin(), samples_ns.end());
+		}
+	};
+
+	double run_once(const micro_benchmark &benchmark, size_t iterations)
+	{
+		using namespace std::chrono;
+		steady_clock::time_point started = steady_clock::now();
+		benchmark.body(iterations);
+		return duration_cast<duration<double, std::nano>>(steady_clock::now() - started).count();
+	}
+
+	// the iteration count is fixed once per benchmark, so every sample does the same work
+	micro_result measure(const micro_benchmark &benchmark, double min_sample_ns, size_t samples)
+	{
+		size_t iterations = 1;
+		run_once(benchmark, iterations);
+		while (true)
+		{
+			double elapsed = run_once(benchmark, iterations);
+			if (elapsed >= min_sample_ns || iterations >= (size_t(1) << 40))
+				break;
+			double factor = (elapsed > 0) ? min_sample_ns / elapsed * 1.2 : 10;
+			iterations = static_cast<size_t>(iterations * std::min(std::max(factor, 2.0), 100.0));
+		}
+
+		micro_result result{ benchmark.name, iterations, {} };
+		for (size_t i = 0; i != samples; ++i)
+			result.samples_ns.push_back(run_once(benchmark, iterations) / iterations);
+		return result;
+	}
+
+	const char *request_corpus[] =
+	{
+		"GET /index.html HTTP/1.0\r\nHost: 127.0.0.1:12345\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n",
+		"GET /static/js/app.min.js?v=1699 HTTP/1.0\r\nHost: example.com\r\n"
+			"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+			"Accept: */*\r\nAccept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate, br\r\n"
+			"Referer: http://example.com/\r\nConnection: keep-alive\r\n\r\n",
+		"GET /images/logo.png HTTP/1.0\r\nHost: example.com\r\nAccept: image/avif,image/webp,*/*\r\n"
+			"If-Modified-Since: Sat, 29 Oct 2022 19:43:31 GMT\r\n\r\n",
+		"GET /\r\n",
+		"HEAD /index.html HTTP/1.0\r\nHost: example.com\r\n\r\n",
+		"GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n",
+		"BREW /pot HTTP/1.0\r\n\r\n"
+	};
+	constexpr size_t request_corpus_size = sizeof(request_corpus) / sizeof(request_corpus[0]);
+
+	const short phrase_statuses[] = { 200, 404, 400, 405, 505, 500, 403, 304, 206, 503 };
+
+	void noop_task(int value)
+	{
+		keep(value);
+	}
+
+	struct loopback_server
+	{
+		// requests are answered by process_client_request over a real loopback connection
+		int listener = -1;
+		struct sockaddr_in address;
+		connection_pool pool{ 16 };
+		std::string path;
+		uint64_t server_mallocs = 0;			// by the serving side of the requests only
+
+		bool start(const std::string &served_path)
+		{
+			path = served_path;
+			listener = socket(AF_INET, SOCK_STREAM, 0);
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			socklen_t length = sizeof(address);
+			return listener != -1 && bind(listener, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0
+				&& getsockname(listener, reinterpret_cast<struct sockaddr *>(&address), &length) == 0
+				&& listen(listener, 16) == 0;
+		}
+
+		// the whole response as the client sees it
+		std::string request(const char *method)
+		{
+			std::string text = std::string(method) + " " + path + " HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n";
+			int peer = socket(AF_INET, SOCK_STREAM, 0);
+			if (peer == -1 || connect(peer, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == -1)
+				throw std::runtime_error("loopback connect failed");
+
+			uint64_t mallocs_before = malloc_calls.load(std::memory_order_relaxed);
+			{
+				active_connection client(pool, listener);
+				http_request parsed(text.data(), client->memory);
+				process_client_request(client, parsed, phase_ticks());
+				if (client)
+					account_request(client);
+			}
+			server_mallocs += malloc_calls.load(std::memory_order_relaxed) - mallocs_before;
+
+			std::string response;
+			char buffer[4096];
+			ssize_t received;
+			while ((received = recv(peer, buffer, sizeof(buffer), 0)) > 0)
+				response.append(buffer, received);
+			close(peer);
+			return response;
+		}
+	};
+
+	uint64_t body_phase_count()
+	{
+		phase_histogram histograms[request_phases_count];
+		merge_phase_histograms(histograms);
+		return histograms[static_cast<size_t>(request_phase::body)].count();
+	}
+
+	// a HEAD carries exactly the headers of the GET and reaches neither open nor sendfile
+	bool check_head(loopback_server &server)
+	{
+		std::string get = server.request("GET");
+		uint64_t bodies = body_phase_count();
+		std::string head = server.request("HEAD");
+
+		size_t get_end = get.find("\r\n\r\n");
+		size_t head_end = head.find("\r\n\r\n");
+		if (get_end == std::string::npos || head_end == std::string::npos || head_end + 4 != head.size())
+		{
+			std::cerr << "HEAD check failed: the response has a body or no header block\n";
+			return false;
+		}
+		if (body_phase_count() != bodies)
+		{
+			std::cerr << "HEAD check failed: sendfile of a body was timed\n";
+			return false;
+		}
+
+		// Date and Expires may tick between the two responses
+		auto without_dates = [](std::string text)
+		{
+			std::string result;
+			std::istringstream lines{ text };
+			std::string line;
+			while (getline(lines, line))
+			{
+				if (line.compare(0, 5, "Date:") != 0 && line.compare(0, 8, "Expires:") != 0)
+					result += line + "\n";
+			}
+			return result;
+		};
+		if (without_dates(get.substr(0, get_end)) != without_dates(head.substr(0, head_end)))
+		{
+			std::cerr << "HEAD check failed: the headers differ from those of GET\n";
+			return false;
+		}
+		std::cerr << "HEAD check passed: " << head.size() << " bytes of headers, no body, no sendfile\n";
+		return true;
+	}
+
+	// once warm, parsing, lookup and the response of GET and HEAD of a cached file run on the arena of the connection
+	bool check_allocations(loopback_server &server)
+	{
+		constexpr size_t warm_up = 4;
+		constexpr size_t requests = 64;
+		for (size_t i = 0; i != warm_up; ++i)
+		{
+			server.request("GET");
+			server.request("HEAD");
+		}
+
+		server.server_mallocs = 0;
+		for (size_t i = 0; i != requests; ++i)
+		{
+			server.request("GET");
+			server.request("HEAD");
+		}
+		if (server.server_mallocs)
+		{
+			std::cerr << "Allocation check failed: " << server.server_mallocs << " malloc calls in "
+				<< 2 * requests << " requests\n";
+			return false;
+		}
+		std::cerr << "Allocation check passed: no malloc call in " << 2 * requests << " GET and HEAD requests\n";
+		return true;
+	}
+
+	// files created and deleted under ever new names, read meanwhile, leave the index no larger than a few rebuilds
+	bool check_path_index(const char *path)
+	{
+		constexpr size_t churned = 200000;
+		constexpr size_t bound = 2 * 1024 * 1024;
+		struct stat statbuf;
+		path_index &index = path_index::instance();
+		if (lstat(path, &statbuf) == -1 || !index.scanned(tree_scan{}))
+		{
+			std::cerr << "Path index check failed: the index could not be built\n";
+			return false;
+		}
+
+		std::atomic<size_t> latest{ 0 };
+		std::atomic<bool> churning{ true };
+		size_t hits = 0;
+		std::thread reader = start_helper_thread([&]()
+		{
+			while (churning.load(std::memory_order_relaxed))
+			{
+				std::string name = "/churn/" + std::to_string(latest.load(std::memory_order_relaxed));
+				bool missing;
+				if (index.find(name.data(), name.size(), path_hash(name.data(), name.size()), missing))
+					++hits;
+			}
+		});
+
+		size_t largest = 0;
+		for (size_t i = 0; i != churned; ++i)
+		{
+			std::string name = "/churn/" + std::to_string(i);
+			index.changed(name, &statbuf, false);
+			latest.store(i, std::memory_order_relaxed);
+			index.changed(name, nullptr, false);
+			largest = std::max(largest, index.retained_bytes());
+		}
+		churning.store(false, std::memory_order_relaxed);
+		reader.join();
+
+		// with no reader left, the next event frees whatever the last rebuilds retired
+		index.changed("/churn/last", nullptr, false);
+		size_t left = index.retained_bytes();
+		index.distrust("its check is over");
+		if (largest > bound || left > bound)
+		{
+			std::cerr << "Path index check failed: " << largest << " bytes held at most and " << left << " left after "
+				<< churned << " files\n";
+			return false;
+		}
+		std::cerr << "Path index check passed: " << largest << " bytes held at most and " << left << " left after "
+			<< churned << " files, " << hits << " found while churning\n";
+		return true;
+	}
+
+	std::vector<micro_benchmark> make_benchmarks(const file_metadata &headers_metadata, loopback_server &server)
+	{
+		std::vector<micro_benchmark> benchmarks;
+
+		benchmarks.push_back({ "parse_request", [](size_t iterations)
+		{
+			arena memory;
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				memory.reset();
+				http_request request(request_corpus[i % request_corpus_size], memory);
+				request.parse_request();
+				keep(request.get_status());
+			}
+		} });
+
+		benchmarks.push_back({ "time_t_to_string", [](size_t iterations)
+		{
+			time_t base = 1700000000;
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				std::string text = time_t_to_string(base + static_cast<time_t>(i));
+				keep(text);
+			}
+		} });
+
+		benchmarks.push_back({ "http_response_phrase", [](size_t iterations)
+		{
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				const char *phrase = http_response_phrase(phrase_statuses[i % (sizeof(phrase_statuses) / sizeof(short))]);
+				keep(phrase);
+			}
+		} });
+
+		benchmarks.push_back({ "response head of 200", [&headers_metadata, &server](size_t iterations)
+		{
+			// the written head goes nowhere, only the formatting is measured
+			arena body_memory;
+			response_body body = whole_file_body(body_memory, headers_metadata);
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				response_head head;
+				head.status_line(200);
+				write_headers(head, server.path.data(), headers_metadata, body);
+				keep(head.length());
+			}
+		} });
+
+		benchmarks.push_back({ "GET request over loopback", [&server](size_t iterations)
+		{
+			for (size_t i = 0; i != iterations; ++i)
+				keep(server.request("GET"));
+		} });
+
+		benchmarks.push_back({ "HEAD request over loopback", [&server](size_t iterations)
+		{
+			for (size_t i = 0; i != iterations; ++i)
+				keep(server.request("HEAD"));
+		} });
+
+		benchmarks.push_back({ "mt_safe_queue push+pop", [](size_t iterations)
+		{
+			actual::mt_safe_queue<int> queue;
+			int value = 0;
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				queue.push(static_cast<int>(i));
+				queue.try_pop(value);
+			}
+			keep(value);
+		} });
+
+		benchmarks.push_back({ "mt_safe_queue push_bulk+try_pop_bulk x8", [](size_t iterations)
+		{
+			actual::mt_safe_queue<int> queue;
+			std::vector<int> batch;
+			batch.reserve(8);
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				std::vector<int> elements(8, static_cast<int>(i));
+				queue.push_bulk(std::move(elements));
+				batch.clear();
+				queue.try_pop_bulk(batch, 8);
+			}
+			keep(batch);
+		} });
+
+		benchmarks.push_back({ "stealing_queue push+pop", [](size_t iterations)
+		{
+			actual::stealing_queue<int> queue;
+			int value = 0;
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				queue.push(static_cast<int>(i));
+				queue.try_pop(value);
+			}
+			keep(value);
+		} });
+
+		benchmarks.push_back({ "stealing_queue push+steal", [](size_t iterations)
+		{
+			actual::stealing_queue<int> queue;
+			int value = 0;
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				queue.push(static_cast<int>(i));
+				queue.try_steal(value);
+			}
+			keep(value);
+		} });
+
+		benchmarks.push_back({ "moveable_task create+run", [](size_t iterations)
+		{
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				actual::moveable_task task{ actual::bound_task<void (*)(int), int>{ noop_task, static_cast<int>(i) } };
+				task();
+			}
+		} });
+
+		benchmarks.push_back({ "moveable_task create+move", [](size_t iterations)
+		{
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				actual::moveable_task task{ actual::bound_task<void (*)(int), int>{ noop_task, static_cast<int>(i) } };
+				actual::moveable_task moved{ std::move(task) };
+				keep(moved);
+			}
+		} });
+
+		return benchmarks;
+	}
+
+	void print_text(std::ostream &stream, const std::vector<micro_result> &results)
+	{
+		char line[160];
+		snprintf(line, sizeof(line), "%-42s %14s %12s %12s %12s\n", "benchmark", "iterations", "median ns", "min ns", "max ns");
+		stream << line;
+		for (const micro_result &i: results)
+		{
+			snprintf(line, sizeof(line), "%-42s %14zu %12.2f %12.2f %12.2f\n", i.name.data(), i.iterations,
+					i.median(), i.minimum(), i.maximum());
+			stream << line;
+		}
+	}
+
+	void print_json(std::ostream &stream, const std::vector<micro_result> &results)
+	{
+		stream << "{\n\t\"benchmarks\": [";
+		for (size_t i = 0; i != results.size(); ++i)
+		{
+			const micro_result &result = results[i];
+			stream << (i ? "," : "") << "\n\t\t{\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+				<< ", \"median_ns\": " << result.median() << ", \"min_ns\": " << result.minimum()
+				<< ", \"max_ns\": " << result.maximum() << ", \"samples_ns\": [";
+			for (size_t j = 0; j != result.samples_ns.size(); ++j)
+				stream << (j ? ", " : "") << result.samples_ns[j];
+			stream << "]}";
+		}
+		stream << "\n\t]\n}\n";
+	}
+
+	void print_csv(std::ostream &stream, const std::vector<micro_result> &results)
+	{
+		stream << "name,iterations,median_ns,min_ns,max_ns\n";
+		for (const micro_result &i: results)
+			stream << '"' << i.name << "\"," << i.iterations << ',' << i.median() << ',' << i.minimum() << ',' << i.maximum() << '\n';
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string filter;
+	std::string format = "text";
+	std::string output;
+	unsigned min_time_ms = 200;
+	unsigned samples = 5;
+	bool list = false;
+
+	try
+	{
+		boost::program_options::options_description options("Micro-benchmarks of the hot helpers of the server");
+		options.add_options()
+			("help", "Print this help")
+			("filter,f", boost::program_options::value<std::string>(&filter), "Run only benchmarks whose name contains this text")
+			("list,l", boost::program_options::bool_switch(&list), "List the benchmarks and exit")
+			("min-time,m", boost::program_options::value<unsigned>(&min_time_ms)->default_value(min_time_ms),
+				"Milliseconds every sample lasts at least, the iteration count is calibrated once to reach it")
+			("samples,s", boost::program_options::value<unsigned>(&samples)->default_value(samples),
+				"Samples per benchmark, the median of them is reported")
+			("format", boost::program_options::value<std::string>(&format)->default_value(format), "text, json or csv")
+			("output,o", boost::program_options::value<std::string>(&output), "Write the results to this file instead of stdout");
+
+		boost::program_options::variables_map map;
+		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), map);
+		boost::program_options::notify(map);
+
+		if (map.count("help"))
+		{
+			std::cout << options << "\n";
+			return EXIT_SUCCESS;
+		}
+		if (format != "text" && format != "json" && format != "csv")
+			throw std::invalid_argument("unknown format " + format);
+		if (!samples)
+			throw std::invalid_argument("samples must be positive");
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Command-line arguments error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	char headers_path[] = "/tmp/final_microbench_XXXXXX";
+	int headers_fd = mkstemp(headers_path);
+	if (headers_fd == -1 || write(headers_fd, "<html></html>\n", 14) != 14)
+	{
+		std::cerr << "Failed to create a file for the response head\n";
+		return EXIT_FAILURE;
+	}
+	close(headers_fd);
+
+	// the metadata, including the popen of file, is loaded here rather than inside the measurement
+	std::shared_ptr<const file_metadata> headers_metadata = file_metadata_cache::instance().lookup(headers_path);
+	server_directory = "/tmp";
+	// the send deadlines are armed as in the server
+	timer_wheel::instance().start();
+	loopback_server server;
+	if (!headers_metadata || !server.start(headers_path + 4))
+	{
+		std::cerr << "Failed to prepare the file and the loopback socket for the benchmarks\n";
+		unlink(headers_path);
+		return EXIT_FAILURE;
+	}
+	if (!list && (!check_head(server) || !check_allocations(server)))
+	{
+		unlink(headers_path);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<micro_result> results;
+	for (const micro_benchmark &i: make_benchmarks(*headers_metadata, server))
+	{
+		if (!filter.empty() && std::string(i.name).find(filter) == std::string::npos)
+			continue;
+		if (list)
+		{
+			std::cout << i.name << "\n";
+			continue;
+		}
+		results.push_back(measure(i, min_time_ms * 1e6, samples));
+		if (format != "text" || !output.empty())
+			std::cerr << i.name << " done\n";
+	}
+	// last, as the index it churns answers for the loopback server until distrusted
+	bool indexed = list || check_path_index(headers_path);
+	unlink(headers_path);
+	if (!indexed)
+		return EXIT_FAILURE;
+
+	if (list)
+		return EXIT_SUCCESS;
+
+	std::ofstream file;
+	if (!output.empty())
+	{
+		file.open(output, std::ios::trunc);
+		if (!file)
+		{
+			std::cerr << "Failed to open " << output << "\n";
+			return EXIT_FAILURE;
+		}
+	}
+	std::ostream &stream = output.empty() ? std::cout : file;
+
+	if (format == "json")
+		print_json(stream, results);
+	else if (format == "csv")
+		print_csv(stream, results);
+	else
+		print_text(stream, results);
+
+	return EXIT_SUCCESS;
+}
@@ -1,8 +1,92 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+#include <sched.h>
+#include <dirent.h>
+
 #include "multithreading.h"
 
+std::vector<int> parse_cpu_list(const std::string &list)
+{
+	// accepts the kernel cpulist format, i. e. "0-3,8,10-11"
+	std::vector<int> result;
+	std::istringstream stream{ list };
+	std::string range;
+
+	while (getline(stream, range, ','))
+	{
+		if (range.empty())
+			continue;
+
+		size_t dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+		if (first < 0 || last < first)
+			throw std::invalid_argument("improper cpu range " + range);
+
+		for (int cpu = first; cpu <= last; ++cpu)
+			result.push_back(cpu);
+	}
+
+	return result;
+}
+
+int numa_node_of_cpu(int cpu) noexcept
+{
+	constexpr char nodes_directory[] = "/sys/devices/system/node";
+
+	DIR *directory = opendir(nodes_directory);
+	if (!directory)
+		return 0;
+
+	int node = 0;
+	while (struct dirent *entry = readdir(directory))
+	{
+		int current;
+		if (sscanf(entry->d_name, "node%d", &current) != 1)
+			continue;
+
+		std::ifstream cpulist{ std::string{ nodes_directory } + "/" + entry->d_name + "/cpulist" };
+		std::string list;
+		if (!getline(cpulist, list))
+			continue;
+
+		try
+		{
+			std::vector<int> cpus = parse_cpu_list(list);
+			if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+			{
+				node = current;
+				break;
+			}
+		}
+		catch (...)
+		{
+			continue;
+		}
+	}
+
+	closedir(directory);
+	return node;
+}
+
+bool pin_current_thread(int cpu) noexcept
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return (sched_setaffinity(0, sizeof(set), &set) == 0);
+}
+
 namespace actual
 {
-	thread_local stealing_queue<thread_pool::moveable_task> *thread_pool::local_tasks_queue;
+	thread_local stealing_queue<moveable_task> *thread_pool::local_tasks_queue;
 
 	thread_local size_t thread_pool::thread_index;
 }
@@ -11,9 +11,60 @@
 #include <condition_variable>
 #include <deque>
 #include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <string>
 
 #include <iostream>
 
+#include "tracing.h"
+
+std::vector<int> parse_cpu_list(const std::string &list);
+
+int numa_node_of_cpu(int cpu) noexcept;
+
+bool pin_current_thread(int cpu) noexcept;
+
+enum class task_lane : size_t
+{
+	latency = 0,		// cached or small responses, served by every worker
+	bulk = 1		// large transfers, served by a capped share of workers
+};
+
+constexpr size_t task_lanes_count = 2;
+
+struct thread_pool_settings
+{
+	std::vector<int> cpus;					// workers are pinned round-robin over this list
+	size_t bulk_share_percent = 25;
+	size_t min_workers = 0;					// 0 means all the workers, the pool then never shrinks
+	size_t max_workers = 0;					// 0 means one per cpu of the list or hardware concurrency - 1
+	std::chrono::milliseconds latency_threshold{ 50 };	// queue wait or task run time that calls for one more worker
+	std::chrono::milliseconds idle_timeout{ 30000 };	// workers above the minimum retire after idling this long
+	std::chrono::milliseconds supervision_interval{ 10 };
+	size_t dequeue_batch = 8;				// tasks a worker moves from the common queue at once
+};
+
+struct scaling_statistics
+{
+	size_t workers;
+	size_t min_workers;
+	size_t max_workers;
+	size_t grown;
+	size_t retired;
+};
+
+struct lane_statistics
+{
+	size_t depth;
+	size_t executed;
+	uint64_t total_wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t total_run_ns;
+};
+
 namespace actual
 {
 	template <typename T>
@@ -36,6 +87,32 @@ namespace actual
 			queue.push(std::move(pointer));
 		}
 
+		void push_bulk(std::vector<T> &&elements)
+		{
+			std::vector<std::shared_ptr<T>> pointers;
+			pointers.reserve(elements.size());
+			for (auto &i: elements)
+				pointers.push_back(std::make_shared<T>(std::move(i)));
+			elements.clear();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto &i: pointers)
+				queue.push(std::move(i));
+		}
+
+		size_t try_pop_bulk(std::vector<T> &dest, size_t max_count)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			size_t count = 0;
+			for (; count != max_count && !queue.empty(); ++count)
+			{
+				dest.push_back(std::move(*queue.front()));
+				queue.pop();
+			}
+			return count;
+		}
+
 		bool try_pop(T &dest)
 		{
 			std::lock_guard<std::mutex> lock(mutex);
@@ -109,6 +186,20 @@ namespace actual
 			condv.notify_one();
 		}
 
+		template <typename Iterator>
+		void push_bulk(Iterator first, Iterator last)
+		{
+			std::vector<std::shared_ptr<T>> pointers;
+			for (; first != last; ++first)
+				pointers.push_back(std::make_shared<T>(std::move(*first)));
+
+			// pushed back to front, so the first element is popped first
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto i = pointers.rbegin(); i != pointers.rend(); ++i)
+				deque.push_front(std::move(*i));
+			condv.notify_all();
+		}
+
 		bool try_pop(T &dest)
 		{
 			std::lock_guard<std::mutex> lock(mutex);
@@ -192,140 +283,539 @@ namespace actual
 		}
 	};
 
-	class thread_pool final
+	// a type-erased move-only callable remembering its lane and enqueue time
+	class moveable_task final
 	{
 	private:
-		class moveable_task final
+		struct base_impl
 		{
-		private:
-			struct base_impl
-			{
-				virtual ~base_impl(){}
-				virtual void call() = 0;
-			};
-
-			std::unique_ptr<base_impl> implementation;
+			virtual ~base_impl(){}
+			virtual void call() = 0;
+		};
 
-			template <typename Function>
-			struct curr_impl: public base_impl
-			{
-				Function function;
-				curr_impl(Function f) : function{ std::move(f) }
-				{}
-				void call() override
-				{
-					function();
-				}
-			};
-		public:
-			moveable_task() = default;
-			template <typename Function>
-			moveable_task(Function function) : implementation{ new curr_impl<Function>(std::move(function)) }
-			{}
-			moveable_task(const moveable_task &) = delete;
-			moveable_task &operator=(const moveable_task &) = delete;
-			moveable_task(moveable_task &&other) : implementation{ std::move(other.implementation) }
+		std::unique_ptr<base_impl> implementation;
+	public:
+		task_lane lane = task_lane::latency;
+		std::chrono::steady_clock::time_point enqueued_at;
+	private:
+		template <typename Function>
+		struct curr_impl: public base_impl
+		{
+			Function function;
+			curr_impl(Function f) : function{ std::move(f) }
 			{}
-			moveable_task &operator=(moveable_task &&other)
+			void call() override
 			{
-				if (&other != this)
-					implementation = std::move(other.implementation);
-				return *this;
+				function();
 			}
-
-			void operator()()
+		};
+	public:
+		moveable_task() = default;
+		template <typename Function>
+		moveable_task(Function function) : implementation{ new curr_impl<Function>(std::move(function)) }
+		{}
+		moveable_task(const moveable_task &) = delete;
+		moveable_task &operator=(const moveable_task &) = delete;
+		moveable_task(moveable_task &&other) : implementation{ std::move(other.implementation) },
+			lane{ other.lane }, enqueued_at{ other.enqueued_at }
+		{}
+		moveable_task &operator=(moveable_task &&other)
+		{
+			if (&other != this)
 			{
-				if (implementation)
-					implementation->call();
+				implementation = std::move(other.implementation);
+				lane = other.lane;
+				enqueued_at = other.enqueued_at;
 			}
+			return *this;
+		}
+
+		void operator()()
+		{
+			if (implementation)
+				implementation->call();
+		}
+	};
+
+	template <typename Function, typename Argument>
+	struct bound_task
+	{
+		Function function;
+		Argument argument;
+		void operator()()
+		{
+			function(std::move(argument));
+		}
+	};
+
+	class thread_pool final
+	{
+	private:
+		struct lane_counters
+		{
+			std::atomic<size_t> depth{ 0 };
+			std::atomic<size_t> executed{ 0 };
+			std::atomic<uint64_t> total_wait_ns{ 0 };
+			std::atomic<uint64_t> max_wait_ns{ 0 };
+			std::atomic<uint64_t> total_run_ns{ 0 };
+		};
+
+		struct worker_slot
+		{
+			std::atomic<bool> active{ false };
+			std::atomic<int64_t> busy_since_ns{ 0 };
+			std::atomic<uint64_t> steals{ 0 };
 		};
 
 		std::atomic<bool> terminate_flag;
+		lane_counters lanes[task_lanes_count];
+		mt_safe_queue<moveable_task> bulk_tasks_queue;
+		std::atomic<size_t> active_bulk_tasks{ 0 };
+		size_t bulk_workers_cap = 1;
 		mt_safe_queue<moveable_task> common_tasks_queue;
 		std::vector<std::unique_ptr<stealing_queue<moveable_task>>> task_queues;
 		static thread_local stealing_queue<moveable_task> *local_tasks_queue;
 		static thread_local size_t thread_index;
 
+		const thread_pool_settings settings;
+		std::vector<int> worker_cpus;
+		std::vector<int> worker_nodes;
+		std::vector<std::vector<size_t>> victims;
+
+		std::mutex placement_mutex;
+		std::condition_variable placement_condv;
+		size_t placed_workers = 0;
+
+		std::unique_ptr<worker_slot[]> slots;
+		std::atomic<size_t> active_workers{ 0 };
+		std::atomic<size_t> grown_count{ 0 };
+		std::atomic<size_t> retired_count{ 0 };
+
 		std::vector<std::thread> threads;
 		thread_joiner joiner_of_pool_threads;
 
-		bool try_steal(moveable_task &dest)
+		std::mutex supervisor_mutex;
+		std::condition_variable supervisor_condv;
+		std::thread supervisor;
+
+		static int64_t now_ns() noexcept
+		{
+			using namespace std::chrono;
+			return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+		}
+
+		static size_t maximal_workers(const thread_pool_settings &settings) noexcept
+		{
+			if (settings.max_workers)
+				return std::max<size_t>(settings.max_workers, 1);
+			if (!settings.cpus.empty())
+				return settings.cpus.size();
+			return std::max<size_t>(std::thread::hardware_concurrency(), 2) - 1;
+		}
+
+		size_t minimal_workers() const noexcept
+		{
+			if (!settings.min_workers)
+				return threads.size();
+			return std::min(settings.min_workers, threads.size());
+		}
+
+		void set_stealing_order()
 		{
-			for (size_t i = 0; i != task_queues.size(); ++i)
+			// same-node victims go first, then the rest, both in ring order from the thief
+			victims.resize(worker_nodes.size());
+			for (size_t thief = 0; thief != worker_nodes.size(); ++thief)
 			{
-				size_t index = (thread_index + i + 1) % task_queues.size();
+				for (int pass = 0; pass != 2; ++pass)
+				{
+					for (size_t i = 1; i < worker_nodes.size(); ++i)
+					{
+						size_t victim = (thief + i) % worker_nodes.size();
+						bool same_node = (worker_nodes[victim] == worker_nodes[thief]);
+						if (same_node == (pass == 0))
+							victims[thief].push_back(victim);
+					}
+				}
+			}
+		}
 
+		bool try_steal(moveable_task &dest)
+		{
+			for (size_t index: victims[thread_index])
+			{
 				if (task_queues[index] && task_queues[index]->try_steal(dest))
+				{
+					std::atomic<uint64_t> &steals = slots[thread_index].steals;
+					steals.store(steals.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					trace_instant("steal", "victim", index);
 					return true;
+				}
 			}
 
 			return false;
 		}
 
-		void working_loop(size_t index)
+		void place_worker(size_t index, bool initial)
+		{
+			if (index < worker_cpus.size() && worker_cpus[index] != -1 && !pin_current_thread(worker_cpus[index]))
+				worker_cpus[index] = -1;
+
+			if (!initial)
+				return;
+
+			// the queue is created after pinning, so its memory is first touched on the local node
+			task_queues[index].reset(new stealing_queue<moveable_task>);
+
+			std::unique_lock<std::mutex> lock(placement_mutex);
+			++placed_workers;
+			placement_condv.notify_all();
+			placement_condv.wait(lock, [this]() { return placed_workers == minimal_workers() || terminate_flag.load(); });
+		}
+
+		bool try_pop_common(moveable_task &dest, std::vector<moveable_task> &batch)
+		{
+			if (settings.dequeue_batch <= 1 || !local_tasks_queue)
+				return common_tasks_queue.try_pop(dest);
+
+			// the surplus of the batch lands in the local queue, where idle workers may still steal it
+			batch.clear();
+			if (!common_tasks_queue.try_pop_bulk(batch, settings.dequeue_batch))
+				return false;
+
+			trace_instant("dequeue batch", "tasks", batch.size());
+			dest = std::move(batch.front());
+			local_tasks_queue->push_bulk(batch.begin() + 1, batch.end());
+			return true;
+		}
+
+		bool try_pop_bulk(moveable_task &dest)
+		{
+			if (active_bulk_tasks.fetch_add(1) >= bulk_workers_cap)
+			{
+				--active_bulk_tasks;
+				return false;
+			}
+			if (bulk_tasks_queue.try_pop(dest))
+				return true;
+
+			--active_bulk_tasks;
+			return false;
+		}
+
+		void run_task(moveable_task &task)
+		{
+			using namespace std::chrono;
+
+			lane_counters &counters = lanes[static_cast<size_t>(task.lane)];
+			--counters.depth;
+
+			steady_clock::time_point started = steady_clock::now();
+			uint64_t waited = duration_cast<nanoseconds>(started - task.enqueued_at).count();
+			counters.total_wait_ns += waited;
+			uint64_t max_wait = counters.max_wait_ns.load(std::memory_order_relaxed);
+			while (waited > max_wait && !counters.max_wait_ns.compare_exchange_weak(max_wait, waited))
+			{}
+
+			slots[thread_index].busy_since_ns.store(duration_cast<nanoseconds>(started.time_since_epoch()).count(),
+					std::memory_order_relaxed);
+
+			try
+			{
+				task();
+			}
+			catch (std::exception &e)
+			{
+				std::cerr << std::this_thread::get_id() << " got an exception: " << e.what() << std::endl;
+			}
+			catch (...)
+			{
+				std::cerr << std::this_thread::get_id() << " got unknown exception thrown" << std::endl;
+			}
+
+			slots[thread_index].busy_since_ns.store(0, std::memory_order_relaxed);
+
+			steady_clock::time_point finished = steady_clock::now();
+			trace_span(task.lane == task_lane::bulk ? "bulk task" : "task", started, finished, "wait_us", waited / 1000);
+
+			counters.total_run_ns += duration_cast<nanoseconds>(finished - started).count();
+			++counters.executed;
+			if (task.lane == task_lane::bulk)
+				--active_bulk_tasks;
+		}
+
+		bool try_retire()
+		{
+			// only the worker itself pushes to its local queue, so an empty one stays empty after leaving
+			if (local_tasks_queue && !local_tasks_queue->empty())
+				return false;
+
+			size_t workers = active_workers.load();
+			while (workers > minimal_workers())
+			{
+				if (active_workers.compare_exchange_weak(workers, workers - 1))
+				{
+					slots[thread_index].active.store(false, std::memory_order_release);
+					++retired_count;
+					trace_instant("retire", "workers", workers - 1);
+					std::clog << "Thread pool shrank to " << workers - 1 << " workers: worker #"
+						<< thread_index << " was idle" << std::endl;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void report_placement()
+		{
+			std::clog << "Thread pool of " << minimal_workers() << ".." << threads.size() << " workers, at most "
+				<< bulk_workers_cap << " of them serve bulk transfers:\n";
+			for (size_t i = 0; i != threads.size(); ++i)
+			{
+				std::clog << "\tworker #" << i;
+				if (i < worker_cpus.size() && worker_cpus[i] != -1)
+					std::clog << " pinned to cpu " << worker_cpus[i] << " (node " << worker_nodes[i] << ")";
+				else
+					std::clog << " is not pinned";
+				std::clog << (slots[i].active.load() ? "\n" : ", spare\n");
+			}
+			std::clog.flush();
+		}
+
+		void working_loop(size_t index, bool initial)
 		{
 			thread_index = index;
+			trace_recorder::name_thread(("worker #" + std::to_string(index)).data());
+			place_worker(index, initial);
 			local_tasks_queue = task_queues[thread_index].get();
 
+			int64_t last_task_ns = now_ns();
+			const int64_t idle_timeout_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(settings.idle_timeout).count();
+
+			std::vector<moveable_task> batch;
+			batch.reserve(settings.dequeue_batch);
+
 			while (!terminate_flag.load())
 			{
 				moveable_task task;
 
-				if ((local_tasks_queue && local_tasks_queue->try_pop(task)) || common_tasks_queue.try_pop(task)	|| try_steal(task))
+				if ((local_tasks_queue && local_tasks_queue->try_pop(task)) || try_pop_common(task, batch)
+					|| try_pop_bulk(task) || try_steal(task))
 				{
-					try
-					{
-						task();
-					}
-					catch (std::exception &e)
-					{
-						std::cerr << std::this_thread::get_id() << " got an exception: " << e.what() << std::endl;
-					}
-					catch (...)
-					{
-						std::cerr << std::this_thread::get_id() << " got unknown exception thrown" << std::endl;
-					}
+					run_task(task);
+					last_task_ns = now_ns();
 				}
+				else if (now_ns() - last_task_ns > idle_timeout_ns && try_retire())
+					return;
 				else
 					std::this_thread::yield();
 			}
 		}
 
+		bool try_grow(const char *reason)
+		{
+			size_t workers = active_workers.load();
+			if (workers >= threads.size())
+				return false;
+
+			for (size_t i = 0; i != threads.size(); ++i)
+			{
+				if (slots[i].active.load(std::memory_order_acquire))
+					continue;
+
+				if (threads[i].joinable())
+					threads[i].join();
+
+				slots[i].active.store(true);
+				++active_workers;
+				try
+				{
+					threads[i] = std::thread(&thread_pool::working_loop, this, i, false);
+				}
+				catch (...)
+				{
+					slots[i].active.store(false);
+					--active_workers;
+					std::cerr << "thread pool failed to start worker #" << i << std::endl;
+					return false;
+				}
+
+				++grown_count;
+				trace_instant("grow", "workers", workers + 1);
+				std::clog << "Thread pool grew to " << workers + 1 << " workers: " << reason << std::endl;
+				return true;
+			}
+			return false;
+		}
+
+		void supervising_loop()
+		{
+			const int64_t threshold_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(settings.latency_threshold).count();
+			lane_statistics previous = get_lane_statistics(task_lane::latency);
+
+			std::unique_lock<std::mutex> lock(supervisor_mutex);
+			while (!terminate_flag.load())
+			{
+				supervisor_condv.wait_for(lock, settings.supervision_interval);
+				if (terminate_flag.load())
+					break;
+
+				lane_statistics current = get_lane_statistics(task_lane::latency);
+				size_t executed = current.executed - previous.executed;
+				uint64_t average_wait = executed ? (current.total_wait_ns - previous.total_wait_ns) / executed : 0;
+				previous = current;
+
+				size_t blocked = 0;
+				int64_t now = now_ns();
+				for (size_t i = 0; i != threads.size(); ++i)
+				{
+					int64_t busy_since = slots[i].busy_since_ns.load(std::memory_order_relaxed);
+					if (slots[i].active.load() && busy_since && now - busy_since > threshold_ns)
+						++blocked;
+				}
+
+				if (average_wait > static_cast<uint64_t>(threshold_ns))
+					try_grow("queue latency crossed the threshold");
+				else if (current.depth && blocked >= active_workers.load())
+					try_grow("all workers are blocked");
+			}
+		}
+
 	public:
-		thread_pool() : terminate_flag{ false },
-				task_queues(std::thread::hardware_concurrency() - 1),
-				threads(std::thread::hardware_concurrency() - 1),
+		explicit thread_pool(thread_pool_settings pool_settings = thread_pool_settings{}) : terminate_flag{ false },
+				task_queues(maximal_workers(pool_settings)),
+				settings(std::move(pool_settings)),
+				worker_cpus(task_queues.size(), -1),
+				worker_nodes(task_queues.size(), -1),
+				slots(new worker_slot[task_queues.size()]),
+				threads(task_queues.size()),
 				joiner_of_pool_threads{ threads }
 		{
 			try
 			{
-				for (auto &i: task_queues)
-					i.reset(new stealing_queue<moveable_task>);
+				bulk_workers_cap = std::max<size_t>(1, threads.size() * std::min<size_t>(settings.bulk_share_percent, 100) / 100);
 
-				for (size_t i = 0; i != threads.size(); ++i)
-					threads[i] = std::thread(&thread_pool::working_loop, this, i);
+				for (size_t i = 0; i != worker_cpus.size() && !settings.cpus.empty(); ++i)
+				{
+					worker_cpus[i] = settings.cpus[i % settings.cpus.size()];
+					worker_nodes[i] = numa_node_of_cpu(worker_cpus[i]);
+				}
+				set_stealing_order();
+
+				for (size_t i = minimal_workers(); i != task_queues.size(); ++i)
+					task_queues[i].reset(new stealing_queue<moveable_task>);
+
+				for (size_t i = 0; i != minimal_workers(); ++i)
+				{
+					slots[i].active.store(true);
+					++active_workers;
+					threads[i] = std::thread(&thread_pool::working_loop, this, i, true);
+				}
+
+				std::unique_lock<std::mutex> lock(placement_mutex);
+				placement_condv.wait(lock, [this]() { return placed_workers == minimal_workers(); });
+				lock.unlock();
+
+				if (minimal_workers() < threads.size())
+					supervisor = std::thread(&thread_pool::supervising_loop, this);
 			}
 			catch (...)
 			{
-				terminate_flag.store(true, std::memory_order_release);
+				{
+					std::lock_guard<std::mutex> lock(placement_mutex);
+					terminate_flag.store(true, std::memory_order_release);
+				}
+				placement_condv.notify_all();
 				std::cerr << "thread pool initialization failed" << std::endl;
+				return;
 			}
+
+			report_placement();
 		}
 		~thread_pool()
 		{
-			terminate_flag.store(true, std::memory_order_release);
+			{
+				std::lock_guard<std::mutex> lock(supervisor_mutex);
+				terminate_flag.store(true, std::memory_order_release);
+			}
+			supervisor_condv.notify_all();
+			if (supervisor.joinable())
+				supervisor.join();
 		}
 
 		template <typename Function, typename Argument>
 		void enqueue_task(Function &&function, Argument &&argument)
 		{
-			moveable_task task{ std::bind(function, std::move(argument)) };
+			enqueue_task(task_lane::latency, std::forward<Function>(function), std::forward<Argument>(argument));
+		}
 
-			if (local_tasks_queue)
+		template <typename Function, typename Argument>
+		void enqueue_task(task_lane lane, Function &&function, Argument &&argument)
+		{
+			using task_type = bound_task<typename std::decay<Function>::type, typename std::decay<Argument>::type>;
+			moveable_task task{ task_type{ function, std::move(argument) } };
+			task.lane = lane;
+			task.enqueued_at = std::chrono::steady_clock::now();
+
+			++lanes[static_cast<size_t>(lane)].depth;
+			trace_instant("enqueue", "lane", static_cast<int64_t>(lane));
+
+			if (lane == task_lane::bulk)
+				bulk_tasks_queue.push(std::move(task));
+			else if (local_tasks_queue)
 				local_tasks_queue->push(std::move(task));
 			else
 				common_tasks_queue.push(std::move(task));
 		}
+
+		template <typename Function, typename Argument>
+		void enqueue_bulk(Function &&function, std::vector<Argument> &&arguments)
+		{
+			using task_type = bound_task<typename std::decay<Function>::type, Argument>;
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			std::vector<moveable_task> tasks;
+			tasks.reserve(arguments.size());
+			for (auto &i: arguments)
+			{
+				tasks.emplace_back(task_type{ function, std::move(i) });
+				tasks.back().enqueued_at = now;
+			}
+			arguments.clear();
+
+			lanes[static_cast<size_t>(task_lane::latency)].depth += tasks.size();
+			trace_instant("enqueue batch", "tasks", tasks.size());
+
+			if (local_tasks_queue)
+				local_tasks_queue->push_bulk(tasks.begin(), tasks.end());
+			else
+				common_tasks_queue.push_bulk(std::move(tasks));
+		}
+
+		lane_statistics get_lane_statistics(task_lane lane) const noexcept
+		{
+			const lane_counters &counters = lanes[static_cast<size_t>(lane)];
+			return lane_statistics{ counters.depth.load(), counters.executed.load(),
+				counters.total_wait_ns.load(), counters.max_wait_ns.load(), counters.total_run_ns.load() };
+		}
+
+		scaling_statistics get_scaling_statistics() const noexcept
+		{
+			return scaling_statistics{ active_workers.load(), minimal_workers(), threads.size(),
+				grown_count.load(), retired_count.load() };
+		}
+
+		size_t size() const noexcept
+		{
+			return active_workers.load();
+		}
+
+		uint64_t get_steals_count() const noexcept
+		{
+			uint64_t result = 0;
+			for (size_t i = 0; i != threads.size(); ++i)
+				result += slots[i].steals.load(std::memory_order_relaxed);
+			return result;
+		}
 	};
 }
 
@@ -609,7 +1099,7 @@ namespace dummy
 		}
 
 	public:
-		thread_pool()
+		explicit thread_pool(thread_pool_settings settings = thread_pool_settings{})
 			//	: terminate_flag{ false },
 			//	task_queues(std::thread::hardware_concurrency() - 1),
 			//	threads(std::thread::hardware_concurrency() - 1),
@@ -628,6 +1118,9 @@ namespace dummy
 			//	terminate_flag.store(true, std::memory_order_release);
 			//	std::cerr << "thread pool initialization failed" << std::endl;
 			//}
+
+			if (!settings.cpus.empty())
+				std::clog << "Connections are processed inline, worker cpu list is ignored" << std::endl;
 		}
 		~thread_pool()
 		{
@@ -647,9 +1140,47 @@ namespace dummy
 			//else
 			//	common_tasks_queue.push(std::move(task));
 		}
+
+		template <typename Function, typename Argument>
+		void enqueue_task(task_lane, Function &&function, Argument &&argument)
+		{
+			function(std::move(argument));
+		}
+
+		template <typename Function, typename Argument>
+		void enqueue_bulk(Function &&function, std::vector<Argument> &&arguments)
+		{
+			for (auto &i: arguments)
+				function(std::move(i));
+			arguments.clear();
+		}
+
+		lane_statistics get_lane_statistics(task_lane) const noexcept
+		{
+			return lane_statistics{ 0, 0, 0, 0, 0 };
+		}
+
+		scaling_statistics get_scaling_statistics() const noexcept
+		{
+			return scaling_statistics{ 0, 0, 0, 0, 0 };
+		}
+
+		size_t size() const noexcept
+		{
+			return 0;
+		}
+
+		uint64_t get_steals_count() const noexcept
+		{
+			return 0;
+		}
 	};
 }
 
+#if defined(ACTUAL_THREAD_POOL) && ACTUAL_THREAD_POOL
+using namespace actual;
+#else
 using namespace dummy;
+#endif
 
 #endif
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <vector>
+
+#include <cstring>
+
+#include "path_filter.h"
+#include "logging.h"
+
+constexpr size_t missing_paths::shards_count;
+constexpr size_t path_filter::hashes_count;
+constexpr size_t path_filter::bits_per_file;
+constexpr size_t path_filter::minimal_bits;
+
+missing_paths::missing_paths(size_t capacity, std::chrono::milliseconds time_to_live) noexcept :
+	entries_per_shard{ std::max<size_t>(capacity / shards_count, 1) }, ttl{ time_to_live }
+{}
+
+missing_paths &missing_paths::instance()
+{
+	static missing_paths *object = new missing_paths(server_negative_cache_entries,
+			std::chrono::milliseconds(server_negative_ttl_ms));
+	return *object;
+}
+
+bool missing_paths::contains(const std::string &path)
+{
+	if (!enabled())
+		return false;
+
+	shard &owner = shard_of(path);
+	std::lock_guard<std::mutex> lock(owner.mutex);
+	auto found = owner.expiries.find(path);
+	if (found == owner.expiries.end())
+		return false;
+	if (found->second > std::chrono::steady_clock::now())
+		return true;
+	owner.expiries.erase(found);
+	return false;
+}
+
+bool missing_paths::contains(const char *path, size_t length)
+{
+	if (!enabled())
+		return false;
+
+	return contains(reused_key(path, length));
+}
+
+void missing_paths::remember(const std::string &path)
+{
+	if (!enabled())
+		return;
+
+	shard &owner = shard_of(path);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(owner.mutex);
+	if (owner.expiries.size() >= entries_per_shard && !owner.expiries.count(path))
+	{
+		// a scan of random paths must not grow the map, so the first expired entry or any entry goes
+		auto victim = owner.expiries.begin();
+		for (auto i = owner.expiries.begin(); i != owner.expiries.end(); ++i)
+		{
+			if (i->second <= now)
+			{
+				victim = i;
+				break;
+			}
+		}
+		owner.expiries.erase(victim);
+	}
+	owner.expiries[path] = now + ttl;
+}
+
+void missing_paths::forget(const std::string &path)
+{
+	if (!enabled())
+		return;
+
+	shard &owner = shard_of(path);
+	std::lock_guard<std::mutex> lock(owner.mutex);
+	owner.expiries.erase(path);
+}
+
+path_filter &path_filter::instance()
+{
+	static path_filter *object = new path_filter;
+	return *object;
+}
+
+uint64_t path_filter::hash_of(const char *path, size_t length) noexcept
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i != length; ++i)
+	{
+		hash ^= static_cast<unsigned char>(path[i]);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+void path_filter::insert(const std::string &path) noexcept
+{
+	// double hashing: the i-th bit is first + i * step
+	uint64_t first = hash_of(path.data(), path.size());
+	uint64_t step = ((first ^ (first >> 29)) * 0xbf58476d1ce4e5b9ull) | 1;
+	for (size_t i = 0; i != hashes_count; ++i)
+	{
+		uint64_t bit = (first + i * step) & bits_mask;
+		std::atomic<uint64_t> &word = words[bit >> 6];
+		word.store(word.load(std::memory_order_relaxed) | (uint64_t(1) << (bit & 63)), std::memory_order_relaxed);
+	}
+}
+
+bool path_filter::rules_out(const char *path, size_t length) const noexcept
+{
+	if (!trusted.load(std::memory_order_acquire) || !is_canonical(path, length))
+		return false;
+
+	uint64_t first = hash_of(path, length);
+	uint64_t step = ((first ^ (first >> 29)) * 0xbf58476d1ce4e5b9ull) | 1;
+	for (size_t i = 0; i != hashes_count; ++i)
+	{
+		uint64_t bit = (first + i * step) & bits_mask;
+		if (!(words[bit >> 6].load(std::memory_order_relaxed) & (uint64_t(1) << (bit & 63))))
+			return true;
+	}
+	return false;
+}
+
+bool path_filter::is_canonical(const char *path, size_t size) noexcept
+{
+	if (size == 0 || path[0] != '/')
+		return false;
+
+	size_t start = 1;
+	while (start <= size)
+	{
+		const char *slash = static_cast<const char *>(memchr(path + start, '/', size - start));
+		size_t end = slash ? slash - path : size;
+		size_t length = end - start;
+		if (length == 0 && end != size)
+			return false;
+		if ((length == 1 && path[start] == '.') || (length == 2 && path[start] == '.' && path[start + 1] == '.'))
+			return false;
+		// a trailing slash names a directory, never a file in the filter, yet the kernel may resolve it otherwise
+		if (length == 0 && size > 1)
+			return false;
+		start = end + 1;
+	}
+	return true;
+}
+
+bool path_filter::scanned(const tree_scan &tree)
+{
+	// a link to a directory watched under another path hides the files below it, which must not be ruled out
+	if (!tree.unfollowed.empty())
+	{
+		log_record{} << "Path filter is unavailable, " << tree.unfollowed.front() << " leads to a directory seen already\n";
+		return false;
+	}
+
+	size_t bits = minimal_bits;
+	while (bits < tree.files.size() * bits_per_file)
+		bits <<= 1;
+	words.reset(new std::atomic<uint64_t>[bits / 64]);
+	for (size_t i = 0; i != bits / 64; ++i)
+		words[i].store(0, std::memory_order_relaxed);
+	bits_mask = bits - 1;
+
+	for (const tree_file &i: tree.files)
+		insert(i.path);
+
+	std::clog << "Path filter of " << bits / 8192 << " KiB holds " << tree.files.size() << " files" << std::endl;
+	trusted.store(true, std::memory_order_release);
+	return true;
+}
+
+void path_filter::changed(const std::string &path, const struct stat *statbuf, bool)
+{
+	if (!statbuf)
+		return;
+	insert(path);
+	missing_paths::instance().forget(path);
+}
+
+void path_filter::removed(const std::vector<std::string> &)
+{
+	// the paths stay in the filter as false positives
+}
+
+void path_filter::unfollowed(const std::string &link)
+{
+	log_record{} << "Path filter does not see below " << link << "\n";
+	distrust("a symbolic link leads to a directory seen already");
+}
+
+void path_filter::distrust(const char *reason) noexcept
+{
+	trusted.store(false, std::memory_order_release);
+	log_record{} << "Path filter disabled until restart: " << reason << "\n";
+}
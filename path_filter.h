@@ -0,0 +1,101 @@
+#ifndef __PATH_FILTER_H__
+#define __PATH_FILTER_H__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tree_watcher.h"
+
+class missing_paths final
+{
+	// URL paths found to have no file, trusted for a TTL or until inotify sees them created
+private:
+	static constexpr size_t shards_count = 16;
+
+	struct shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string, std::chrono::steady_clock::time_point> expiries;
+	};
+
+	shard shards[shards_count];
+	const size_t entries_per_shard;
+	const std::chrono::milliseconds ttl;
+
+	missing_paths(size_t capacity, std::chrono::milliseconds time_to_live) noexcept;
+
+	shard &shard_of(const std::string &path) noexcept
+	{
+		return shards[std::hash<std::string>{}(path) % shards_count];
+	}
+public:
+	static missing_paths &instance();
+	missing_paths(const missing_paths &) = delete;
+	missing_paths &operator=(const missing_paths &) = delete;
+
+	bool enabled() const noexcept
+	{
+		return ttl.count() != 0;
+	}
+
+	bool contains(const std::string &path);
+	bool contains(const char *path, size_t length);
+	void remember(const std::string &path);
+	void remember(const char *path, size_t length)
+	{
+		if (enabled())
+			remember(std::string(path, length));
+	}
+	void forget(const std::string &path);
+};
+
+class path_filter final : public tree_listener
+{
+	// Bloom filter of the URL path of every file under the directory, so most missing paths need no syscall;
+	// files are only ever added, deleted ones stay as false positives for the stat to sort out
+public:
+	static constexpr size_t hashes_count = 6;
+	static constexpr size_t bits_per_file = 16;
+	static constexpr size_t minimal_bits = size_t(1) << 20;
+private:
+	std::unique_ptr<std::atomic<uint64_t>[]> words;		// written by the watching thread only
+	size_t bits_mask = 0;
+	std::atomic<bool> trusted{ false };			// cleared for good once an event may have been missed
+
+	path_filter() noexcept = default;
+
+	static uint64_t hash_of(const char *path, size_t length) noexcept;
+	void insert(const std::string &path) noexcept;
+public:
+	static path_filter &instance();
+	path_filter(const path_filter &) = delete;
+	path_filter &operator=(const path_filter &) = delete;
+
+	// built from the scan of tree_watcher, kept current by its events
+	bool scanned(const tree_scan &tree) override;
+	void changed(const std::string &path, const struct stat *statbuf, bool linked) override;
+	void removed(const std::vector<std::string> &directories) override;
+	void unfollowed(const std::string &link) override;
+	void distrust(const char *reason) noexcept override;
+
+	// without dot segments or empty segments, so a path names a file in one way only
+	static bool is_canonical(const char *path, size_t length) noexcept;
+	static bool is_canonical(const std::string &path) noexcept
+	{
+		return is_canonical(path.data(), path.size());
+	}
+
+	// true only when the path surely names no file
+	bool rules_out(const char *path, size_t length) const noexcept;
+	bool rules_out(const std::string &path) const noexcept
+	{
+		return rules_out(path.data(), path.size());
+	}
+};
+
+#endif
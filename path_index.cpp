@@ -0,0 +1,338 @@
+#include <cstdint>
+#include <cstring>
+
+#include "path_index.h"
+#include "path_filter.h"
+#include "access_log.h"
+#include "statistics.h"
+#include "logging.h"
+
+constexpr size_t path_index::minimal_slots;
+
+struct path_index::reader_slot
+{
+	std::atomic<uint64_t> epoch{ 0 };
+	std::atomic<bool> owned{ true };
+};
+
+struct path_index::reader_holder
+{
+	reader_slot *slot = nullptr;
+	size_t depth = 0;
+
+	~reader_holder()
+	{
+		if (slot)
+			slot->owned.store(false, std::memory_order_release);
+	}
+};
+
+thread_local path_index::reader_holder path_index::local_reader;
+
+path_index &path_index::instance()
+{
+	static path_index *object = new path_index;
+	return *object;
+}
+
+bool path_index::is_tracked(const struct stat &statbuf) noexcept
+{
+	// a file with other hard links may change through a directory that is not watched
+	return S_ISREG(statbuf.st_mode) && statbuf.st_nlink == 1;
+}
+
+std::unique_ptr<path_index::table> path_index::make_table(size_t slots)
+{
+	std::unique_ptr<table> made(new table);
+	made->mask = slots - 1;
+	made->slots.reset(new std::atomic<entry *>[slots]);
+	for (size_t i = 0; i != slots; ++i)
+		made->slots[i].store(nullptr, std::memory_order_relaxed);
+	made->used = 0;
+	return made;
+}
+
+path_index::entry *path_index::probe(const table &where, const char *path, size_t length, uint64_t hash) noexcept
+{
+	// linear probing in a table at most half full, so an empty slot always ends the search
+	for (size_t i = hash & where.mask; ; i = (i + 1) & where.mask)
+	{
+		entry *candidate = where.slots[i].load(std::memory_order_acquire);
+		if (!candidate)
+			return nullptr;
+		if (candidate->hash == hash && candidate->path.size() == length && !memcmp(candidate->path.data(), path, length))
+			return candidate;
+	}
+}
+
+void path_index::place(table &where, entry *added) noexcept
+{
+	size_t i = added->hash & where.mask;
+	while (where.slots[i].load(std::memory_order_relaxed))
+		i = (i + 1) & where.mask;
+	where.slots[i].store(added, std::memory_order_release);
+	++where.used;
+}
+
+bool path_index::enter() noexcept
+{
+	if (!local_reader.slot)
+	{
+		try
+		{
+			std::lock_guard<std::mutex> lock(readers_mutex);
+			for (reader_slot *i: readers)
+			{
+				bool owned = false;
+				if (i->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+				{
+					local_reader.slot = i;
+					break;
+				}
+			}
+			if (!local_reader.slot)
+			{
+				std::unique_ptr<reader_slot> added(new reader_slot);
+				readers.push_back(added.get());
+				local_reader.slot = added.release();
+			}
+		}
+		catch (std::exception &)
+		{
+			return false;
+		}
+	}
+
+	// the epoch is published before the table is loaded: a rebuild either sees it, or swapped the table before
+	if (local_reader.depth++ == 0)
+		local_reader.slot->epoch.store(epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	return true;
+}
+
+void path_index::leave() noexcept
+{
+	if (--local_reader.depth == 0)
+		local_reader.slot->epoch.store(0, std::memory_order_release);
+}
+
+void path_index::reclaim()
+{
+	// a retirement tagged with the epoch a reader entered at or before was swapped out before that reader loaded
+	uint64_t oldest = UINT64_MAX;
+	{
+		std::lock_guard<std::mutex> lock(readers_mutex);
+		for (const reader_slot *i: readers)
+		{
+			uint64_t entered = i->epoch.load(std::memory_order_seq_cst);
+			if (entered && entered < oldest)
+				oldest = entered;
+		}
+	}
+
+	size_t freed = 0;
+	while (freed != retired.size() && retired[freed].epoch <= oldest)
+		++freed;
+	retired.erase(retired.begin(), retired.begin() + freed);
+}
+
+void path_index::rebuild()
+{
+	// deleted files are left out, readers still probing the old table miss only the entries added from now on;
+	// at most a quarter full, so the next rebuild waits for as many additions again
+	std::vector<std::unique_ptr<entry>> kept, dropped;
+	for (std::unique_ptr<entry> &i: entries)
+	{
+		if (std::atomic_load(&i->file))
+			kept.push_back(std::move(i));
+		else
+			dropped.push_back(std::move(i));
+	}
+
+	size_t slots = minimal_slots;
+	while (slots < 4 * (kept.size() + 1))
+		slots <<= 1;
+	std::unique_ptr<table> rebuilt = make_table(slots);
+	files_of.clear();
+	for (const std::unique_ptr<entry> &i: kept)
+	{
+		place(*rebuilt, i.get());
+		files_of[i->path.substr(0, i->path.rfind('/'))].push_back(i.get());
+	}
+	entries.swap(kept);
+
+	std::unique_ptr<table> replaced = std::move(current_table);
+	current_table = std::move(rebuilt);
+	current.store(current_table.get(), std::memory_order_seq_cst);
+	retired.push_back(retirement{ epoch.fetch_add(1, std::memory_order_seq_cst) + 1, std::move(replaced),
+			std::move(dropped) });
+	reclaim();
+}
+
+void path_index::publish(const std::string &path, const struct stat *statbuf)
+{
+	std::shared_ptr<const indexed_file> file;
+	if (statbuf && !S_ISDIR(statbuf->st_mode))
+	{
+		std::shared_ptr<indexed_file> snapshot = std::make_shared<indexed_file>();
+		snapshot->statbuf = *statbuf;
+		file = std::move(snapshot);
+
+		// a symbolic link may lead to a directory, whose files the index leaves to the filesystem
+		if (S_ISLNK(statbuf->st_mode) && misses_authoritative.load(std::memory_order_relaxed))
+		{
+			misses_authoritative.store(false, std::memory_order_relaxed);
+			log_record{} << "Path index leaves missing paths to the filesystem, " << path << " is a symbolic link\n";
+		}
+	}
+
+	// what a rebuild retired while readers were still probing goes with the next event
+	if (!retired.empty())
+		reclaim();
+
+	uint64_t hash = path_hash(path.data(), path.size());
+	table *where = current.load(std::memory_order_relaxed);
+	entry *found = probe(*where, path.data(), path.size(), hash);
+	if (found)
+	{
+		std::atomic_store(&found->file, file);
+		return;
+	}
+	if (!file)
+		return;
+
+	if ((where->used + 1) * 2 > where->mask + 1)
+	{
+		rebuild();
+		where = current.load(std::memory_order_relaxed);
+	}
+
+	entries.emplace_back(new entry{ hash, path, std::move(file) });
+	place(*where, entries.back().get());
+	files_of[path.substr(0, path.rfind('/'))].push_back(entries.back().get());
+}
+
+bool path_index::scanned(const tree_scan &tree)
+{
+	size_t slots = minimal_slots;
+	while (slots < 2 * (tree.files.size() + 1))
+		slots <<= 1;
+	current_table = make_table(slots);
+	current.store(current_table.get(), std::memory_order_seq_cst);
+	for (const tree_file &i: tree.files)
+	{
+		if (!i.linked)
+			publish(i.path, &i.statbuf);
+	}
+
+	std::clog << "Path index of " << current.load(std::memory_order_relaxed)->mask + 1 << " slots holds "
+		<< entries.size() << " files" << std::endl;
+	trusted.store(true, std::memory_order_release);
+	return true;
+}
+
+void path_index::changed(const std::string &path, const struct stat *statbuf, bool linked)
+{
+	// the target of a link may change unseen, so the files below one are left to the filesystem
+	if (linked)
+		return;
+	publish(path, statbuf);
+	if (statbuf)
+		missing_paths::instance().forget(path);
+}
+
+void path_index::removed(const std::vector<std::string> &directories)
+{
+	for (const std::string &i: directories)
+	{
+		auto found = files_of.find(i);
+		if (found == files_of.end())
+			continue;
+		for (entry *file: found->second)
+			std::atomic_store(&file->file, std::shared_ptr<const indexed_file>());
+	}
+}
+
+void path_index::unfollowed(const std::string &)
+{
+	// the link itself is published, so misses are left to the filesystem already
+}
+
+void path_index::distrust(const char *reason) noexcept
+{
+	trusted.store(false, std::memory_order_release);
+	log_record{} << "Path index disabled until restart: " << reason << "\n";
+}
+
+std::shared_ptr<const indexed_file> path_index::find(const char *path, size_t length, uint64_t hash, bool &missing)
+{
+	missing = false;
+	if (!trusted.load(std::memory_order_acquire) || !enter())
+		return nullptr;
+
+	// the snapshot outlives the entry, which may be freed once the reader leaves
+	std::shared_ptr<const indexed_file> file;
+	const entry *found = probe(*current.load(std::memory_order_seq_cst), path, length, hash);
+	if (found)
+		file = std::atomic_load(&found->file);
+	leave();
+
+	if (file)
+	{
+		if (!is_tracked(file->statbuf))
+			return nullptr;
+		count_statistic(statistic::path_index_hits);
+		return file;
+	}
+
+	// a directory, a path never seen or a file deleted since
+	if (misses_authoritative.load(std::memory_order_relaxed) && path_filter::is_canonical(path, length))
+	{
+		count_statistic(statistic::path_index_misses);
+		missing = true;
+	}
+	return nullptr;
+}
+
+std::shared_ptr<const file_metadata> path_index::metadata_of(const indexed_file &indexed, const char *location)
+{
+	std::shared_ptr<const file_metadata> metadata = std::atomic_load(&indexed.metadata);
+	if (metadata)
+		return metadata;
+
+	// kept with the snapshot: a newer one from inotify replaces it and is described on its next request
+	metadata = file_metadata_cache::instance().lookup(location, indexed.statbuf);
+	if (metadata)
+		std::atomic_store(&indexed.metadata, metadata);
+	return metadata;
+}
+
+bool path_index::snapshot_of(const char *path, size_t length, std::shared_ptr<const indexed_file> &file)
+{
+	file.reset();
+	if (!trusted.load(std::memory_order_acquire) || !enter())
+		return false;
+
+	const entry *found = probe(*current.load(std::memory_order_seq_cst), path, length, path_hash(path, length));
+	if (found)
+		file = std::atomic_load(&found->file);
+	leave();
+	if (file)
+		return is_tracked(file->statbuf);
+	return misses_authoritative.load(std::memory_order_relaxed) && path_filter::is_canonical(path, length);
+}
+
+size_t path_index::retained_bytes() const noexcept
+{
+	auto held = [](const table *where, const std::vector<std::unique_ptr<entry>> &owned)
+	{
+		size_t bytes = where ? sizeof(table) + (where->mask + 1) * sizeof(std::atomic<entry *>) : 0;
+		for (const std::unique_ptr<entry> &i: owned)
+			bytes += sizeof(entry) + i->path.capacity();
+		return bytes;
+	};
+
+	size_t bytes = held(current_table.get(), entries);
+	for (const retirement &i: retired)
+		bytes += held(i.replaced.get(), i.dropped);
+	return bytes;
+}
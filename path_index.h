@@ -0,0 +1,116 @@
+#ifndef __PATH_INDEX_H__
+#define __PATH_INDEX_H__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_wrapper.h"
+#include "tree_watcher.h"
+
+struct indexed_file
+{
+	struct stat statbuf;					// lstat as of the last inotify event
+	// loaded by the first request after a change, with std::atomic_*
+	mutable std::shared_ptr<const file_metadata> metadata;
+};
+
+class path_index final : public tree_listener
+{
+	// open-addressing table from URL path to the file under the directory, kept current by inotify,
+	// so a request for an indexed file needs neither a path walk nor a stat
+public:
+	struct entry
+	{
+		uint64_t hash;
+		std::string path;					// URL path, immutable once published
+		// nullptr once deleted; swapped by the inotify thread with std::atomic_*
+		std::shared_ptr<const indexed_file> file;
+	};
+private:
+	struct table
+	{
+		size_t mask;
+		std::unique_ptr<std::atomic<entry *>[]> slots;
+		size_t used;
+	};
+
+	struct retirement
+	{
+		uint64_t epoch;					// freed once no reader entered before it is still reading
+		std::unique_ptr<table> replaced;
+		std::vector<std::unique_ptr<entry>> dropped;
+	};
+
+	struct reader_slot;
+	struct reader_holder;
+
+	static constexpr size_t minimal_slots = 1024;
+
+	// changed by the watching thread only; a deleted file keeps its entry, reused if it comes back, until the table
+	// is rebuilt, and the old table and the entries it drops are retired until no reader may still probe them
+	std::atomic<table *> current{ nullptr };
+	std::unique_ptr<table> current_table;
+	std::vector<std::unique_ptr<entry>> entries;		// those of the current table
+	std::vector<retirement> retired;
+	std::unordered_map<std::string, std::vector<entry *>> files_of;	// URL path of a directory to its entries
+
+	// epoch based reclamation: a reader publishes the epoch it enters at in the slot of its thread, 0 when out
+	std::atomic<uint64_t> epoch{ 1 };
+	std::mutex readers_mutex;
+	std::vector<reader_slot *> readers;			// never freed, a slot of a finished thread is adopted by the next
+	static thread_local reader_holder local_reader;
+
+	std::atomic<bool> trusted{ false };			// cleared for good once an event may have been missed
+	std::atomic<bool> misses_authoritative{ true };	// false once a symbolic link may lead to a directory
+
+	path_index() noexcept = default;
+
+	static bool is_tracked(const struct stat &statbuf) noexcept;
+	static std::unique_ptr<table> make_table(size_t slots);
+	static entry *probe(const table &where, const char *path, size_t length, uint64_t hash) noexcept;
+	static void place(table &where, entry *added) noexcept;
+	bool enter() noexcept;
+	void leave() noexcept;
+	void reclaim();
+	void rebuild();
+	void publish(const std::string &path, const struct stat *statbuf);
+public:
+	static path_index &instance();
+	path_index(const path_index &) = delete;
+	path_index &operator=(const path_index &) = delete;
+
+	bool enabled() const noexcept
+	{
+		return trusted.load(std::memory_order_acquire);
+	}
+
+	// built from the scan of tree_watcher, kept current by its events
+	bool scanned(const tree_scan &tree) override;
+	void changed(const std::string &path, const struct stat *statbuf, bool linked) override;
+	void removed(const std::vector<std::string> &directories) override;
+	void unfollowed(const std::string &link) override;
+	void distrust(const char *reason) noexcept override;
+
+	// hash is path_hash of the path; the snapshot only for a file whose changes are followed, missing when
+	// the path surely names no file, neither when only the filesystem can tell
+	std::shared_ptr<const indexed_file> find(const char *path, size_t length, uint64_t hash, bool &missing);
+
+	// nullptr when the file is gone
+	std::shared_ptr<const file_metadata> metadata_of(const indexed_file &indexed, const char *location);
+
+	// a lookup made on the side of a request, so not counted: false when only the filesystem can tell,
+	// else true with the lstat snapshot, nullptr when the path surely names no file
+	bool snapshot_of(const char *path, size_t length, std::shared_ptr<const indexed_file> &file);
+
+	// from the watching thread only: bytes held by the tables and the entries, the retired ones included
+	size_t retained_bytes() const noexcept;
+};
+
+#endif
@@ -0,0 +1,223 @@
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <string>
+
+#include <ctime>
+#include <cstring>
+
+#include "phase_timing.h"
+#include "tracing.h"
+#include "thread_shards.h"
+
+constexpr size_t phase_histogram::sub_buckets;
+constexpr size_t phase_histogram::max_magnitude;
+constexpr size_t phase_histogram::buckets_count;
+
+const char *request_phase_name(request_phase phase) noexcept
+{
+	static const char *names[request_phases_count] = { "accept", "receive", "parse", "open", "headers", "body" };
+	return names[static_cast<size_t>(phase)];
+}
+
+phase_histogram::phase_histogram() noexcept
+{
+	memset(counts, 0, sizeof(counts));
+}
+
+void phase_histogram::add(size_t bucket, uint64_t count) noexcept
+{
+	counts[bucket] += count;
+	total += count;
+}
+
+void phase_histogram::set_maximum(uint64_t value) noexcept
+{
+	if (value > maximum)
+		maximum = value;
+}
+
+void phase_histogram::merge(const phase_histogram &other) noexcept
+{
+	for (size_t i = 0; i != buckets_count; ++i)
+		counts[i] += other.counts[i];
+	total += other.total;
+	set_maximum(other.maximum);
+}
+
+uint64_t phase_histogram::percentile(double fraction) const noexcept
+{
+	if (!total)
+		return 0;
+
+	uint64_t rank = static_cast<uint64_t>(fraction * total);
+	if (rank >= total)
+		rank = total - 1;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i != buckets_count; ++i)
+	{
+		seen += counts[i];
+		if (seen > rank)
+			return std::min(lowest_value_of(i), maximum);
+	}
+	return maximum;
+}
+
+namespace
+{
+	struct phase_totals
+	{
+		phase_histogram phases[request_phases_count];
+	};
+
+	struct thread_recorder
+	{
+		// written by the owning thread only, read by merges, hence relaxed atomics without read-modify-write
+		std::atomic<uint64_t> counts[request_phases_count][phase_histogram::buckets_count];
+		std::atomic<uint64_t> maximum[request_phases_count];
+
+		thread_recorder() noexcept
+		{
+			for (auto &phase: counts)
+				for (auto &bucket: phase)
+					bucket.store(0, std::memory_order_relaxed);
+			for (auto &i: maximum)
+				i.store(0, std::memory_order_relaxed);
+		}
+
+		void add_to(phase_totals &destination) const noexcept
+		{
+			for (size_t phase = 0; phase != request_phases_count; ++phase)
+			{
+				for (size_t bucket = 0; bucket != phase_histogram::buckets_count; ++bucket)
+				{
+					uint64_t count = counts[phase][bucket].load(std::memory_order_relaxed);
+					if (count)
+						destination.phases[phase].add(bucket, count);
+				}
+				destination.phases[phase].set_maximum(maximum[phase].load(std::memory_order_relaxed));
+			}
+		}
+	};
+
+	thread_shards<thread_recorder, phase_totals> &recorders()
+	{
+		static thread_shards<thread_recorder, phase_totals> *object = new thread_shards<thread_recorder, phase_totals>;
+		return *object;
+	}
+
+	bool invariant_tsc() noexcept
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		std::ifstream cpuinfo{ "/proc/cpuinfo" };
+		std::string line;
+		while (getline(cpuinfo, line))
+		{
+			if (line.compare(0, 5, "flags") == 0)
+				return (line.find(" constant_tsc") != std::string::npos && line.find(" nonstop_tsc") != std::string::npos);
+		}
+#endif
+		return false;
+	}
+
+	double calibrate_ticks() noexcept
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		if (!invariant_tsc())
+			return 0.0;
+
+		using namespace std::chrono;
+		steady_clock::time_point started = steady_clock::now();
+		uint64_t started_ticks = __rdtsc();
+		std::this_thread::sleep_for(milliseconds(20));
+		uint64_t finished_ticks = __rdtsc();
+		steady_clock::time_point finished = steady_clock::now();
+
+		double nanoseconds = duration_cast<std::chrono::nanoseconds>(finished - started).count();
+		return nanoseconds / static_cast<double>(finished_ticks - started_ticks);
+#else
+		return 1.0;
+#endif
+	}
+}
+
+#if PHASE_TIMING
+
+void record_phase(request_phase phase, uint64_t started, uint64_t finished) noexcept
+{
+	thread_recorder *recorder = recorders().local();
+	if (!recorder)
+		return;
+
+	uint64_t elapsed = (finished > started) ? finished - started : 0;
+	size_t index = static_cast<size_t>(phase);
+
+	std::atomic<uint64_t> &bucket = recorder->counts[index][phase_histogram::bucket_of(elapsed)];
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	std::atomic<uint64_t> &maximum = recorder->maximum[index];
+	if (elapsed > maximum.load(std::memory_order_relaxed))
+		maximum.store(elapsed, std::memory_order_relaxed);
+
+	if (trace_recorder::active())
+	{
+		// the phase is placed on the steady clock of the trace by its distance from now in ticks
+		double scale = nanoseconds_per_phase_tick();
+		uint64_t now = phase_ticks();
+		if (scale != 0.0 && now >= finished)
+		{
+			int64_t finished_ns = trace_recorder::now_ns() - static_cast<int64_t>((now - finished) * scale);
+			trace_recorder::record(request_phase_name(phase), finished_ns - static_cast<int64_t>(elapsed * scale),
+					static_cast<int64_t>(elapsed * scale), nullptr, 0);
+		}
+	}
+}
+
+#endif
+
+double nanoseconds_per_phase_tick() noexcept
+{
+	// 0 stands for a TSC that is not invariant, phase timing is reported as unavailable then
+	static const double value = calibrate_ticks();
+	return value;
+}
+
+void merge_phase_histograms(phase_histogram *destination)
+{
+	std::unique_ptr<phase_totals> merged{ new phase_totals };
+	recorders().collect(*merged);
+	std::copy(merged->phases, merged->phases + request_phases_count, destination);
+}
+
+void report_phase_timing(std::ostream &stream)
+{
+#if PHASE_TIMING
+	double scale = nanoseconds_per_phase_tick() / 1000.0;
+	if (scale == 0.0)
+	{
+		stream << "Phase timing is unavailable without an invariant TSC\n";
+		return;
+	}
+
+	std::unique_ptr<phase_histogram[]> merged{ new phase_histogram[request_phases_count] };
+	merge_phase_histograms(merged.get());
+
+	stream << "Request phases, microseconds:\n";
+	for (size_t i = 0; i != request_phases_count; ++i)
+	{
+		const phase_histogram &histogram = merged[i];
+		stream << '\t' << request_phase_name(static_cast<request_phase>(i)) << ": count " << histogram.count()
+			<< ", p50 " << histogram.percentile(0.5) * scale
+			<< ", p90 " << histogram.percentile(0.9) * scale
+			<< ", p99 " << histogram.percentile(0.99) * scale
+			<< ", p99.9 " << histogram.percentile(0.999) * scale
+			<< ", max " << histogram.max() * scale << '\n';
+	}
+#else
+	stream << "Phase timing is compiled out\n";
+#endif
+}
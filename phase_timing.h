@@ -0,0 +1,115 @@
+#ifndef __PHASE_TIMING_H__
+#define __PHASE_TIMING_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef PHASE_TIMING
+#define PHASE_TIMING 0
+#endif
+
+enum class request_phase : size_t
+{
+	accept = 0,		// accept of the connection
+	receive = 1,		// recv of the request
+	parse = 2,		// http_request construction and parse_request
+	open = 3,		// open_file with its properties, including the popen of file
+	headers = 4,		// send_status_line and send_headers
+	body = 5		// sendfile of the body
+};
+
+constexpr size_t request_phases_count = 6;
+
+const char *request_phase_name(request_phase phase) noexcept;
+
+class phase_histogram final
+{
+	// log-linear buckets in the manner of HDR histograms: 16 sub-buckets per power of two, so about 6% precision
+public:
+	static constexpr size_t sub_buckets = 16;
+	static constexpr size_t max_magnitude = 44;
+	static constexpr size_t buckets_count = (max_magnitude - 2) * sub_buckets;
+private:
+	uint64_t counts[buckets_count];
+	uint64_t total = 0;
+	uint64_t maximum = 0;
+public:
+	phase_histogram() noexcept;
+
+	static size_t bucket_of(uint64_t value) noexcept
+	{
+		if (value < 2 * sub_buckets)
+			return value;
+
+		size_t magnitude = 63 - __builtin_clzll(value);
+		if (magnitude > max_magnitude)
+			return buckets_count - 1;
+
+		size_t shift = magnitude - 4;
+		return (shift + 1) * sub_buckets + ((value >> shift) - sub_buckets);
+	}
+	static uint64_t lowest_value_of(size_t bucket) noexcept
+	{
+		if (bucket < 2 * sub_buckets)
+			return bucket;
+
+		size_t shift = bucket / sub_buckets - 1;
+		return static_cast<uint64_t>(bucket % sub_buckets + sub_buckets) << shift;
+	}
+
+	void add(size_t bucket, uint64_t count) noexcept;
+	void set_maximum(uint64_t value) noexcept;
+	void merge(const phase_histogram &other) noexcept;
+
+	uint64_t count() const noexcept
+	{
+		return total;
+	}
+	uint64_t max() const noexcept
+	{
+		return maximum;
+	}
+	uint64_t percentile(double fraction) const noexcept;
+};
+
+#if PHASE_TIMING
+
+inline uint64_t phase_ticks() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+void record_phase(request_phase phase, uint64_t started, uint64_t finished) noexcept;
+
+#else
+
+inline uint64_t phase_ticks() noexcept
+{
+	return 0;
+}
+
+inline void record_phase(request_phase, uint64_t, uint64_t) noexcept
+{}
+
+#endif
+
+double nanoseconds_per_phase_tick() noexcept;
+
+// merges histograms of all the threads (alive and finished) into phase_histogram[request_phases_count], in ticks
+void merge_phase_histograms(phase_histogram *destination);
+
+void report_phase_timing(std::ostream &stream);
+
+#endif
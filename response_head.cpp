@@ -0,0 +1,100 @@
+#include <ctime>
+
+#include "response_head.h"
+#include "logging.h"
+
+constexpr size_t response_head::capacity;
+
+#define RENDERED_STATUS(code, phrase) { code, phrase, "HTTP/1.0 " #code " " phrase "\r\n", \
+	sizeof("HTTP/1.0 " #code " " phrase "\r\n") - 1 }
+
+namespace
+{
+	// every status line is a literal, nothing is formatted per response
+	constexpr rendered_status rendered_statuses[] =
+	{
+		RENDERED_STATUS(200, "OK"),
+		RENDERED_STATUS(206, "Partial Content"),
+		RENDERED_STATUS(304, "Not Modified"),
+		RENDERED_STATUS(400, "Bad Request"),
+		RENDERED_STATUS(404, "Not Found"),
+		RENDERED_STATUS(405, "Method Not Allowed"),
+		RENDERED_STATUS(414, "URI Too Long"),
+		RENDERED_STATUS(416, "Range Not Satisfiable"),
+		RENDERED_STATUS(500, "Internal Server Error"),
+		RENDERED_STATUS(503, "Service Unavailable"),
+		RENDERED_STATUS(505, "HTTP Version Not Supported")
+	};
+
+	constexpr char digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+}
+
+const rendered_status *find_rendered_status(short status) noexcept
+{
+	for (const rendered_status &i: rendered_statuses)
+	{
+		if (i.status == status)
+			return &i;
+	}
+	return nullptr;
+}
+
+size_t format_decimal(uint64_t value, char *destination) noexcept
+{
+	// two digits per division, written from the end
+	char digits[20];
+	char *position = digits + sizeof(digits);
+	while (value >= 100)
+	{
+		size_t pair = (value % 100) * 2;
+		value /= 100;
+		*--position = digit_pairs[pair + 1];
+		*--position = digit_pairs[pair];
+	}
+	if (value >= 10)
+	{
+		*--position = digit_pairs[value * 2 + 1];
+		*--position = digit_pairs[value * 2];
+	}
+	else
+	{
+		*--position = static_cast<char>('0' + value);
+	}
+
+	size_t count = digits + sizeof(digits) - position;
+	memcpy(destination, position, count);
+	return count;
+}
+
+char *response_head::thread_buffer() noexcept
+{
+	thread_local char buffer[capacity];
+	return buffer;
+}
+
+response_head &response_head::status_line(short status) noexcept
+{
+	const rendered_status *rendered = find_rendered_status(status);
+	if (rendered)
+		return append(rendered->line, rendered->line_size);
+	return append("HTTP/1.0 ", 9).number(static_cast<uint16_t>(status)) << " Unknown error of response status\r\n";
+}
+
+response_head &response_head::date() noexcept
+{
+	thread_local time_t formatted_second = -1;
+	thread_local char formatted[http_date_size + 1];
+
+	time_t now = current_time_t();
+	if (now != formatted_second)
+	{
+		format_http_date(now, formatted);
+		formatted_second = now;
+	}
+	return *this << formatted;
+}
@@ -0,0 +1,92 @@
+#ifndef __RESPONSE_HEAD_H__
+#define __RESPONSE_HEAD_H__
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+struct rendered_status
+{
+	short status;
+	const char *phrase;
+	const char *line;			// "HTTP/1.0 200 OK\r\n"
+	size_t line_size;
+};
+
+// nullptr for a status the server never sends
+const rendered_status *find_rendered_status(short status) noexcept;
+
+// decimal digits of value, without a terminating NUL; destination has room for 20
+size_t format_decimal(uint64_t value, char *destination) noexcept;
+
+class response_head final
+{
+	// status line and headers of one response, written into a buffer of the thread reused for every response,
+	// so at most one head per thread may be alive at a time
+public:
+	static constexpr size_t capacity = 16384;
+private:
+	char *const buffer;
+	size_t size = 0;
+	bool overflowed = false;
+
+	static char *thread_buffer() noexcept;
+public:
+	response_head() noexcept : buffer{ thread_buffer() }
+	{}
+
+	response_head(const response_head &) = delete;
+	response_head &operator=(const response_head &) = delete;
+
+	response_head &append(const char *text, size_t length) noexcept
+	{
+		if (length > capacity - size)
+		{
+			overflowed = true;
+			return *this;
+		}
+		memcpy(buffer + size, text, length);
+		size += length;
+		return *this;
+	}
+
+	response_head &operator<<(const char *text) noexcept
+	{
+		return append(text, strlen(text));
+	}
+
+	response_head &operator<<(const std::string &text) noexcept
+	{
+		return append(text.data(), text.size());
+	}
+
+	response_head &number(uint64_t value) noexcept
+	{
+		char digits[20];
+		return append(digits, format_decimal(value, digits));
+	}
+
+	response_head &status_line(short status) noexcept;
+
+	// the current IMF-fixdate, formatted once a second by every thread
+	response_head &date() noexcept;
+
+	const char *data() const noexcept
+	{
+		return buffer;
+	}
+
+	size_t length() const noexcept
+	{
+		return size;
+	}
+
+	// false when something did not fit and the head must not be sent
+	bool complete() const noexcept
+	{
+		return !overflowed;
+	}
+};
+
+#endif
@@ -5,6 +5,12 @@
 #include "server.h"
 #include "utils.h"
 
+constexpr size_t connection_state::buffer_size;
+constexpr size_t connection_pool::slab_size;
+constexpr size_t connection_pool::default_capacity;
+
+static thread_pool *the_server_pool = nullptr;
+
 struct addrinfo get_addrinfo_hints() noexcept
 {
 	struct addrinfo hints;
@@ -37,7 +43,6 @@ int get_binded_socket(struct addrinfo *address_info) noexcept
 		int yes = 1;
 		if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
 		{
-			std::lock_guard<std::mutex> lock(cerr_mutex);
 			LOG_CERROR("Program terminates due to setsockopt fail");
 			exit(EXIT_FAILURE);
 		}
@@ -58,12 +63,12 @@ int get_binded_socket(struct addrinfo *address_info) noexcept
 		return -1;
 }
 
-int get_listening_socket() noexcept
+int get_listening_socket(const std::string &port) noexcept
 {
 	struct addrinfo hints = get_addrinfo_hints();
 	struct addrinfo *address_info;
 
-	int gai_res = getaddrinfo(server_ip.data(), server_port.data(), &hints, &address_info);
+	int gai_res = getaddrinfo(server_ip.data(), port.data(), &hints, &address_info);
 	if (gai_res != 0)
 	{
 		std::lock_guard<std::mutex> lock(cerr_mutex);
@@ -84,87 +89,477 @@ int get_listening_socket() noexcept
 
 	if (listen(socket_fd, SOMAXCONN) == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("Program terminates due to listen error");
 		exit(EXIT_FAILURE);
 	}
 
-	std::clog << "Listening master socket fd is " << socket_fd << std::endl;
+	std::clog << "Listening socket of port " << port << " has fd " << socket_fd << std::endl;
 
 	return socket_fd;
 }
 
 void process_the_accepted_connection(active_connection client)
 {
-	constexpr size_t buffer_size = 8192;
-	char buffer[buffer_size] = { 0 };
+	uint64_t receive_started = phase_ticks();
+
+	if (receive_request_head(client))
+	{
+		record_phase(request_phase::receive, receive_started, phase_ticks());
+
+		client->last_activity = std::chrono::steady_clock::now();
+
+		uint64_t parse_started = phase_ticks();
+		http_request request(client->buffer, client->memory);
+		process_client_request(client, request, parse_started);
+
+		if (client)
+			account_request(client);
+	}
+}
+
+bool receive_request_head(active_connection &client) noexcept
+{
+	using std::chrono::milliseconds;
+
+	// until the first byte the connection is idle, then it has until the header timeout to complete the head
+	timer_wheel &timers = timer_wheel::instance();
+	if (server_connection_idle_ms && (!server_header_timeout_ms || server_connection_idle_ms < server_header_timeout_ms))
+		timers.arm(client->timer, client, connection_timeout::idle, client->accepted_at + milliseconds(server_connection_idle_ms));
+	else if (server_header_timeout_ms)
+		timers.arm(client->timer, client, connection_timeout::header, client->accepted_at + milliseconds(server_header_timeout_ms));
+
+	char *buffer = client->buffer;
+	size_t received = 0;
+	while (true)
+	{
+		ssize_t got = recv(client, buffer + received, connection_state::buffer_size - 1 - received, MSG_NOSIGNAL);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0)
+		{
+			if (got == -1 && !client->timer.expired.load(std::memory_order_relaxed))
+			{
+				LOG_CERROR("Failed to recieve the request and process the client");
+				log_record{} << "Client " << static_cast<int>(client) << " remains unprocessed\n";
+			}
+			timers.disarm(client->timer);
+			return false;
+		}
+
+		received += got;
+		buffer[received] = '\0';
+		// a head filling the buffer is left to the parser, which answers it
+		if (received == connection_state::buffer_size - 1 || http_request::is_complete_head(buffer, received))
+			break;
+
+		if (received == static_cast<size_t>(got) && server_header_timeout_ms && server_connection_idle_ms
+				&& server_connection_idle_ms < server_header_timeout_ms)
+			timers.arm(client->timer, client, connection_timeout::header,
+					client->accepted_at + milliseconds(server_header_timeout_ms));
+	}
+
+	// the time taken by the server itself is not held against the client
+	timers.disarm(client->timer);
+	client->received = received;
+	return true;
+}
+
+void arm_send_deadline(active_connection &client, size_t bytes) noexcept
+{
+	if (!server_min_send_rate)
+		return;
+	std::chrono::milliseconds allowed(server_send_grace_ms + bytes * 1000 / server_min_send_rate);
+	timer_wheel::instance().arm(client->timer, client, connection_timeout::send, std::chrono::steady_clock::now() + allowed);
+}
+
+void process_admin_connection(active_connection client)
+{
+	if (!receive_request_head(client))
+		return;
 
-	ssize_t recieved = recv(client, buffer, buffer_size, MSG_NOSIGNAL);
+	http_request request(client->buffer, client->memory);
+	request.parse_request();
 
-	if (recieved > 0)
+	if (!request)
 	{
-		http_request request(buffer);
-		process_client_request(client, request);
+		if (request.status_required())
+			send_status_line(client, request.get_status());
 	}
-	else if (recieved == -1)
+	else if (!send_status_page(client, request))
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
-		LOG_CERROR("Failed to recieve the request and process the client");
-		std::cerr << "Client " << client << " remains unprocessed\n";
+		if (request.status_required())
+			send_status_line(client, 404);
+	}
+}
+
+size_t queued_tasks(const thread_pool &pool) noexcept
+{
+	size_t queued = 0;
+	for (size_t i = 0; i != task_lanes_count; ++i)
+		queued += pool.get_lane_statistics(static_cast<task_lane>(i)).depth;
+	return queued;
+}
+
+void publish_pool_metrics(metrics_segment &metrics, const thread_pool &pool) noexcept
+{
+	uint64_t depth[metrics_lanes_count], executed[metrics_lanes_count], total_wait_ns[metrics_lanes_count];
+	for (size_t i = 0; i != metrics_lanes_count; ++i)
+	{
+		lane_statistics lane = pool.get_lane_statistics(static_cast<task_lane>(i));
+		depth[i] = lane.depth;
+		executed[i] = lane.executed;
+		total_wait_ns[i] = lane.total_wait_ns;
+	}
+	metrics.publish_pool(pool.size(), depth, executed, total_wait_ns);
+}
+
+bool send_status_page(active_connection &client, const http_request &request)
+{
+	const arena_string &address = request.get_address();
+	if (server_status_path.empty() || address.compare(0, server_status_path.size(), server_status_path.data()) != 0)
+		return false;
+
+	status_format format;
+	if (address.size() == server_status_path.size())
+		format = status_format::text;
+	else if (address.compare(server_status_path.size(), std::string::npos, "/prometheus") == 0)
+		format = status_format::prometheus;
+	else
+		return false;
+
+	std::string body = render_status_page(format, the_server_pool);
+
+	if (request.status_required())
+	{
+		response_head head;
+		head.status_line(200) << "Date: ";
+		head.date() << "\r\nServer: Bolbot-CPPserver/10.0\r\nCache-Control: no-store\r\nContent-Length: ";
+		head.number(body.size()) << "\r\nContent-Type: " << status_content_type(format) << "\r\n\r\n";
+		if (send_response_head(client, 200, head) == -1)
+			return true;
 	}
+
+	arm_send_deadline(client, body.size());
+	ssize_t sent = send(client, body.data(), body.size(), MSG_NOSIGNAL);
+	if (sent > 0)
+		client->bytes_sent += sent;
+	return true;
 }
 
-void run_server_loop(int master_socket)
+void run_server_loop(int master_socket, int admin_socket)
 {
 	size_t limit_of_file_descriptors = set_maximal_avaliable_limit_of_fd();
 	std::clog << "Processing at most " << limit_of_file_descriptors << " fd at a time." << std::endl;
 
+#if PHASE_TIMING
+	if (double scale = nanoseconds_per_phase_tick())
+		std::clog << "Request phases are timed with " << scale << " ns per tick" << std::endl;
+	else
+		std::clog << "Request phases are not timed: TSC is not invariant on this machine" << std::endl;
+#endif
+
 	//initialize_thread_pool();
 
-	thread_pool the_pool;
+	trace_recorder::name_thread("listener");
+
+	std::vector<int> listener_cpus = parse_cpu_list(server_listener_cpus);
+	if (!listener_cpus.empty())
+	{
+		if (pin_current_thread(listener_cpus.front()))
+			std::clog << "Accepting thread pinned to cpu " << listener_cpus.front()
+				<< " (node " << numa_node_of_cpu(listener_cpus.front()) << ")" << std::endl;
+		else
+			std::clog << "Failed to pin accepting thread to cpu " << listener_cpus.front() << std::endl;
+	}
+
+	connection_pool connection_states(limit_of_file_descriptors);
+	thread_pool_settings pool_settings;
+	pool_settings.cpus = parse_cpu_list(server_worker_cpus);
+	pool_settings.bulk_share_percent = server_bulk_share;
+	pool_settings.min_workers = server_min_workers;
+	pool_settings.max_workers = server_max_workers;
+	pool_settings.latency_threshold = std::chrono::milliseconds(server_scale_latency_ms);
+	pool_settings.idle_timeout = std::chrono::milliseconds(server_idle_timeout_ms);
+	pool_settings.dequeue_batch = server_dequeue_batch;
+
+	thread_pool the_pool(pool_settings);
+	the_server_pool = &the_pool;
+
+	if (server_path_filter)
+		tree_watcher::instance().listen(path_filter::instance());
+	if (server_path_index)
+		tree_watcher::instance().listen(path_index::instance());
+	if (server_path_filter || server_path_index)
+		tree_watcher::instance().start(server_directory, server_path_index_threads);
+	if (server_connection_idle_ms || server_header_timeout_ms || server_min_send_rate)
+		timer_wheel::instance().start();
+
+	int flags = fcntl(master_socket, F_GETFL);
+	if (flags == -1 || fcntl(master_socket, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		LOG_CERROR("Program terminates due to failure of making the master socket non-blocking");
+		exit(EXIT_FAILURE);
+	}
+
+	if (admin_socket != -1)
+	{
+		int admin_flags = fcntl(admin_socket, F_GETFL);
+		if (admin_flags == -1 || fcntl(admin_socket, F_SETFL, admin_flags | O_NONBLOCK) == -1)
+		{
+			LOG_CERROR("Program terminates due to failure of making the admin socket non-blocking");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	std::vector<active_connection> burst;
+	burst.reserve(server_accept_batch);
+
+	metrics_segment &metrics = metrics_segment::instance();
+	// while the segment is published, poll wakes up to refresh the queue depths even without connections
+	int poll_timeout = metrics.enabled() ? metrics_segment::publish_interval.count() : -1;
+
+	admission_control admission(limit_of_file_descriptors, server_max_connections, server_max_queued, server_resume_percent);
+	std::clog << "Admitting at most " << admission.get_connections_high() << " connections at a time." << std::endl;
+	bool stalled = false;		// a pending connection could not be accepted even with the reserve descriptor
 
 	while (true)
 	{
-		active_connection connection(master_socket);
+		if (metrics.enabled())
+			publish_pool_metrics(metrics, the_pool);
+
+		// a paused or stalled listener leaves the backlog alone, poll only wakes it up to check the load again
+		bool shedding = admission.overloaded(connection_states.live(), queued_tasks(the_pool));
+		bool listening = !stalled && !(shedding && server_overload_pause);
+		stalled = false;
+
+		bool admin_ready = false;
+		bool master_ready = wait_for_connections(listening ? master_socket : -1, admin_socket, admin_ready,
+				listening ? poll_timeout : admission_control::recheck_interval_ms);
 
-		if (!connection)
+		if (admin_ready)
+		{
+			active_connection connection(connection_states, admin_socket);
+			if (connection)
+				the_pool.enqueue_task(process_admin_connection, std::move(connection));
+		}
+
+		if (!master_ready)
+			continue;
+
+		if (shedding)
+		{
+			stalled = !admission.reject_pending(master_socket, server_accept_batch);
+			continue;
+		}
+
+		if (server_accept_batch <= 1)
+		{
+			active_connection connection(connection_states, master_socket);
+
+			if (!connection)
+			{
+				if (errno == EMFILE || errno == ENFILE)
+					stalled = !admission.reject_pending(master_socket, 1);
+				continue;
+			}
+
+			//worker_threads->enqueue_task(process_the_accepted_connection, std::move(connection));
+
+			the_pool.enqueue_task(
+						process_the_accepted_connection, 
+						std::move(connection));
 			continue;
+		}
+
+		// drain the backlog that is ready right now and publish it to the pool at once
+		while (burst.size() < server_accept_batch && connection_states.live() < admission.get_connections_high())
+		{
+			active_connection connection(connection_states, master_socket);
+			if (!connection)
+			{
+				if (errno == EMFILE || errno == ENFILE)
+					stalled = !admission.reject_pending(master_socket, 1);
+				break;
+			}
+			burst.push_back(std::move(connection));
+		}
 
-		//worker_threads->enqueue_task(process_the_accepted_connection, std::move(connection));
+		if (!burst.empty())
+			the_pool.enqueue_bulk(process_the_accepted_connection, std::move(burst));
+	}
+}
+
+bool wait_for_connections(int master_socket, int admin_socket, bool &admin_ready, int timeout_ms) noexcept
+{
+	struct pollfd sockets[2];
+	sockets[0].fd = master_socket;
+	sockets[1].fd = admin_socket;
+	for (auto &i: sockets)
+	{
+		i.events = POLLIN;
+		i.revents = 0;
+	}
 
-		the_pool.enqueue_task(
-					process_the_accepted_connection, 
-					std::move(connection));
+	if (poll(sockets, (admin_socket == -1) ? 1 : 2, timeout_ms) == -1)
+	{
+		if (errno != EINTR)
+		{
+			LOG_CERROR("poll of the master socket failed");
+		}
+		return false;
 	}
+
+	admin_ready = (sockets[1].revents & POLLIN);
+	return (sockets[0].revents & POLLIN);
 }
 
-void process_client_request(active_connection &client, http_request request)
+void process_client_request(active_connection &client, http_request request, uint64_t parse_started)
 {
 	request.parse_request();
+	client->parsed_at = std::chrono::steady_clock::now();
+	uint64_t open_started = phase_ticks();
+	record_phase(request_phase::parse, parse_started, open_started);
+	client->status = request.get_status();
+	client->path_hash = path_hash(request.get_address().data(), request.get_address().size());
 
-	std::string address = (server_directory + request.get_address()).data();
+	if (request && server_admin_port.empty() && send_status_page(client, request))
+	{
+		return;
+	}
 
 	if (request)
 	{
-		open_file file(address.data());
-		if (file)
+		// one probe over the requested bytes, hashed for the access log already
+		const arena_string &requested = request.get_address();
+		bool missing = false;
+		std::shared_ptr<const indexed_file> indexed = path_index::instance().find(requested.data(), requested.size(),
+				client->path_hash, missing);
+		if (missing || (!indexed && known_missing(requested.data(), requested.size())))
 		{
 			if (request.status_required())
+				send_status_line(client, 404);
+			else
+				client->status = 404;
+			return;
+		}
+
+		arena_string address(server_directory.data(), server_directory.size(), arena_allocator<char>(client->memory));
+		address += requested;
+		std::shared_ptr<const file_metadata> metadata = indexed ? path_index::instance().metadata_of(*indexed, address.data())
+			: file_metadata_cache::instance().lookup(address.data());
+		if (!metadata)
+			missing_paths::instance().remember(requested.data(), requested.size());
+		arena_string served = address;
+		if (metadata && server_precompressed && request.status_required())
+			choose_precompressed(request, served, metadata);
+
+		if (metadata && compression_wanted(request, *metadata))
+		{
+			std::shared_ptr<const compressed_variant> compressed = compression_cache::instance().find(served.data(), *metadata);
+			client->opened_at = std::chrono::steady_clock::now();
+			record_phase(request_phase::open, open_started, phase_ticks());
+
+			if (compressed && !compressed->data.empty())
 			{
-				if (send_status_line(client, request.get_status()) == -1)
+				uint64_t headers_started = phase_ticks();
+				if (is_not_modified(request, compressed->metadata))
 				{
+					if (send_not_modified(client, compressed->metadata) != -1)
+						record_phase(request_phase::headers, headers_started, phase_ticks());
 					return;
 				}
-				if (send_headers(client, file) == -1)
+				send_compressed_variant(client, address.data(), *compressed, !request.is_head());
+				return;
+			}
+			// the first GET waits for the compression, on the bulk lane as it may take long; a HEAD never opens
+			// the file, until a GET has compressed it the identity headers go out, with Vary telling both exist
+			if (!compressed && !request.is_head())
+			{
+				compression_job job{ std::move(client), address.data(), served.data(), std::move(metadata) };
+				if (the_server_pool)
+					the_server_pool->enqueue_task(task_lane::bulk, send_compressed, std::move(job));
+				else
+					send_compressed(std::move(job));
+				return;
+			}
+		}
+
+		if (metadata && request.status_required() && is_not_modified(request, *metadata))
+		{
+			client->opened_at = std::chrono::steady_clock::now();
+			uint64_t headers_started = phase_ticks();
+			record_phase(request_phase::open, open_started, headers_started);
+
+			if (send_not_modified(client, *metadata) != -1)
+				record_phase(request_phase::headers, headers_started, phase_ticks());
+			return;
+		}
+
+		if (request.is_head())
+		{
+			// answered from the cached metadata alone: no open, no body
+			client->opened_at = std::chrono::steady_clock::now();
+			uint64_t headers_started = phase_ticks();
+			record_phase(request_phase::open, open_started, headers_started);
+
+			if (!metadata)
+			{
+				send_status_line(client, 404);
+				return;
+			}
+			if (send_headers(client, 200, address.data(), *metadata, whole_file_body(client->memory, *metadata)) != -1)
+				record_phase(request_phase::headers, headers_started, phase_ticks());
+			return;
+		}
+
+		open_file file(served.data(), metadata);
+		client->opened_at = std::chrono::steady_clock::now();
+		uint64_t headers_started = phase_ticks();
+		record_phase(request_phase::open, open_started, headers_started);
+
+		if (file)
+		{
+			short status = request.get_status();
+			response_body body(client->memory);
+			std::vector<byte_range> ranges;
+
+			if (request.status_required() && !request.get_range().empty() && if_range_allows(request, *metadata)
+					&& parse_byte_ranges(request.get_range(), metadata->size, ranges))
+			{
+				if (ranges.empty())
+				{
+					send_range_not_satisfiable(client, metadata->size);
+					return;
+				}
+				status = 206;
+				body = ranged_body(client->memory, *metadata, ranges);
+			}
+			else
+			{
+				body = whole_file_body(client->memory, *metadata);
+			}
+
+			if (request.status_required())
+			{
+				if (send_headers(client, status, address.data(), *metadata, body) == -1)
 				{
 					return;
 				}
+				record_phase(request_phase::headers, headers_started, phase_ticks());
 			}
 
-			send_client_a_file(client, file);
+			if (the_server_pool && static_cast<size_t>(body.length) > server_bulk_threshold)
+			{
+				the_server_pool->enqueue_task(task_lane::bulk, send_bulk_transfer,
+						bulk_transfer{ std::move(client), std::move(file), std::move(body) });
+				return;
+			}
+
+			send_client_a_file(client, file, body);
 		}
 		else
 		{
+			client->status = 404;
 			if (request.status_required())
 			{
 				send_status_line(client, 404);
@@ -182,92 +577,579 @@ void process_client_request(active_connection &client, http_request request)
 
 const char *http_response_phrase(short status) noexcept
 {
-	static const std::map<short, const char *> responses
+	const rendered_status *rendered = find_rendered_status(status);
+	return rendered ? rendered->phrase : "Unknown error of response status";
+}
+
+ssize_t send_status_line(active_connection &client, short status) noexcept
+{
+	response_head head;
+	head.status_line(status);
+	return send_response_head(client, status, head);
+}
+
+ssize_t send_response_head(active_connection &client, short status, const response_head &head) noexcept
+{
+	if (!head.complete())
 	{
-		{ 200, "OK" },
-		{ 400, "Bad Request" },
-		{ 404, "Not Found" },
-		{ 405, "Method Not Allowed" },
-		{ 414, "URI Too Long" },
-		{ 500, "Internal Server Error" },
-		{ 505, "HTTP Version Not Supported" }
-	};
+		// the head is not sent cut, the client gets a bare 500 and no body
+		log_record{} << "Response head of status " << status << " does not fit in " << response_head::capacity << " bytes.\n";
+		client->status = 500;
+		const rendered_status *failure = find_rendered_status(500);
+		send_buffer(client, failure->line, failure->line_size);
+		return -1;
+	}
+
+	client->status = status;
+	arm_send_deadline(client, head.length());
+	return send_buffer(client, head.data(), head.length());
+}
+
+void write_headers(response_head &head, const char *location, const file_metadata &metadata,
+		const response_body &body) noexcept
+{
+	// general, response and entity headers, in this order
+	head << "Date: ";
+	head.date() << "\r\n";
+
+	head << "Location: " << location << "\r\n";
+	head << "Server: Bolbot-CPPserver/10.0\r\n";
+
+	head << "Allow: GET, HEAD\r\n";
+	head << "Accept-Ranges: bytes\r\n";
+	head << "Content-Length: ";
+	head.number(body.length) << "\r\n";
+	head << "Content-Type: " << (body.content_type.empty() ? metadata.mime_type : body.content_type) << "\r\n";
+	if (!metadata.content_encoding.empty())
+		head << "Content-Encoding: " << metadata.content_encoding << "\r\n";
+	if (varies_by_encoding())
+		head << "Vary: Accept-Encoding\r\n";
+	if (!body.content_range.empty())
+		head << "Content-Range: " << body.content_range << "\r\n";
+
+	head << "Expires: ";
+	head.date() << "\r\n";
+	head << "Last-Modified: " << metadata.last_modified << "\r\n";
+	head << "ETag: " << metadata.etag << "\r\n";
+
+	head << "\r\n";
+}
+
+ssize_t send_headers(active_connection &client, short status, const char *location, const file_metadata &metadata,
+		const response_body &body) noexcept
+{
+	// the status line and the headers leave in one send
+	response_head head;
+	head.status_line(status);
+	write_headers(head, location, metadata, body);
+	return send_response_head(client, status, head);
+}
+
+bool entity_tag_matches(const arena_string &tags, const std::string &etag) noexcept
+{
+	// comma-separated list of tags or *; W/ tags compare weakly, which is allowed for GET
+	size_t position = 0;
+	while (position < tags.size())
+	{
+		size_t start = tags.find_first_not_of(" \t,", position);
+		if (start == std::string::npos)
+			return false;
+		size_t end = tags.find(',', start);
+		if (end == std::string::npos)
+			end = tags.size();
+		position = end;
+
+		size_t last = tags.find_last_not_of(" \t", end - 1);
+		if (tags.compare(start, 2, "W/") == 0)
+			start += 2;
+
+		if (tags.compare(start, last - start + 1, "*") == 0 || tags.compare(start, last - start + 1, etag.data()) == 0)
+			return true;
+	}
+	return false;
+}
+
+double content_coding_quality(const arena_string &accepted, const char *coding, const char *alias) noexcept
+{
+	// q of the coding, or of * when the coding is not listed; 0 when neither is
+	double quality = 0, wildcard = 0;
+	bool listed = false;
+	size_t position = 0;
+	while (position < accepted.size())
+	{
+		size_t end = accepted.find(',', position);
+		if (end == std::string::npos)
+			end = accepted.size();
+		size_t start = accepted.find_first_not_of(" \t", position);
+		position = end + 1;
+		if (start == std::string::npos || start >= end)
+			continue;
+
+		size_t token_end = std::min(accepted.find_first_of(" \t;", start), end);
+		const char *token = accepted.data() + start;
+		size_t token_size = token_end - start;
+		auto token_is = [token, token_size](const char *name)
+		{
+			return strlen(name) == token_size && strncasecmp(token, name, token_size) == 0;
+		};
+
+		double q = 1;
+		size_t parameter = accepted.find(';', start);
+		if (parameter < end)
+		{
+			size_t q_start = accepted.find_first_not_of(" \t", parameter + 1);
+			if (q_start < end && (accepted[q_start] == 'q' || accepted[q_start] == 'Q') && accepted[q_start + 1] == '=')
+				q = strtod(accepted.data() + q_start + 2, nullptr);
+		}
+
+		if (token_is(coding) || (alias && token_is(alias)))
+		{
+			quality = std::max(quality, q);
+			listed = true;
+		}
+		else if (token_is("*"))
+		{
+			wildcard = q;
+		}
+	}
+	return listed ? quality : wildcard;
+}
+
+bool known_missing(const char *path, size_t length)
+{
+	if (path_filter::instance().rules_out(path, length))
+	{
+		count_statistic(statistic::missing_filtered);
+		return true;
+	}
+	if (missing_paths::instance().contains(path, length))
+	{
+		count_statistic(statistic::missing_cached);
+		return true;
+	}
+	return false;
+}
+
+bool varies_by_encoding() noexcept
+{
+	return server_precompressed || server_compression_cache_mb;
+}
+
+bool compression_wanted(const http_request &request, const file_metadata &metadata) noexcept
+{
+	// ranges and precompressed siblings are served from the file as they are
+	return metadata.content_encoding.empty() && request.status_required() && request.get_range().empty()
+		&& compression_cache::instance().applies(metadata)
+		&& content_coding_quality(request.get_accept_encoding(), "gzip", "x-gzip") > 0;
+}
+
+ssize_t send_buffer(active_connection &client, const char *data, size_t size) noexcept
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t sent = send(client, data + done, size - done, MSG_NOSIGNAL);
+		if (sent == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += sent;
+		client->bytes_sent += sent;
+	}
+	return done;
+}
+
+void send_compressed_variant(active_connection &client, const char *location, const compressed_variant &variant,
+		bool with_body)
+{
+	// the whole body is one cached buffer, no file is opened
+	uint64_t headers_started = phase_ticks();
+	response_body body(client->memory);
+	body.length = variant.data.size();
+	if (send_headers(client, 200, location, variant.metadata, body) == -1)
+		return;
+	uint64_t body_started = phase_ticks();
+	record_phase(request_phase::headers, headers_started, body_started);
+
+	if (!with_body)
+		return;
+	arm_send_deadline(client, variant.data.size());
+	if (send_buffer(client, variant.data.data(), variant.data.size()) != -1)
+		count_statistic(statistic::compression_saved_bytes, variant.original_size - variant.data.size());
+	record_phase(request_phase::body, body_started, phase_ticks());
+}
 
-	const char *result;
+void send_compressed(compression_job job) noexcept
+{
+	std::shared_ptr<const compressed_variant> compressed;
 	try
 	{
-		result = responses.at(status);
+		compressed = compression_cache::instance().compress(job.path, *job.original);
 	}
-	catch (std::out_of_range &ex)
+	catch (std::exception &e)
 	{
-		return "Unknown error of response status";
+		log_record{} << "Failed to compress " << job.path << ": " << e.what() << "\n";
 	}
 
-	return result;
-};
+	if (compressed && !compressed->data.empty())
+	{
+		send_compressed_variant(job.client, job.location.data(), *compressed, true);
+	}
+	else
+	{
+		// not worth compressing, or the file changed meanwhile: the file goes out as it is
+		open_file file(job.path.data(), job.original);
+		if (!file)
+		{
+			send_status_line(job.client, 404);
+		}
+		else
+		{
+			response_body body = whole_file_body(job.client->memory, *job.original);
+			if (send_headers(job.client, 200, job.location.data(), *job.original, body) != -1)
+				send_client_a_file(job.client, file, body);
+		}
+	}
+	account_request(job.client);
+}
 
-ssize_t send_status_line(active_connection &client, short status)
+void choose_precompressed(const http_request &request, arena_string &path, std::shared_ptr<const file_metadata> &metadata)
 {
-	constexpr char http_version[] = "HTTP/1.0";
-	std::string status_line = http_version;
-	status_line += ' ';
-	status_line += std::to_string(status);
-	status_line += ' ';
-	status_line += http_response_phrase(status);
-	status_line += "\r\n";
+	const arena_string &accepted = request.get_accept_encoding();
+	if (accepted.empty())
+		return;
+
+	// brotli is preferred at an equal q, it is the smaller of the two
+	double brotli = content_coding_quality(accepted, "br", nullptr);
+	double gzip = content_coding_quality(accepted, "gzip", "x-gzip");
+	struct
+	{
+		double quality;
+		precompressed_coding coding;
+		const char *suffix;
+	} candidates[] = { { brotli, precompressed_coding::brotli, ".br" }, { gzip, precompressed_coding::gzip, ".gz" } };
+	if (gzip > brotli)
+		std::swap(candidates[0], candidates[1]);
 
-	return send(client, status_line.data(), status_line.size(), MSG_NOSIGNAL);
+	for (auto &candidate: candidates)
+	{
+		if (candidate.quality <= 0)
+			continue;
+
+		// the index knows the sibling without a stat; otherwise its lookup, a miss too, is kept with the original
+		arena_string requested = request.get_address();
+		requested += candidate.suffix;
+		std::shared_ptr<const indexed_file> indexed;
+		std::shared_ptr<const file_metadata> encoded;
+		if (path_index::instance().snapshot_of(requested.data(), requested.size(), indexed))
+		{
+			encoded = file_metadata_cache::instance().lookup_encoded(indexed ? &indexed->statbuf : nullptr, *metadata,
+					candidate.coding);
+		}
+		else
+		{
+			arena_string sibling = path;
+			sibling += candidate.suffix;
+			encoded = file_metadata_cache::instance().lookup_encoded(sibling.data(), *metadata, candidate.coding);
+		}
+		// a sibling older than the original is stale and skipped
+		if (encoded && (encoded->modified.tv_sec > metadata->modified.tv_sec
+					|| (encoded->modified.tv_sec == metadata->modified.tv_sec
+						&& encoded->modified.tv_nsec >= metadata->modified.tv_nsec)))
+		{
+			path += candidate.suffix;
+			metadata = std::move(encoded);
+			return;
+		}
+	}
+}
+
+bool is_not_modified(const http_request &request, const file_metadata &metadata) noexcept
+{
+	// If-None-Match takes precedence, If-Modified-Since is then ignored
+	if (!request.get_if_none_match().empty())
+		return entity_tag_matches(request.get_if_none_match(), metadata.etag);
+
+	const arena_string &since = request.get_if_modified_since();
+	if (since.empty())
+		return false;
+	if (since.compare(metadata.last_modified.data()) == 0)
+		return true;
+
+	time_t since_time = http_date_to_time_t(since.data());
+	return since_time != -1 && metadata.modified.tv_sec <= since_time;
+}
+
+ssize_t send_not_modified(active_connection &client, const file_metadata &metadata) noexcept
+{
+	response_head head;
+	head.status_line(304) << "Date: ";
+	head.date() << "\r\nServer: Bolbot-CPPserver/10.0\r\nETag: " << metadata.etag;
+	head << "\r\nLast-Modified: " << metadata.last_modified;
+	if (varies_by_encoding())
+		head << "\r\nVary: Accept-Encoding";
+	head << "\r\n\r\n";
+	return send_response_head(client, 304, head);
+}
+
+bool parse_byte_position(const arena_string &text, size_t first, size_t last, off_t &value) noexcept
+{
+	if (first >= last)
+		return false;
+
+	uint64_t result = 0;
+	for (size_t i = first; i != last; ++i)
+	{
+		if (!isdigit(static_cast<unsigned char>(text[i])) || result > (static_cast<uint64_t>(INT64_MAX) - 9) / 10)
+			return false;
+		result = result * 10 + (text[i] - '0');
+	}
+	value = static_cast<off_t>(result);
+	return true;
 }
 
-ssize_t send_headers(active_connection &client, open_file &file)
+bool parse_byte_ranges(const arena_string &header, off_t size, std::vector<byte_range> &ranges)
 {
-	std::string general_header;
+	// false means the header is ignored and the whole file is sent; no ranges left means 416
+	constexpr size_t max_ranges = 16;
 
-	general_header += "Date: ";
-	general_header += time_t_to_string(current_time_t());
-	general_header += "\r\n";
+	ranges.clear();
+	size_t equals = header.find('=');
+	if (equals == std::string::npos || header.find_first_not_of(" \t") == equals)
+		return false;
+	size_t unit_end = header.find_last_not_of(" \t", equals - 1) + 1;
+	if (unit_end != 5 || strncasecmp(header.data(), "bytes", 5) != 0)
+		return false;
 
-	std::string response_header;
+	size_t position = equals + 1;
+	size_t specs = 0;
+	while (position < header.size())
+	{
+		size_t end = header.find(',', position);
+		if (end == std::string::npos)
+			end = header.size();
+		size_t first = header.find_first_not_of(" \t", position);
+		position = end + 1;
+		if (first == std::string::npos || first >= end)
+			continue;
+		size_t last = header.find_last_not_of(" \t", end - 1) + 1;
+
+		if (++specs > max_ranges)
+			return false;
 
-	response_header += "Location: ";
-	response_header += file.location();
-	response_header += "\r\n";
-	response_header += "Server: Bolbot-CPPserver/10.0\r\n";
+		size_t dash = header.find('-', first);
+		if (dash == std::string::npos || dash >= last)
+			return false;
 
-	std::string entity_header;
+		byte_range range;
+		if (dash == first)
+		{
+			off_t suffix;
+			if (!parse_byte_position(header, dash + 1, last, suffix))
+				return false;
+			if (suffix == 0 || size == 0)
+				continue;
+			range.first = (suffix < size) ? size - suffix : 0;
+			range.last = size - 1;
+		}
+		else
+		{
+			if (!parse_byte_position(header, first, dash, range.first))
+				return false;
+			if (dash + 1 == last)
+				range.last = size - 1;
+			else if (!parse_byte_position(header, dash + 1, last, range.last) || range.last < range.first)
+				return false;
 
-	const char allowed_methods[] = "GET";
-	entity_header += "Allow: ";
-	entity_header += allowed_methods;
-	entity_header += "\r\n";
+			if (range.first >= size)
+				continue;
+			range.last = std::min(range.last, size - 1);
+		}
+		ranges.push_back(range);
+	}
 
-	entity_header += "Content-Length: ";
-	entity_header += std::to_string(file.size());
-	entity_header += "\r\n";
-	entity_header += "Content-Type: ";
-	entity_header += file.mime_type();
-	entity_header += "\r\n";
+	if (!specs)
+		return false;
 
-	entity_header += "Expires: ";
-	entity_header += time_t_to_string(current_time_t());
-	entity_header += "\r\n";
-	entity_header += "Last-Modified: ";
-	entity_header += file.last_modified();
-	entity_header += "\r\n";
+	// overlapping and adjacent ranges are coalesced, so a client cannot multiply the body
+	if (ranges.size() > 1)
+	{
+		std::sort(ranges.begin(), ranges.end(), [](const byte_range &a, const byte_range &b) { return a.first < b.first; });
+		size_t kept = 0;
+		for (size_t i = 1; i != ranges.size(); ++i)
+		{
+			if (ranges[i].first <= ranges[kept].last + 1)
+				ranges[kept].last = std::max(ranges[kept].last, ranges[i].last);
+			else
+				ranges[++kept] = ranges[i];
+		}
+		ranges.resize(kept + 1);
+	}
+	return true;
+}
 
-	std::string total = general_header + response_header + entity_header + "\r\n";
+bool if_range_allows(const http_request &request, const file_metadata &metadata) noexcept
+{
+	// the range applies only to the representation the client already has part of
+	const arena_string &validator = request.get_if_range();
+	if (validator.empty())
+		return true;
+	if (validator[0] == '"' || validator.compare(0, 2, "W/") == 0)
+		return validator.compare(metadata.etag.data()) == 0;
+	return validator.compare(metadata.last_modified.data()) == 0;
+}
 
-	return send(client, total.data(), total.size(), MSG_NOSIGNAL);
+response_body whole_file_body(arena &memory, const file_metadata &metadata)
+{
+	response_body body(memory);
+	body.length = metadata.size;
+	body.pieces.push_back(body_piece{ "", 0, body.length });
+	return body;
 }
 
-void send_client_a_file(active_connection &client, open_file &file) noexcept
+response_body ranged_body(arena &memory, const file_metadata &metadata, const std::vector<byte_range> &ranges)
+{
+	response_body body(memory);
+	std::string size = std::to_string(metadata.size);
+
+	if (ranges.size() == 1)
+	{
+		const byte_range &range = ranges.front();
+		body.length = range.last - range.first + 1;
+		body.content_range = "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + size;
+		body.pieces.push_back(body_piece{ "", range.first, body.length });
+		return body;
+	}
+
+	static std::atomic<uint64_t> boundaries{ 0 };
+	char boundary[40];
+	snprintf(boundary, sizeof(boundary), "final_byteranges_%016llx",
+			static_cast<unsigned long long>((boundaries.fetch_add(1, std::memory_order_relaxed) + 1) * 0x9e3779b97f4a7c15ull));
+
+	std::string part_type = "\r\nContent-Type: " + metadata.mime_type + "\r\nContent-Range: bytes ";
+	for (const byte_range &range: ranges)
+	{
+		body_piece piece;
+		piece.text = "\r\n--";
+		piece.text += boundary;
+		piece.text += part_type + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + size + "\r\n\r\n";
+		piece.offset = range.first;
+		piece.length = range.last - range.first + 1;
+		body.length += piece.text.size() + piece.length;
+		body.pieces.push_back(std::move(piece));
+	}
+	body.pieces.push_back(body_piece{ std::string("\r\n--") + boundary + "--\r\n", 0, 0 });
+	body.length += body.pieces.back().text.size();
+	body.content_type = std::string("multipart/byteranges; boundary=") + boundary;
+	return body;
+}
+
+ssize_t send_range_not_satisfiable(active_connection &client, off_t size) noexcept
+{
+	response_head head;
+	head.status_line(416) << "Date: ";
+	head.date() << "\r\nServer: Bolbot-CPPserver/10.0\r\nContent-Range: bytes */";
+	head.number(size) << "\r\nContent-Length: 0\r\n\r\n";
+	return send_response_head(client, 416, head);
+}
+
+void send_client_a_file(active_connection &client, open_file &file, const response_body &body) noexcept
 {
 	constexpr size_t max_attempts = 3;
 
-	for (size_t i = 0; i < max_attempts; ++i)
+	uint64_t body_started = phase_ticks();
+	arm_send_deadline(client, body.length);
+
+	for (const body_piece &piece: body.pieces)
 	{
-		ssize_t file_sent = sendfile(client, file, nullptr, file.size());
-		if (file_sent ==  -1 || file.size() == static_cast<size_t>(file_sent))
+		if (!piece.text.empty())
+		{
+			ssize_t sent = send(client, piece.text.data(), piece.text.size(), MSG_NOSIGNAL | MSG_MORE);
+			if (sent == -1)
+				break;
+			client->bytes_sent += sent;
+		}
+
+		// zero-copy from the offset of the piece
+		off_t &offset = client->send_offset;
+		offset = piece.offset;
+		const off_t end = piece.offset + piece.length;
+		for (size_t i = 0; i < max_attempts && offset < end; ++i)
+		{
+			ssize_t file_sent = sendfile(client, file, &offset, end - offset);
+			if (file_sent == -1)
+				break;
+			client->bytes_sent += file_sent;
+		}
+		if (offset < end)
 			break;
 	}
+
+	record_phase(request_phase::body, body_started, phase_ticks());
+}
+
+void send_bulk_transfer(bulk_transfer transfer) noexcept
+{
+	send_client_a_file(transfer.client, transfer.file, transfer.body);
+	account_request(transfer.client);
+}
+
+void account_request(active_connection &client) noexcept
+{
+	using namespace std::chrono;
+
+	count_statistic(statistic::requests);
+	count_statistic(statistic::bytes_sent, client->bytes_sent);
+	count_status(client->status);
+
+	steady_clock::time_point answered_at = steady_clock::now();
+	metrics_segment::instance().publish_request(client->status, client->bytes_sent, answered_at - client->accepted_at);
+	trace_span("connection", client->accepted_at, answered_at, "fd", client->fd);
+
+	access_log &log = access_log::instance();
+	if (!log.enabled())
+		return;
+
+	steady_clock::time_point finished_at = steady_clock::now();
+	auto microseconds_between = [](steady_clock::time_point from, steady_clock::time_point to) -> uint32_t
+	{
+		if (from == steady_clock::time_point{} || to < from)
+			return 0;
+		return static_cast<uint32_t>(std::min<int64_t>(duration_cast<microseconds>(to - from).count(), UINT32_MAX));
+	};
+
+	access_log_entry entry;
+	memset(&entry, 0, sizeof(entry));
+
+	entry.timestamp_ns = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+	entry.path_hash = client->path_hash;
+	entry.bytes_sent = client->bytes_sent;
+	entry.status = client->status;
+
+	const struct sockaddr_storage &peer = client->peer;
+	entry.family = peer.ss_family;
+	if (peer.ss_family == AF_INET)
+	{
+		const struct sockaddr_in &ipv4 = reinterpret_cast<const struct sockaddr_in &>(peer);
+		memcpy(entry.address, &ipv4.sin_addr, sizeof(ipv4.sin_addr));
+		entry.port = ntohs(ipv4.sin_port);
+	}
+	else if (peer.ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6 &ipv6 = reinterpret_cast<const struct sockaddr_in6 &>(peer);
+		memcpy(entry.address, &ipv6.sin6_addr, sizeof(ipv6.sin6_addr));
+		entry.port = ntohs(ipv6.sin6_port);
+	}
+
+	steady_clock::time_point parsed_at = (client->parsed_at == steady_clock::time_point{}) ? finished_at : client->parsed_at;
+	steady_clock::time_point opened_at = (client->opened_at == steady_clock::time_point{}) ? parsed_at : client->opened_at;
+
+	entry.phase_us[static_cast<size_t>(access_phase::receive)] = microseconds_between(client->accepted_at, client->last_activity);
+	entry.phase_us[static_cast<size_t>(access_phase::parse)] = microseconds_between(client->last_activity, parsed_at);
+	entry.phase_us[static_cast<size_t>(access_phase::open)] = microseconds_between(parsed_at, opened_at);
+	entry.phase_us[static_cast<size_t>(access_phase::send)] = microseconds_between(opened_at, finished_at);
+
+	log.append(entry);
 }
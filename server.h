@@ -10,32 +10,142 @@
 
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/syscall.h>
 #include <sys/sendfile.h>
 
 #include "utils.h"
+#include "access_log.h"
+#include "statistics.h"
+#include "status_page.h"
+#include "metrics_segment.h"
 #include "multithreading.h"
+#include "compression_cache.h"
+#include "tree_watcher.h"
+#include "path_filter.h"
+#include "path_index.h"
+#include "response_head.h"
+#include "admission.h"
 #include "server_classes.h"
 
 struct addrinfo get_addrinfo_hints() noexcept;
 
 int get_binded_socket(struct addrinfo *address_info) noexcept;
 
-int get_listening_socket() noexcept;
+int get_listening_socket(const std::string &port) noexcept;
 
-void run_server_loop(int master_socket);
+void run_server_loop(int master_socket, int admin_socket);
+
+bool wait_for_connections(int master_socket, int admin_socket, bool &admin_ready, int timeout_ms) noexcept;
 
 void process_the_accepted_connection(active_connection client_fd);
 
-void process_client_request(active_connection &client, http_request request);
+bool receive_request_head(active_connection &client) noexcept;
+
+void arm_send_deadline(active_connection &client, size_t bytes) noexcept;
+
+void process_client_request(active_connection &client, http_request request, uint64_t parse_started);
 
 const char *http_response_phrase(short status) noexcept;
 
-ssize_t send_status_line(active_connection &client, short status);
+ssize_t send_status_line(active_connection &client, short status) noexcept;
+
+ssize_t send_response_head(active_connection &client, short status, const response_head &head) noexcept;
+
+struct byte_range
+{
+	off_t first;
+	off_t last;				// inclusive
+};
+
+struct body_piece
+{
+	std::string text;			// sent before the file bytes, parts headers of multipart/byteranges
+	off_t offset;
+	off_t length;
+};
+
+struct response_body
+{
+	arena_vector<body_piece> pieces;
+	off_t length = 0;
+	std::string content_type;		// empty keeps the MIME type of the file
+	std::string content_range;		// only for a single range
+
+	explicit response_body(arena &memory) : pieces(arena_allocator<body_piece>(memory))
+	{}
+};
+
+bool parse_byte_position(const arena_string &text, size_t first, size_t last, off_t &value) noexcept;
+
+bool parse_byte_ranges(const arena_string &header, off_t size, std::vector<byte_range> &ranges);
+
+bool if_range_allows(const http_request &request, const file_metadata &metadata) noexcept;
+
+response_body whole_file_body(arena &memory, const file_metadata &metadata);
+
+response_body ranged_body(arena &memory, const file_metadata &metadata, const std::vector<byte_range> &ranges);
+
+ssize_t send_range_not_satisfiable(active_connection &client, off_t size) noexcept;
+
+void write_headers(response_head &head, const char *location, const file_metadata &metadata,
+		const response_body &body) noexcept;
+
+ssize_t send_headers(active_connection &client, short status, const char *location, const file_metadata &metadata,
+		const response_body &body) noexcept;
+
+bool entity_tag_matches(const arena_string &tags, const std::string &etag) noexcept;
+
+double content_coding_quality(const arena_string &accepted, const char *coding, const char *alias) noexcept;
+
+bool known_missing(const char *path, size_t length);
+
+bool varies_by_encoding() noexcept;
+
+bool compression_wanted(const http_request &request, const file_metadata &metadata) noexcept;
+
+ssize_t send_buffer(active_connection &client, const char *data, size_t size) noexcept;
+
+void send_compressed_variant(active_connection &client, const char *location, const compressed_variant &variant,
+		bool with_body);
+
+void choose_precompressed(const http_request &request, arena_string &path, std::shared_ptr<const file_metadata> &metadata);
+
+bool is_not_modified(const http_request &request, const file_metadata &metadata) noexcept;
+
+ssize_t send_not_modified(active_connection &client, const file_metadata &metadata) noexcept;
+
+void send_client_a_file(active_connection &client, open_file &file, const response_body &body) noexcept;
+
+struct bulk_transfer
+{
+	active_connection client;
+	open_file file;
+	response_body body;
+};
+
+struct compression_job
+{
+	active_connection client;
+	std::string location;
+	std::string path;
+	std::shared_ptr<const file_metadata> original;
+};
+
+void send_bulk_transfer(bulk_transfer transfer) noexcept;
+
+void send_compressed(compression_job job) noexcept;
+
+void account_request(active_connection &client) noexcept;
+
+void process_admin_connection(active_connection client);
+
+bool send_status_page(active_connection &client, const http_request &request);
 
-ssize_t send_headers(active_connection &client, open_file &file);
+size_t queued_tasks(const thread_pool &pool) noexcept;
 
-void send_client_a_file(active_connection &client, open_file &file) noexcept;
+void publish_pool_metrics(metrics_segment &metrics, const thread_pool &pool) noexcept;
 
 #endif
@@ -1,145 +1,350 @@
 #ifndef __SERVER_CLASSES_H__
 #define __SERVER_CLASSES_H__
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <string>
-#include <regex>
-#include <sstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "logging.h"
+#include "phase_timing.h"
+#include "statistics.h"
+#include "timer_wheel.h"
 
-class active_connection final
+class connection_pool;
+
+struct connection_state final
 {
-	class implementation final
+	static constexpr size_t buffer_size = 8192;
+
+	int fd = -1;
+	char buffer[buffer_size];
+	size_t received = 0;
+	short status = 0;
+	off_t send_offset = 0;
+	size_t bytes_sent = 0;
+	uint64_t path_hash = 0;
+	arena memory;					// of the request and its response, reset when the state is released
+	struct sockaddr_storage peer;
+	std::chrono::steady_clock::time_point accepted_at;
+	std::chrono::steady_clock::time_point last_activity;
+	std::chrono::steady_clock::time_point parsed_at;
+	std::chrono::steady_clock::time_point opened_at;
+	timer_node timer;				// the deadline the connection is held to, if any
+
+	connection_state *next_free = nullptr;
+	connection_pool *owner = nullptr;
+};
+
+class connection_pool final
+{
+private:
+	// states are handed out by the accepting thread only, while any worker may give them back
+	static constexpr size_t slab_size = 256;
+	static constexpr size_t default_capacity = 1024;
+
+	const size_t capacity;
+	size_t allocated = 0;
+	std::vector<std::unique_ptr<connection_state[]>> slabs;
+	connection_state *local_free = nullptr;
+	std::atomic<connection_state *> released{ nullptr };
+	std::atomic<size_t> in_use{ 0 };
+
+	bool allocate_slab() noexcept
 	{
-	private:
-		int fd;
-	public:
-		explicit implementation(int master_socket) noexcept : fd{ accept(master_socket, nullptr, nullptr) }
+		size_t count = std::min(slab_size, capacity - allocated);
+		if (count == 0)
+			return false;
+
+		try
 		{
-			if (fd == -1)
-			{
-				std::lock_guard<std::mutex> lock(cerr_mutex);
-				LOG_CERROR("Error of accept, connection stays flawed");
-			}
+			slabs.emplace_back(new connection_state[count]);
 		}
-		~implementation()
+		catch (...)
 		{
-			if (fd == -1)
-			{
-				return;
-			}
-
-			if (close(fd) == -1)
-			{
-				std::lock_guard<std::mutex> lock(cerr_mutex);
-				LOG_CERROR("Failed to close connection");
-				std::cerr << "fd " << fd << " not closed in proper way\n";
-			}
+			return false;
 		}
 
-		implementation(const implementation &) = default;
-		implementation &operator=(const implementation &) = default;
-		implementation(implementation &&) = default;
-		implementation &operator=(implementation &&) = default;
-
-		operator int() const noexcept
+		connection_state *slab = slabs.back().get();
+		for (size_t i = 0; i != count; ++i)
 		{
-			return fd;
+			slab[i].owner = this;
+			slab[i].next_free = local_free;
+			local_free = slab + i;
 		}
-	};
-private:
-	std::shared_ptr<implementation> fd;
+		allocated += count;
+		return true;
+	}
 public:
-	explicit active_connection(int master_socket) : fd{ new implementation(master_socket) }
+	explicit connection_pool(size_t limit_of_file_descriptors) noexcept
+		: capacity{ limit_of_file_descriptors ? limit_of_file_descriptors : default_capacity }
 	{}
 
-	active_connection() : fd{ nullptr }
-	{}
+	connection_pool(const connection_pool &) = delete;
+	connection_pool &operator=(const connection_pool &) = delete;
 
-	active_connection(const active_connection &other) : fd{ other.fd }
-	{}
-	active_connection &operator=(const active_connection &other)
+	connection_state *acquire() noexcept
+	{
+		if (!local_free)
+			local_free = released.exchange(nullptr, std::memory_order_acquire);
+
+		if (!local_free && !allocate_slab())
+			return nullptr;
+
+		connection_state *state = local_free;
+		local_free = state->next_free;
+		state->next_free = nullptr;
+		in_use.fetch_add(1, std::memory_order_relaxed);
+		return state;
+	}
+
+	void release(connection_state *state) noexcept
 	{
-		if (this != &other)
+		state->fd = -1;
+		state->received = 0;
+		state->status = 0;
+		state->send_offset = 0;
+		state->bytes_sent = 0;
+		state->path_hash = 0;
+		state->memory.reset();
+		state->parsed_at = state->opened_at = std::chrono::steady_clock::time_point{};
+		state->timer.expired.store(false, std::memory_order_relaxed);
+
+		state->next_free = released.load(std::memory_order_relaxed);
+		while (!released.compare_exchange_weak(state->next_free, state,
+					std::memory_order_release, std::memory_order_relaxed))
+		{}
+		in_use.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// states handed out and not released yet, the live connections
+	size_t live() const noexcept
+	{
+		return in_use.load(std::memory_order_relaxed);
+	}
+
+	size_t get_capacity() const noexcept
+	{
+		return capacity;
+	}
+};
+
+class active_connection final
+{
+private:
+	connection_state *state;
+
+	void reset() noexcept
+	{
+		if (!state)
 		{
-			fd = other.fd;
+			return;
 		}
-		return *this;
+
+		if (state->fd != -1)
+		{
+			count_statistic(statistic::connections_closed);
+			// before close, a deadline firing later must not shut down a reused fd
+			timer_wheel::instance().disarm(state->timer);
+		}
+
+		if (state->fd != -1 && close(state->fd) == -1)
+		{
+			LOG_CERROR("Failed to close connection");
+			log_record{} << "fd " << state->fd << " not closed in proper way\n";
+		}
+
+		state->owner->release(state);
+		state = nullptr;
+	}
+public:
+	active_connection(connection_pool &pool, int master_socket) noexcept : state{ pool.acquire() }
+	{
+		socklen_t peer_length = sizeof(struct sockaddr_storage);
+		uint64_t accept_started = phase_ticks();
+		int fd = (state) ? accept(master_socket, reinterpret_cast<struct sockaddr *>(&state->peer), &peer_length)
+			: accept(master_socket, nullptr, nullptr);
+		if (!state)
+		{
+			if (fd != -1)
+				close(fd);
+			log_record{} << "Connection pool of " << pool.get_capacity() << " states is exhausted, connection dropped\n";
+			return;
+		}
+
+		// counted only with a state, whose reset counts the close
+		if (fd != -1)
+		{
+			record_phase(request_phase::accept, accept_started, phase_ticks());
+			count_statistic(statistic::connections_opened);
+		}
+
+		state->fd = fd;
+		if (fd == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;		// the non-blocking master socket has no more pending connections
+			if (errno == EMFILE || errno == ENFILE)
+				return;		// left to admission control, which checks errno
+
+			LOG_CERROR("Error of accept, connection stays flawed");
+			return;
+		}
+
+		state->accepted_at = state->last_activity = std::chrono::steady_clock::now();
 	}
 
-	active_connection(active_connection &&other) noexcept : fd{ std::move(other.fd) }
+	active_connection() noexcept : state{ nullptr }
 	{}
+
+	active_connection(const active_connection &) = delete;
+	active_connection &operator=(const active_connection &) = delete;
+
+	active_connection(active_connection &&other) noexcept : state{ other.state }
+	{
+		other.state = nullptr;
+	}
 	active_connection &operator=(active_connection &&other) noexcept
 	{
 		if (&other != this)
-			fd = std::move(other.fd);
+		{
+			reset();
+			state = other.state;
+			other.state = nullptr;
+		}
 		return *this;
 	}
 
 	~active_connection()
-	{}
+	{
+		reset();
+	}
 
 	explicit operator bool() const noexcept
 	{
-		return (fd && (*fd != -1));
+		return (state && (state->fd != -1));
 	}
 
 	operator int() const noexcept
 	{
-		return ((fd) ? *fd : -1);
+		return ((state) ? state->fd : -1);
+	}
+
+	connection_state *operator->() const noexcept
+	{
+		return state;
 	}
 };
 
 class http_request final
 {
+	// parsed in place from the received bytes; what is kept lives in the arena of the connection
 private:
-	std::string source;
-	std::string address;
+	const char *source;
+	size_t length;
+	arena_string address;
 	short status = 520;
 	char delimiter;
-	bool http09;
-
-	const std::regex simple_request
+	bool http09 = false;
+	bool head = false;
+	arena_string if_none_match;
+	arena_string if_modified_since;
+	arena_string range;
+	arena_string if_range;
+	arena_string accept_encoding;
+
+	static bool is_space(char c) noexcept
 	{
-		R"(^GET\s\S+$)"
-	};
-	const std::regex full_request
+		return isspace(static_cast<unsigned char>(c));
+	}
+	static bool is_digit(char c) noexcept
 	{
-		R"(^((GET)|(POST)|(HEAD))(\s\S+\s)(HTTP/\d\.\d)$)"
-	};
-	const std::regex header
+		return isdigit(static_cast<unsigned char>(c));
+	}
+	static bool contains(const char *line, size_t size, const char *text) noexcept
 	{
-		R"(^[^()<>@,;:\"/\[\]?={} 	[:cntrl:]]+:[^[:cntrl:]]*$)"
-	};
+		return std::search(line, line + size, text, text + strlen(text)) != line + size;
+	}
+	static bool starts_with(const char *line, size_t size, const char *text) noexcept
+	{
+		size_t text_size = strlen(text);
+		return size >= text_size && !memcmp(line, text, text_size);
+	}
+	// end of the run of non-whitespace characters starting at from
+	static size_t token_end(const char *line, size_t size, size_t from) noexcept
+	{
+		while (from < size && !is_space(line[from]))
+			++from;
+		return from;
+	}
+	// ^((GET)|(POST)|(HEAD))(\s\S+\s)(HTTP/\d\.\d)$
+	static bool is_full_request(const char *line, size_t size) noexcept
+	{
+		size_t method = starts_with(line, size, "GET") ? 3
+			: (starts_with(line, size, "POST") || starts_with(line, size, "HEAD")) ? 4 : 0;
+		if (!method || method == size || !is_space(line[method]))
+			return false;
 
-	std::string readline(std::istringstream &stream) const
+		size_t target_end = token_end(line, size, method + 1);
+		const char *version = line + target_end + 1;
+		return target_end != method + 1 && size - target_end == 9 && is_space(line[target_end])
+			&& !memcmp(version, "HTTP/", 5) && is_digit(version[5]) && version[6] == '.' && is_digit(version[7]);
+	}
+	// ^GET\s\S+$
+	static bool is_simple_request(const char *line, size_t size) noexcept
+	{
+		return size > 4 && starts_with(line, size, "GET") && is_space(line[3]) && token_end(line, size, 4) == size;
+	}
+	// ^[^()<>@,;:\"/\[\]?={} \t[:cntrl:]]+:[^[:cntrl:]]*$
+	static bool is_header(const char *line, size_t size) noexcept
 	{
-		std::string result;
-		getline(stream, result, delimiter);
-		if (delimiter == '\r')
+		size_t colon = 0;
+		while (colon < size && !iscntrl(static_cast<unsigned char>(line[colon])) && !strchr("()<>@,;:\"/[]?={} \t", line[colon]))
+			++colon;
+		if (colon == 0 || colon == size || line[colon] != ':')
+			return false;
+		for (size_t i = colon + 1; i != size; ++i)
 		{
-			if (stream.peek() == '\n')
-				stream.get();
+			if (iscntrl(static_cast<unsigned char>(line[i])))
+				return false;
 		}
-		return result;
+		return true;
+	}
+
+	// the line at position, which moves past the delimiter; an LF after a CR delimiter is skipped too
+	void readline(size_t &position, const char *&line, size_t &size) const noexcept
+	{
+		line = source + position;
+		const char *found = static_cast<const char *>(memchr(line, delimiter, length - position));
+		size = found ? found - line : length - position;
+		position = found ? position + size + 1 : length;
+		if (delimiter == '\r' && position < length && source[position] == '\n')
+			++position;
 	}
 	void set_delimiter() noexcept
 	{
-		if (source.find('\r') != std::string::npos)
+		if (memchr(source, '\r', length))
 			delimiter = '\r';
 		else
 			delimiter = '\n';
 	}
 	bool is_invalid_request() noexcept
 	{
-		if (source.find('\n') == std::string::npos && source.find('\r') == std::string::npos)
+		if (!memchr(source, '\n', length) && !memchr(source, '\r', length))
 		{
-			if (source.size())
+			if (length)
 				status = 414;
 			else
 				status = 400;
@@ -147,27 +352,81 @@ private:
 		}
 		return false;
 	}
-	void set_address_from_first_line(std::string first_line)
+	static bool header_name_is(const char *line, size_t colon, const char *name) noexcept
 	{
-		std::stringstream temp;
-		temp.str(first_line);
-		temp >> address;
-		temp >> address;
-		auto question_mark_pos = address.find("?");
-		if (question_mark_pos != std::string::npos)
+		if (colon != strlen(name))
+			return false;
+		for (size_t i = 0; i != colon; ++i)
 		{
-			address.erase(question_mark_pos);
+			if (tolower(static_cast<unsigned char>(line[i])) != name[i])
+				return false;
 		}
+		return true;
+	}
+	void remember_header(const char *line, size_t size)
+	{
+		// only the headers the server acts upon are kept
+		size_t colon = static_cast<const char *>(memchr(line, ':', size)) - line;
+		size_t value_start = colon + 1;
+		while (value_start < size && (line[value_start] == ' ' || line[value_start] == '\t'))
+			++value_start;
+		size_t value_end = size;
+		while (value_end > value_start && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t'))
+			--value_end;
+
+		arena_string *value = nullptr;
+		if (header_name_is(line, colon, "if-none-match"))
+			value = &if_none_match;
+		else if (header_name_is(line, colon, "if-modified-since"))
+			value = &if_modified_since;
+		else if (header_name_is(line, colon, "range"))
+			value = &range;
+		else if (header_name_is(line, colon, "if-range"))
+			value = &if_range;
+		else if (header_name_is(line, colon, "accept-encoding"))
+			value = &accept_encoding;
+		if (value)
+			value->assign(line + value_start, value_end - value_start);
+	}
+	void set_address_from_first_line(const char *line, size_t size)
+	{
+		// the second word, without the query
+		size_t start = token_end(line, size, 0);
+		while (start < size && is_space(line[start]))
+			++start;
+		size_t end = token_end(line, size, start);
+		const char *question_mark = static_cast<const char *>(memchr(line + start, '?', end - start));
+		if (question_mark)
+			end = question_mark - line;
+		address.assign(line + start, end - start);
 	}
 public:
-	explicit http_request(const char *s) : source{ s }
+	// text, NUL-terminated, must outlive the request
+	http_request(const char *text, arena &memory) : source{ text }, length{ strlen(text) },
+		address(arena_allocator<char>(memory)), if_none_match(arena_allocator<char>(memory)),
+		if_modified_since(arena_allocator<char>(memory)), range(arena_allocator<char>(memory)),
+		if_range(arena_allocator<char>(memory)), accept_encoding(arena_allocator<char>(memory))
 	{
 		set_delimiter();
 	}
 
-	http_request(const http_request &) = default;				// is this a problem? do some unit tests perhaps...
+	http_request(const http_request &) = default;
 	http_request &operator=(const http_request &) = default;
 
+	// whether the received bytes hold the whole head: up to the empty line, or the request line of HTTP/0.9
+	static bool is_complete_head(const char *text, size_t size) noexcept
+	{
+		const char *line_end = static_cast<const char *>(memchr(text, '\n', size));
+		const char *carriage_return = static_cast<const char *>(memchr(text, '\r', size));
+		if (!line_end || (carriage_return && carriage_return < line_end))
+			line_end = carriage_return;
+		if (!line_end)
+			return false;
+		if (!contains(text, line_end - text, " HTTP/") || contains(text, line_end - text, " HTTP/0.9"))
+			return true;
+		return contains(text, size, "\n\r\n") || contains(text, size, "\n\n") || contains(text, size, "\r\r");
+	}
+
 	void parse_request()
 	{
 		if (is_invalid_request())
@@ -175,37 +434,39 @@ public:
 			return;
 		}
 
-		std::istringstream stream{ source };
-
-		std::string first_line = readline(stream);
-		if (first_line.size() < 5 || first_line.find(" ") == std::string::npos)
+		size_t position = 0;
+		const char *first_line;
+		size_t first_size;
+		readline(position, first_line, first_size);
+		if (first_size < 5 || !memchr(first_line, ' ', first_size))
 		{
 			status = 400;
 			return;
 		}
 
-		if (regex_match(first_line, full_request))
+		if (is_full_request(first_line, first_size))
 		{
 			http09 = false;
-			if (first_line.find(" HTTP/0.9") != std::string::npos)
+			if (contains(first_line, first_size, " HTTP/0.9"))
 			{
 				http09 = true;
 			}
 			else
 			{
-				if (first_line.find(" HTTP/1.0") == std::string::npos)
+				if (!contains(first_line, first_size, " HTTP/1.0"))
 				{
 					status = 505;
 					return;
 				}
-				if (first_line.find("HEAD") == 0 || first_line.find("POST") == 0)		// why not implement HEAD sometime later?
+				if (starts_with(first_line, first_size, "POST"))
 				{
 					status = 405;
 					return;
 				}
+				head = starts_with(first_line, first_size, "HEAD");
 			}
 		}
-		else if(regex_match(first_line, simple_request))
+		else if (is_simple_request(first_line, first_size))
 		{
 			http09 = true;
 		}
@@ -217,17 +478,26 @@ public:
 
 		status = 200;
 
-		set_address_from_first_line(first_line);
+		set_address_from_first_line(first_line, first_size);
 
 		if (http09)
 			return;
 
-		std::string current;
-		while (!(current = readline(stream)).empty())
+		const char *current;
+		size_t current_size;
+		while (position < length)
 		{
-			if (!regex_match(current, header))
+			readline(position, current, current_size);
+			if (!current_size)
+				break;
+			if (!is_header(current, current_size))
+			{
+				std::cout << "Found improper header in request: ";
+				std::cout.write(current, current_size) << std::endl;
+			}
+			else
 			{
-				std::cout << "Found improper header in request: " << current << std::endl;
+				remember_header(current, current_size);
 			}
 		}
 	}
@@ -239,7 +509,7 @@ public:
 	{
 		return status;
 	}
-	std::string get_address() const noexcept
+	const arena_string &get_address() const noexcept
 	{
 		return address;
 	}
@@ -247,6 +517,30 @@ public:
 	{
 		return !http09;
 	}
+	bool is_head() const noexcept
+	{
+		return head;
+	}
+	const arena_string &get_if_none_match() const noexcept
+	{
+		return if_none_match;
+	}
+	const arena_string &get_if_modified_since() const noexcept
+	{
+		return if_modified_since;
+	}
+	const arena_string &get_range() const noexcept
+	{
+		return range;
+	}
+	const arena_string &get_if_range() const noexcept
+	{
+		return if_range;
+	}
+	const arena_string &get_accept_encoding() const noexcept
+	{
+		return accept_encoding;
+	}
 };
 
 void process_the_accepted_connection(active_connection client_fd);
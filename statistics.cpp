@@ -0,0 +1,76 @@
+#include <mutex>
+#include <vector>
+#include <memory>
+
+#include "statistics.h"
+#include "thread_shards.h"
+
+const char *statistic_name(statistic which) noexcept
+{
+	static const char *names[statistics_count] = { "connections_opened", "connections_closed", "requests", "bytes_sent",
+		"metadata_hits", "metadata_misses", "compressions", "compression_cpu_us", "compression_saved_bytes",
+		"metadata_coalesced", "compression_coalesced", "missing_cached", "missing_filtered",
+		"path_index_hits", "path_index_misses", "timeouts_idle", "timeouts_header", "timeouts_send",
+		"connections_shed" };
+	return names[static_cast<size_t>(which)];
+}
+
+namespace
+{
+	const std::chrono::steady_clock::time_point process_started_at = std::chrono::steady_clock::now();
+
+	struct statistics_shard
+	{
+		// written by the owning thread only, read by collections, hence relaxed atomics without read-modify-write
+		std::atomic<uint64_t> values[statistics_count];
+		std::atomic<uint64_t> statuses[statuses_count];
+
+		statistics_shard() noexcept
+		{
+			for (auto &i: values)
+				i.store(0, std::memory_order_relaxed);
+			for (auto &i: statuses)
+				i.store(0, std::memory_order_relaxed);
+		}
+
+		void add_to(statistics_snapshot &destination) const noexcept
+		{
+			for (size_t i = 0; i != statistics_count; ++i)
+				destination.values[i] += values[i].load(std::memory_order_relaxed);
+			for (size_t i = 0; i != statuses_count; ++i)
+				destination.statuses[i] += statuses[i].load(std::memory_order_relaxed);
+		}
+	};
+
+	thread_shards<statistics_shard, statistics_snapshot> &shards()
+	{
+		static thread_shards<statistics_shard, statistics_snapshot> *object = new thread_shards<statistics_shard, statistics_snapshot>;
+		return *object;
+	}
+
+	void increase(std::atomic<uint64_t> &counter, uint64_t amount) noexcept
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+}
+
+void count_statistic(statistic which, uint64_t amount) noexcept
+{
+	if (statistics_shard *shard = shards().local())
+		increase(shard->values[static_cast<size_t>(which)], amount);
+}
+
+void count_status(short status) noexcept
+{
+	if (status < static_cast<short>(lowest_status) || status > static_cast<short>(highest_status))
+		return;
+
+	if (statistics_shard *shard = shards().local())
+		increase(shard->statuses[status - lowest_status], 1);
+}
+
+void collect_statistics(statistics_snapshot &destination)
+{
+	shards().collect(destination);
+	destination.uptime = std::chrono::steady_clock::now() - process_started_at;
+}
@@ -0,0 +1,60 @@
+#ifndef __STATISTICS_H__
+#define __STATISTICS_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+enum class statistic : size_t
+{
+	connections_opened = 0,
+	connections_closed = 1,
+	requests = 2,
+	bytes_sent = 3,
+	metadata_hits = 4,
+	metadata_misses = 5,
+	compressions = 6,
+	compression_cpu_us = 7,		// thread CPU time spent in deflate
+	compression_saved_bytes = 8,		// original minus compressed size of every response sent compressed
+	metadata_coalesced = 9,		// loads saved by waiting for the same load of another thread
+	compression_coalesced = 10,
+	missing_cached = 11,		// 404 answered from the negative cache
+	missing_filtered = 12,		// 404 answered from the path filter
+	path_index_hits = 13,		// files found in the path index, served without a stat
+	path_index_misses = 14,		// 404 answered from the path index
+	timeouts_idle = 15,		// connections closed for sending nothing
+	timeouts_header = 16,		// connections closed for an incomplete request head
+	timeouts_send = 17,		// responses cut for a client reading too slowly
+	connections_shed = 18		// connections answered with the prebuilt 503 by admission control
+};
+
+constexpr size_t statistics_count = 19;
+
+const char *statistic_name(statistic which) noexcept;
+
+constexpr size_t lowest_status = 100;
+constexpr size_t highest_status = 599;
+constexpr size_t statuses_count = highest_status - lowest_status + 1;
+
+struct statistics_snapshot
+{
+	uint64_t values[statistics_count];
+	uint64_t statuses[statuses_count];
+	std::chrono::steady_clock::duration uptime;
+
+	uint64_t operator[](statistic which) const noexcept
+	{
+		return values[static_cast<size_t>(which)];
+	}
+};
+
+// counters live in per-thread shards, so counting never touches a shared cache line
+void count_statistic(statistic which, uint64_t amount = 1) noexcept;
+
+void count_status(short status) noexcept;
+
+// sums the shards of all the threads, alive and finished
+void collect_statistics(statistics_snapshot &destination);
+
+#endif
@@ -0,0 +1,226 @@
+#include <memory>
+#include <sstream>
+
+#include "status_page.h"
+#include "statistics.h"
+#include "phase_timing.h"
+#include "logging.h"
+
+namespace
+{
+	struct pool_figures
+	{
+		size_t workers = 0;
+		uint64_t steals = 0;
+		lane_statistics lanes[task_lanes_count] = {};
+	};
+
+	const char *lane_name(size_t lane) noexcept
+	{
+		return (lane == static_cast<size_t>(task_lane::bulk)) ? "bulk" : "latency";
+	}
+
+	const double phase_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	void render_text(std::ostringstream &page, const statistics_snapshot &counters, const pool_figures &pool,
+			const phase_histogram *phases, double microseconds_per_tick)
+	{
+		page << "Bolbot-CPPserver status\n"
+			<< "uptime " << std::chrono::duration_cast<std::chrono::seconds>(counters.uptime).count() << " s\n"
+			<< "connections active " << counters[statistic::connections_opened] - counters[statistic::connections_closed]
+			<< ", total " << counters[statistic::connections_opened]
+			<< ", shed " << counters[statistic::connections_shed] << "\n"
+			<< "requests " << counters[statistic::requests] << ", bytes sent " << counters[statistic::bytes_sent] << "\n";
+
+		for (size_t i = 0; i != statuses_count; ++i)
+		{
+			if (counters.statuses[i])
+				page << "\tstatus " << i + lowest_status << ": " << counters.statuses[i] << "\n";
+		}
+
+		page << "pool workers " << pool.workers << ", steals " << pool.steals << "\n";
+		for (size_t i = 0; i != task_lanes_count; ++i)
+		{
+			const lane_statistics &lane = pool.lanes[i];
+			page << "\t" << lane_name(i) << " lane: depth " << lane.depth << ", executed " << lane.executed
+				<< ", average wait " << (lane.executed ? lane.total_wait_ns / lane.executed / 1000 : 0) << " us"
+				<< ", max wait " << lane.max_wait_ns / 1000 << " us\n";
+		}
+
+		page << "metadata cache hits " << counters[statistic::metadata_hits]
+			<< ", misses " << counters[statistic::metadata_misses]
+			<< ", coalesced " << counters[statistic::metadata_coalesced] << "\n";
+
+		page << "not found without a syscall: negative cache " << counters[statistic::missing_cached]
+			<< ", path filter " << counters[statistic::missing_filtered]
+			<< ", path index " << counters[statistic::path_index_misses] << "\n";
+
+		page << "path index hits " << counters[statistic::path_index_hits] << "\n";
+
+		page << "timed out connections: idle " << counters[statistic::timeouts_idle]
+			<< ", request head " << counters[statistic::timeouts_header]
+			<< ", slow send " << counters[statistic::timeouts_send] << "\n";
+
+		page << "compressions " << counters[statistic::compressions]
+			<< ", coalesced " << counters[statistic::compression_coalesced]
+			<< ", cpu " << counters[statistic::compression_cpu_us] << " us"
+			<< ", bytes saved " << counters[statistic::compression_saved_bytes] << "\n";
+
+		page << "log records dropped " << async_logger::instance().dropped_records() << "\n";
+
+		if (!phases)
+			return;
+
+		page << "request phases, us:\n";
+		for (size_t i = 0; i != request_phases_count; ++i)
+		{
+			page << "\t" << request_phase_name(static_cast<request_phase>(i)) << ": count " << phases[i].count();
+			for (double quantile: phase_quantiles)
+				page << ", p" << quantile * 100 << " " << phases[i].percentile(quantile) * microseconds_per_tick;
+			page << ", max " << phases[i].max() * microseconds_per_tick << "\n";
+		}
+	}
+
+	void render_prometheus(std::ostringstream &page, const statistics_snapshot &counters, const pool_figures &pool,
+			const phase_histogram *phases, double microseconds_per_tick)
+	{
+		page << "# HELP final_uptime_seconds Time since the server started.\n"
+			<< "# TYPE final_uptime_seconds gauge\n"
+			<< "final_uptime_seconds " << std::chrono::duration_cast<std::chrono::seconds>(counters.uptime).count() << "\n"
+			<< "# HELP final_connections_active Accepted connections not closed yet.\n"
+			<< "# TYPE final_connections_active gauge\n"
+			<< "final_connections_active " << counters[statistic::connections_opened] - counters[statistic::connections_closed] << "\n"
+			<< "# HELP final_connections_total Accepted connections.\n"
+			<< "# TYPE final_connections_total counter\n"
+			<< "final_connections_total " << counters[statistic::connections_opened] << "\n"
+			<< "# HELP final_connections_shed_total Connections answered with 503 by admission control.\n"
+			<< "# TYPE final_connections_shed_total counter\n"
+			<< "final_connections_shed_total " << counters[statistic::connections_shed] << "\n"
+			<< "# HELP final_bytes_sent_total Bytes of status lines, headers and bodies sent.\n"
+			<< "# TYPE final_bytes_sent_total counter\n"
+			<< "final_bytes_sent_total " << counters[statistic::bytes_sent] << "\n"
+			<< "# HELP final_requests_total Answered requests by response status.\n"
+			<< "# TYPE final_requests_total counter\n";
+
+		for (size_t i = 0; i != statuses_count; ++i)
+		{
+			if (counters.statuses[i])
+				page << "final_requests_total{status=\"" << i + lowest_status << "\"} " << counters.statuses[i] << "\n";
+		}
+
+		page << "# HELP final_pool_workers Running workers of the thread pool.\n"
+			<< "# TYPE final_pool_workers gauge\n"
+			<< "final_pool_workers " << pool.workers << "\n"
+			<< "# HELP final_pool_steals_total Tasks stolen between workers.\n"
+			<< "# TYPE final_pool_steals_total counter\n"
+			<< "final_pool_steals_total " << pool.steals << "\n"
+			<< "# HELP final_pool_queue_depth Queued tasks by lane.\n"
+			<< "# TYPE final_pool_queue_depth gauge\n";
+		for (size_t i = 0; i != task_lanes_count; ++i)
+			page << "final_pool_queue_depth{lane=\"" << lane_name(i) << "\"} " << pool.lanes[i].depth << "\n";
+
+		page << "# HELP final_pool_tasks_total Executed tasks by lane.\n"
+			<< "# TYPE final_pool_tasks_total counter\n";
+		for (size_t i = 0; i != task_lanes_count; ++i)
+			page << "final_pool_tasks_total{lane=\"" << lane_name(i) << "\"} " << pool.lanes[i].executed << "\n";
+
+		page << "# HELP final_pool_wait_seconds_total Time tasks spent queued by lane.\n"
+			<< "# TYPE final_pool_wait_seconds_total counter\n";
+		for (size_t i = 0; i != task_lanes_count; ++i)
+			page << "final_pool_wait_seconds_total{lane=\"" << lane_name(i) << "\"} " << pool.lanes[i].total_wait_ns / 1e9 << "\n";
+
+		page << "# HELP final_metadata_cache_lookups_total Lookups of file metadata by result.\n"
+			<< "# TYPE final_metadata_cache_lookups_total counter\n"
+			<< "final_metadata_cache_lookups_total{result=\"hit\"} " << counters[statistic::metadata_hits] << "\n"
+			<< "final_metadata_cache_lookups_total{result=\"miss\"} " << counters[statistic::metadata_misses] << "\n"
+			<< "final_metadata_cache_lookups_total{result=\"coalesced\"} " << counters[statistic::metadata_coalesced] << "\n";
+
+		page << "# HELP final_not_found_shortcuts_total Missing paths answered without a filesystem syscall by source.\n"
+			<< "# TYPE final_not_found_shortcuts_total counter\n"
+			<< "final_not_found_shortcuts_total{source=\"negative_cache\"} " << counters[statistic::missing_cached] << "\n"
+			<< "final_not_found_shortcuts_total{source=\"path_filter\"} " << counters[statistic::missing_filtered] << "\n"
+			<< "final_not_found_shortcuts_total{source=\"path_index\"} " << counters[statistic::path_index_misses] << "\n";
+
+		page << "# HELP final_path_index_hits_total Files found in the path index and served without a stat.\n"
+			<< "# TYPE final_path_index_hits_total counter\n"
+			<< "final_path_index_hits_total " << counters[statistic::path_index_hits] << "\n";
+
+		page << "# HELP final_connection_timeouts_total Connections closed by the timer wheel by timeout.\n"
+			<< "# TYPE final_connection_timeouts_total counter\n"
+			<< "final_connection_timeouts_total{timeout=\"idle\"} " << counters[statistic::timeouts_idle] << "\n"
+			<< "final_connection_timeouts_total{timeout=\"header\"} " << counters[statistic::timeouts_header] << "\n"
+			<< "final_connection_timeouts_total{timeout=\"send\"} " << counters[statistic::timeouts_send] << "\n";
+
+		page << "# HELP final_compressions_total Files compressed on the fly.\n"
+			<< "# TYPE final_compressions_total counter\n"
+			<< "final_compressions_total " << counters[statistic::compressions] << "\n"
+			<< "# HELP final_compressions_coalesced_total Compressions saved by waiting for the same one of another thread.\n"
+			<< "# TYPE final_compressions_coalesced_total counter\n"
+			<< "final_compressions_coalesced_total " << counters[statistic::compression_coalesced] << "\n"
+			<< "# HELP final_compression_cpu_seconds_total CPU time spent compressing.\n"
+			<< "# TYPE final_compression_cpu_seconds_total counter\n"
+			<< "final_compression_cpu_seconds_total " << counters[statistic::compression_cpu_us] / 1e6 << "\n"
+			<< "# HELP final_compression_saved_bytes_total Body bytes not sent thanks to compression on the fly.\n"
+			<< "# TYPE final_compression_saved_bytes_total counter\n"
+			<< "final_compression_saved_bytes_total " << counters[statistic::compression_saved_bytes] << "\n";
+
+		page << "# HELP final_log_records_dropped_total Error log records dropped because of full buffers.\n"
+			<< "# TYPE final_log_records_dropped_total counter\n"
+			<< "final_log_records_dropped_total " << async_logger::instance().dropped_records() << "\n";
+
+		if (!phases)
+			return;
+
+		page << "# HELP final_request_phase_seconds Duration of request phases.\n"
+			<< "# TYPE final_request_phase_seconds summary\n";
+		for (size_t i = 0; i != request_phases_count; ++i)
+		{
+			const char *name = request_phase_name(static_cast<request_phase>(i));
+			for (double quantile: phase_quantiles)
+			{
+				page << "final_request_phase_seconds{phase=\"" << name << "\",quantile=\"" << quantile << "\"} "
+					<< phases[i].percentile(quantile) * microseconds_per_tick / 1e6 << "\n";
+			}
+			page << "final_request_phase_seconds_count{phase=\"" << name << "\"} " << phases[i].count() << "\n";
+		}
+	}
+}
+
+const char *status_content_type(status_format format) noexcept
+{
+	return (format == status_format::prometheus) ? "text/plain; version=0.0.4" : "text/plain";
+}
+
+std::string render_status_page(status_format format, const thread_pool *pool)
+{
+	statistics_snapshot counters;
+	collect_statistics(counters);
+
+	pool_figures figures;
+	if (pool)
+	{
+		figures.workers = pool->size();
+		figures.steals = pool->get_steals_count();
+		for (size_t i = 0; i != task_lanes_count; ++i)
+			figures.lanes[i] = pool->get_lane_statistics(static_cast<task_lane>(i));
+	}
+
+	std::unique_ptr<phase_histogram[]> phases;
+	double microseconds_per_tick = 0.0;
+#if PHASE_TIMING
+	microseconds_per_tick = nanoseconds_per_phase_tick() / 1000.0;
+	if (microseconds_per_tick != 0.0)
+	{
+		phases.reset(new phase_histogram[request_phases_count]);
+		merge_phase_histograms(phases.get());
+	}
+#endif
+
+	std::ostringstream page;
+	if (format == status_format::prometheus)
+		render_prometheus(page, counters, figures, phases.get(), microseconds_per_tick);
+	else
+		render_text(page, counters, figures, phases.get(), microseconds_per_tick);
+
+	return page.str();
+}
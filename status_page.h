@@ -0,0 +1,18 @@
+#ifndef __STATUS_PAGE_H__
+#define __STATUS_PAGE_H__
+
+#include <string>
+
+#include "multithreading.h"
+
+enum class status_format
+{
+	text,
+	prometheus
+};
+
+const char *status_content_type(status_format format) noexcept;
+
+std::string render_status_page(status_format format, const thread_pool *pool);
+
+#endif
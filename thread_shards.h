@@ -0,0 +1,69 @@
+#ifndef __THREAD_SHARDS_H__
+#define __THREAD_SHARDS_H__
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+template <typename Shard, typename Total>
+class thread_shards final
+{
+	// a Shard per thread, written by that thread alone so counting never touches a shared cache line;
+	// a finishing thread folds its shard into the total of the finished ones.
+	// Shard needs void add_to(Total &) const noexcept, reading its counters with relaxed loads
+private:
+	struct holder
+	{
+		thread_shards *owner = nullptr;
+		Shard *shard = nullptr;
+
+		~holder()
+		{
+			if (!shard)
+				return;
+
+			std::lock_guard<std::mutex> lock(owner->mutex);
+			shard->add_to(owner->finished);
+			owner->alive.erase(std::find(owner->alive.begin(), owner->alive.end(), shard));
+			delete shard;
+		}
+	};
+
+	std::mutex mutex;
+	std::vector<Shard *> alive;
+	Total finished{};
+public:
+	// nullptr when no shard could be allocated, the caller then counts nothing
+	Shard *local() noexcept
+	{
+		static thread_local holder slot;
+
+		if (!slot.shard)
+		{
+			try
+			{
+				std::unique_ptr<Shard> shard{ new Shard };
+				std::lock_guard<std::mutex> lock(mutex);
+				alive.push_back(shard.get());
+				slot.owner = this;
+				slot.shard = shard.release();
+			}
+			catch (...)
+			{
+				return nullptr;
+			}
+		}
+		return slot.shard;
+	}
+
+	void collect(Total &destination)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		destination = finished;
+		for (const Shard *shard: alive)
+			shard->add_to(destination);
+	}
+};
+
+#endif
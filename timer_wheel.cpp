@@ -0,0 +1,130 @@
+#include <thread>
+
+#include <sys/socket.h>
+
+#include "timer_wheel.h"
+#include "logging.h"
+#include "statistics.h"
+#include "tracing.h"
+
+constexpr size_t timer_wheel::slots_count;
+constexpr std::chrono::milliseconds timer_wheel::tick;
+
+timer_wheel::timer_wheel() noexcept
+{
+	for (timer_node &head: slots)
+		head.previous = head.next = &head;
+}
+
+timer_wheel &timer_wheel::instance()
+{
+	static timer_wheel *object = new timer_wheel;
+	return *object;
+}
+
+void timer_wheel::start()
+{
+	if (running.load(std::memory_order_relaxed))
+		return;
+
+	origin = std::chrono::steady_clock::now();
+	start_helper_thread(&timer_wheel::ticking_loop, this).detach();
+	running.store(true, std::memory_order_release);
+}
+
+void timer_wheel::unlink(timer_node &node) noexcept
+{
+	node.previous->next = node.next;
+	node.next->previous = node.previous;
+	node.previous = node.next = nullptr;
+	node.armed = false;
+}
+
+void timer_wheel::arm(timer_node &node, int fd, connection_timeout kind, std::chrono::steady_clock::time_point deadline) noexcept
+{
+	if (!enabled())
+		return;
+
+	// rounded up, a deadline never fires early
+	auto delay = deadline - origin;
+	uint64_t expiry = delay.count() <= 0 ? 0 : (delay + tick - std::chrono::steady_clock::duration(1)) / tick;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (node.armed)
+		unlink(node);
+	if (expiry <= current_tick)
+		expiry = current_tick + 1;
+
+	node.fd = fd;
+	node.kind = kind;
+	node.expiry_tick = expiry;
+	timer_node &head = slots[expiry % slots_count];
+	node.previous = head.previous;
+	node.next = &head;
+	head.previous->next = &node;
+	head.previous = &node;
+	node.armed = true;
+}
+
+void timer_wheel::disarm(timer_node &node) noexcept
+{
+	if (!enabled())
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (node.armed)
+		unlink(node);
+}
+
+void timer_wheel::expire_slot(timer_node &head) noexcept
+{
+	// a slot also holds deadlines whole turns of the wheel away, they stay
+	timer_node *node = head.next;
+	while (node != &head)
+	{
+		timer_node *next = node->next;
+		if (node->expiry_tick <= current_tick)
+		{
+			unlink(*node);
+			node->expired.store(true, std::memory_order_relaxed);
+			// shutdown rather than close: the fd stays owned by the worker, which sees the end of the stream
+			if (shutdown(node->fd, SHUT_RDWR) == -1 && errno != ENOTCONN)
+				LOG_CERROR("failed to shut down a timed out connection");
+
+			switch (node->kind)
+			{
+			case connection_timeout::idle:
+				count_statistic(statistic::timeouts_idle);
+				break;
+			case connection_timeout::header:
+				count_statistic(statistic::timeouts_header);
+				break;
+			case connection_timeout::send:
+				count_statistic(statistic::timeouts_send);
+				break;
+			}
+		}
+		node = next;
+	}
+}
+
+void timer_wheel::ticking_loop() noexcept
+{
+	trace_recorder::name_thread("timer wheel");
+
+	while (true)
+	{
+		std::this_thread::sleep_until(origin + tick * static_cast<int64_t>(current_tick + 1));
+
+		uint64_t now = (std::chrono::steady_clock::now() - origin) / tick;
+		std::lock_guard<std::mutex> lock(mutex);
+		// a late wake-up expires every slot it overslept, at most one turn
+		if (now > current_tick + slots_count)
+			current_tick = now - slots_count;
+		while (current_tick < now)
+		{
+			++current_tick;
+			expire_slot(slots[current_tick % slots_count]);
+		}
+	}
+}
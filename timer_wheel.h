@@ -0,0 +1,67 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+enum class connection_timeout : uint8_t
+{
+	idle = 0,		// nothing received since accept
+	header = 1,		// request head still incomplete
+	send = 2		// response slower than the minimum send rate
+};
+
+struct timer_node
+{
+	// embedded in the state of a connection, so arming never allocates
+	timer_node *previous = nullptr;
+	timer_node *next = nullptr;
+	uint64_t expiry_tick = 0;
+	int fd = -1;
+	connection_timeout kind = connection_timeout::idle;
+	bool armed = false;
+	std::atomic<bool> expired{ false };		// the socket was shut down by the wheel
+};
+
+class timer_wheel final
+{
+	// hashed wheel of connection deadlines: arming and disarming are O(1) list splices under one mutex, and a
+	// thread of its own shuts an expired socket down, which wakes the worker blocked in recv, send or sendfile
+public:
+	static constexpr size_t slots_count = 1024;
+	static constexpr std::chrono::milliseconds tick{ 100 };
+private:
+	std::mutex mutex;
+	timer_node slots[slots_count];			// sentinels of circular lists
+	uint64_t current_tick = 0;			// every slot up to it has expired
+	std::chrono::steady_clock::time_point origin;
+	std::atomic<bool> running{ false };
+
+	timer_wheel() noexcept;
+
+	static void unlink(timer_node &node) noexcept;
+	void expire_slot(timer_node &head) noexcept;
+	void ticking_loop() noexcept;
+public:
+	static timer_wheel &instance();
+	timer_wheel(const timer_wheel &) = delete;
+	timer_wheel &operator=(const timer_wheel &) = delete;
+
+	bool enabled() const noexcept
+	{
+		return running.load(std::memory_order_relaxed);
+	}
+
+	void start();
+
+	// replaces the deadline the node had; does nothing until started
+	void arm(timer_node &node, int fd, connection_timeout kind, std::chrono::steady_clock::time_point deadline) noexcept;
+
+	// after it returns the wheel never touches the fd of the node again, so the fd may be closed
+	void disarm(timer_node &node) noexcept;
+};
+
+#endif
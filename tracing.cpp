@@ -0,0 +1,285 @@
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <thread>
+#include <fstream>
+
+#include <cstdio>
+#include <cstring>
+#include <climits>
+
+#include <unistd.h>
+
+#include "tracing.h"
+#include "logging.h"
+
+constexpr size_t trace_recorder::events_per_thread;
+constexpr std::chrono::milliseconds trace_recorder::writer_interval;
+constexpr char trace_recorder::file_prefix[];
+
+std::atomic<bool> trace_recorder::active_flag{ false };
+
+namespace
+{
+	struct trace_event
+	{
+		const char *name;
+		int64_t started_ns;
+		int64_t duration_ns;			// negative for instant events
+		const char *argument_name;
+		int64_t argument;
+	};
+
+	struct thread_buffer
+	{
+		// filled by the owning thread only; a dump reads the events below count of the current generation
+		std::atomic<uint64_t> generation{ 0 };
+		std::atomic<size_t> count{ 0 };
+		std::atomic<size_t> dropped{ 0 };
+		std::atomic<bool> owned{ true };
+		std::atomic<bool> recording{ false };		// set by the owner around the writing of an event
+		char name[32];
+		std::unique_ptr<trace_event[]> events{ new trace_event[trace_recorder::events_per_thread] };
+	};
+
+	struct recorder_state
+	{
+		std::atomic<uint64_t> generation{ 0 };
+		std::mutex mutex;
+		std::vector<thread_buffer *> buffers;
+		std::string directory;
+	};
+
+	recorder_state &state()
+	{
+		static recorder_state *object = new recorder_state;
+		return *object;
+	}
+
+	// constant-initialized, so the signal handler touches nothing that needs construction
+	std::atomic<unsigned> toggle_requests{ 0 };
+
+	thread_local char thread_name[32] = "";
+
+	struct buffer_holder
+	{
+		thread_buffer *buffer = nullptr;
+
+		~buffer_holder()
+		{
+			// events stay for the dump, the buffer is adopted by a later thread once they are stale
+			if (buffer)
+				buffer->owned.store(false, std::memory_order_release);
+		}
+	};
+
+	thread_buffer *local_buffer() noexcept
+	{
+		static thread_local buffer_holder holder;
+
+		if (!holder.buffer)
+		{
+			try
+			{
+				recorder_state &all = state();
+				uint64_t generation = all.generation.load(std::memory_order_acquire);
+
+				std::lock_guard<std::mutex> lock(all.mutex);
+				for (thread_buffer *buffer: all.buffers)
+				{
+					if (!buffer->owned.load(std::memory_order_acquire)
+							&& buffer->generation.load(std::memory_order_relaxed) != generation)
+					{
+						buffer->owned.store(true, std::memory_order_relaxed);
+						holder.buffer = buffer;
+						break;
+					}
+				}
+				if (!holder.buffer)
+				{
+					std::unique_ptr<thread_buffer> created{ new thread_buffer };
+					all.buffers.push_back(created.get());
+					holder.buffer = created.release();
+				}
+
+				if (thread_name[0])
+					snprintf(holder.buffer->name, sizeof(holder.buffer->name), "%s", thread_name);
+				else
+					snprintf(holder.buffer->name, sizeof(holder.buffer->name), "thread %zu", all.buffers.size());
+			}
+			catch (...)
+			{
+				return nullptr;
+			}
+		}
+		return holder.buffer;
+	}
+
+	void write_event(std::ofstream &file, const trace_event &event, size_t track, pid_t pid)
+	{
+		char text[256];
+		int length;
+		if (event.duration_ns < 0)
+			length = snprintf(text, sizeof(text), ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%zu,\"ts\":%.3f",
+					event.name, static_cast<int>(pid), track, event.started_ns / 1000.0);
+		else
+			length = snprintf(text, sizeof(text), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f",
+					event.name, static_cast<int>(pid), track, event.started_ns / 1000.0, event.duration_ns / 1000.0);
+		file.write(text, std::min<size_t>(length, sizeof(text) - 1));
+
+		if (event.argument_name)
+			file << ",\"args\":{\"" << event.argument_name << "\":" << event.argument << "}";
+		file << "}";
+	}
+
+	void dump(uint64_t generation)
+	{
+		recorder_state &all = state();
+		std::string path = all.directory + "/" + trace_recorder::file_prefix + std::to_string(generation) + ".json";
+
+		std::ofstream file{ path };
+		if (!file)
+		{
+			log_record{} << "Failed to open " << path << " for the trace\n";
+			return;
+		}
+
+		pid_t pid = getpid();
+		size_t events = 0, dropped = 0;
+
+		file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+			<< "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"final\"}}";
+
+		std::lock_guard<std::mutex> lock(all.mutex);
+		for (size_t track = 0; track != all.buffers.size(); ++track)
+		{
+			const thread_buffer &buffer = *all.buffers[track];
+			// the recording is stopped already, an owner still writing an event started before is waited for
+			while (buffer.recording.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			if (buffer.generation.load(std::memory_order_acquire) != generation)
+				continue;
+
+			size_t count = buffer.count.load(std::memory_order_acquire);
+			file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << track
+				<< ",\"args\":{\"name\":\"" << buffer.name << "\"}}";
+			for (size_t i = 0; i != count; ++i)
+				write_event(file, buffer.events[i], track, pid);
+
+			events += count;
+			dropped += buffer.dropped.load(std::memory_order_relaxed);
+		}
+		file << "\n]}\n";
+		file.close();
+
+		std::clog << "Trace of " << events << " events written to " << path;
+		if (dropped)
+			std::clog << ", " << dropped << " events did not fit the buffers";
+		std::clog << std::endl;
+	}
+
+	void append(thread_buffer &buffer, const trace_event &event) noexcept
+	{
+		uint64_t generation = state().generation.load(std::memory_order_acquire);
+		if (buffer.generation.load(std::memory_order_relaxed) != generation)
+		{
+			// events of an older recording are dropped here by the owner rather than by the writer
+			buffer.count.store(0, std::memory_order_relaxed);
+			buffer.dropped.store(0, std::memory_order_relaxed);
+			buffer.generation.store(generation, std::memory_order_release);
+		}
+
+		size_t count = buffer.count.load(std::memory_order_relaxed);
+		if (count == trace_recorder::events_per_thread)
+		{
+			buffer.dropped.store(buffer.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+
+		buffer.events[count] = event;
+		buffer.count.store(count + 1, std::memory_order_release);
+	}
+}
+
+void trace_recorder::toggle() noexcept
+{
+	toggle_requests.fetch_add(1, std::memory_order_relaxed);
+}
+
+void trace_recorder::writing_loop()
+{
+	unsigned seen = 0;
+	while (true)
+	{
+		std::this_thread::sleep_for(writer_interval);
+
+		unsigned requested = toggle_requests.load(std::memory_order_relaxed);
+		if (requested == seen)
+			continue;
+		seen = requested;
+
+		bool wanted = requested & 1;
+		if (wanted == active())
+			continue;
+
+		recorder_state &all = state();
+		if (wanted)
+		{
+			all.generation.fetch_add(1, std::memory_order_release);
+			active_flag.store(true, std::memory_order_relaxed);
+			std::clog << "Tracing started" << std::endl;
+			continue;
+		}
+
+		active_flag.store(false, std::memory_order_seq_cst);
+		try
+		{
+			dump(all.generation.load(std::memory_order_acquire));
+		}
+		catch (std::exception &e)
+		{
+			log_record{} << "Failed to write the trace: " << e.what() << "\n";
+		}
+	}
+}
+
+void trace_recorder::start_writer() noexcept
+{
+	char directory[PATH_MAX];
+	if (!getcwd(directory, sizeof(directory)))
+	{
+		LOG_CERROR("failed to get the directory for traces, tracing is unavailable");
+		return;
+	}
+
+	try
+	{
+		state().directory = directory;
+		start_helper_thread(&trace_recorder::writing_loop).detach();
+	}
+	catch (std::exception &e)
+	{
+		log_record{} << "Failed to start the trace writer, tracing is unavailable: " << e.what() << "\n";
+	}
+}
+
+void trace_recorder::record(const char *name, int64_t started_ns, int64_t duration_ns, const char *argument_name,
+		int64_t argument) noexcept
+{
+	thread_buffer *buffer = local_buffer();
+	if (!buffer)
+		return;
+
+	// paired with the dump, which clears active_flag and then waits for recording to drop: either the dump sees
+	// this store, or the load below sees the recording stopped and nothing is written
+	buffer->recording.store(true, std::memory_order_seq_cst);
+	if (active_flag.load(std::memory_order_seq_cst))
+		append(*buffer, trace_event{ name, started_ns, duration_ns, argument_name, argument });
+	buffer->recording.store(false, std::memory_order_release);
+}
+
+void trace_recorder::name_thread(const char *name) noexcept
+{
+	snprintf(thread_name, sizeof(thread_name), "%s", name);
+}
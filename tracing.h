@@ -0,0 +1,69 @@
+#ifndef __TRACING_H__
+#define __TRACING_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// on-demand recording of task and connection timelines, dumped as Chrome trace-event JSON for Perfetto
+class trace_recorder final
+{
+private:
+	static std::atomic<bool> active_flag;
+
+	static void writing_loop();
+public:
+	static constexpr size_t events_per_thread = 1 << 16;
+	static constexpr std::chrono::milliseconds writer_interval{ 100 };
+	static constexpr char file_prefix[] = "the_server_trace.";
+
+	static bool active() noexcept
+	{
+		return active_flag.load(std::memory_order_relaxed);
+	}
+
+	static int64_t now_ns() noexcept
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	// async-signal-safe, the writer thread starts or stops the recording on its next wake-up
+	static void toggle() noexcept;
+
+	// captures the current directory for the dumps, so it has to run before the chdir of daemonize
+	static void start_writer() noexcept;
+
+	static void record(const char *name, int64_t started_ns, int64_t duration_ns, const char *argument_name,
+			int64_t argument) noexcept;
+
+	// names the track of the calling thread, kept for recordings started later
+	static void name_thread(const char *name) noexcept;
+};
+
+// names and argument names have to be string literals, events keep only the pointers
+
+inline void trace_instant(const char *name, const char *argument_name = nullptr, int64_t argument = 0) noexcept
+{
+	if (trace_recorder::active())
+		trace_recorder::record(name, trace_recorder::now_ns(), -1, argument_name, argument);
+}
+
+inline void trace_span(const char *name, int64_t started_ns, int64_t finished_ns, const char *argument_name = nullptr,
+		int64_t argument = 0) noexcept
+{
+	if (trace_recorder::active())
+		trace_recorder::record(name, started_ns, finished_ns - started_ns, argument_name, argument);
+}
+
+inline void trace_span(const char *name, std::chrono::steady_clock::time_point started,
+		std::chrono::steady_clock::time_point finished, const char *argument_name = nullptr, int64_t argument = 0) noexcept
+{
+	using namespace std::chrono;
+	if (trace_recorder::active())
+		trace_recorder::record(name, duration_cast<nanoseconds>(started.time_since_epoch()).count(),
+				duration_cast<nanoseconds>(finished - started).count(), argument_name, argument);
+}
+
+#endif
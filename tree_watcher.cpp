@@ -0,0 +1,359 @@
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <iterator>
+
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "tree_watcher.h"
+#include "logging.h"
+
+namespace
+{
+	constexpr uint32_t watched_events = IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CLOSE_WRITE
+		| IN_MODIFY | IN_ATTRIB | IN_ONLYDIR;
+
+	// a directory, or a symbolic link leading to one, is listed rather than reported as a file
+	bool names_directory(const std::string &full, const struct stat &statbuf) noexcept
+	{
+		struct stat target;
+		return S_ISDIR(statbuf.st_mode)
+			|| (S_ISLNK(statbuf.st_mode) && stat(full.data(), &target) == 0 && S_ISDIR(target.st_mode));
+	}
+}
+
+tree_watcher &tree_watcher::instance()
+{
+	static tree_watcher *object = new tree_watcher;
+	return *object;
+}
+
+bool tree_watcher::list_directory(const std::string &directory, bool linked, tree_scan &found,
+		std::vector<std::pair<std::string, bool>> &subdirectories)
+{
+	// the watch goes first, so a file changed during the listing is either seen here or reported by inotify
+	std::string full = root + directory;
+	int descriptor = inotify_add_watch(inotify_fd, full.data(), watched_events);
+	if (descriptor == -1)
+	{
+		LOG_CERROR("failed to watch a directory");
+		log_record{} << "Directory " << full << " is not watched\n";
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(watched_mutex);
+		auto known = watched.find(descriptor);
+		if (known != watched.end() && known->second.path != directory)
+		{
+			// one watch per inode: a directory reachable by two paths reports events under one of them only;
+			// a directory moved within the tree keeps its watch and is simply known by its new path
+			struct stat previous, now;
+			if (stat((root + known->second.path).data(), &previous) == 0 && stat(full.data(), &now) == 0
+					&& previous.st_dev == now.st_dev && previous.st_ino == now.st_ino)
+			{
+				if (lstat(full.data(), &now) == 0 && S_ISLNK(now.st_mode))
+				{
+					found.unfollowed.push_back(directory);
+					return true;
+				}
+				log_record{} << "Directories " << root + known->second.path << " and " << full << " are the same\n";
+				return false;
+			}
+			descriptors.erase(known->second.path);
+		}
+		watched[descriptor] = watched_directory{ directory, linked };
+		descriptors[directory] = descriptor;
+	}
+
+	DIR *listing = opendir(full.data());
+	if (!listing)
+	{
+		LOG_CERROR("failed to list a directory");
+		return false;
+	}
+
+	++found.directories;
+	while (struct dirent *entry = readdir(listing))
+	{
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		struct stat statbuf;
+		if (fstatat(dirfd(listing), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;		// deleted since readdir, inotify tells
+
+		// a link to a directory is followed, and reported as well, so a listener may leave its paths to the filesystem
+		std::string child = directory + "/" + entry->d_name;
+		if (names_directory(root + child, statbuf))
+		{
+			bool link = S_ISLNK(statbuf.st_mode);
+			if (link)
+				found.files.push_back(tree_file{ child, statbuf, linked });
+			subdirectories.emplace_back(std::move(child), linked || link);
+		}
+		else
+		{
+			found.files.push_back(tree_file{ std::move(child), statbuf, linked });
+		}
+	}
+	closedir(listing);
+	return true;
+}
+
+bool tree_watcher::scan_in_parallel(tree_scan &tree, size_t threads)
+{
+	// directories are a shared queue: a worker lists one, queues its subdirectories and takes the next
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::pair<std::string, bool>> pending{ { "", false } };
+	size_t busy = 0;
+	bool failed = false;
+
+	auto worker = [&]()
+	{
+		tree_scan found;
+		std::vector<std::pair<std::string, bool>> subdirectories;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			changed.wait(lock, [&]() { return failed || !pending.empty() || busy == 0; });
+			if (failed || pending.empty())
+				break;
+
+			std::pair<std::string, bool> directory = std::move(pending.front());
+			pending.pop_front();
+			++busy;
+			lock.unlock();
+
+			subdirectories.clear();
+			bool listed;
+			try
+			{
+				listed = list_directory(directory.first, directory.second, found, subdirectories);
+			}
+			catch (std::exception &e)
+			{
+				log_record{} << "Failed to list " << root + directory.first << ": " << e.what() << "\n";
+				listed = false;
+			}
+
+			lock.lock();
+			--busy;
+			failed = failed || !listed;
+			for (std::pair<std::string, bool> &i: subdirectories)
+				pending.push_back(std::move(i));
+			changed.notify_all();
+		}
+		tree.files.insert(tree.files.end(), std::make_move_iterator(found.files.begin()),
+				std::make_move_iterator(found.files.end()));
+		tree.unfollowed.insert(tree.unfollowed.end(), found.unfollowed.begin(), found.unfollowed.end());
+		tree.directories += found.directories;
+	};
+
+	if (threads == 0)
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	std::vector<std::thread> helpers;
+	for (size_t i = 1; i < threads; ++i)
+		helpers.push_back(start_helper_thread(worker));
+	worker();
+	for (std::thread &i: helpers)
+		i.join();
+	return !failed;
+}
+
+bool tree_watcher::scan_subtree(const std::string &directory, bool linked, tree_scan &tree)
+{
+	std::vector<std::pair<std::string, bool>> pending{ { directory, linked } };
+	while (!pending.empty())
+	{
+		std::vector<std::pair<std::string, bool>> subdirectories;
+		std::pair<std::string, bool> listed = std::move(pending.back());
+		pending.pop_back();
+		if (!list_directory(listed.first, listed.second, tree, subdirectories))
+			return false;
+		pending.insert(pending.end(), subdirectories.begin(), subdirectories.end());
+	}
+	return true;
+}
+
+void tree_watcher::forget_subtree(const std::string &directory)
+{
+	// the directories below it are contiguous in the ordered map; a directory moved out of the tree
+	// would keep reporting its events under its old path, so its watch goes too
+	std::vector<std::string> directories;
+	auto unwatch = [&](std::map<std::string, int>::iterator i)
+	{
+		inotify_rm_watch(inotify_fd, i->second);
+		watched.erase(i->second);
+		directories.push_back(i->first);
+		return descriptors.erase(i);
+	};
+
+	auto i = descriptors.find(directory);
+	if (i != descriptors.end())
+		unwatch(i);
+	std::string prefix = directory + "/";
+	for (i = descriptors.lower_bound(prefix); i != descriptors.end() && i->first.compare(0, prefix.size(), prefix) == 0; )
+		i = unwatch(i);
+
+	if (!directories.empty())
+	{
+		for (tree_listener *listener: listeners)
+			listener->removed(directories);
+	}
+}
+
+bool tree_watcher::apply(const struct inotify_event &event)
+{
+	if (event.mask & IN_IGNORED)
+	{
+		auto directory = watched.find(event.wd);
+		if (directory != watched.end())
+		{
+			auto descriptor = descriptors.find(directory->second.path);
+			if (descriptor != descriptors.end() && descriptor->second == event.wd)
+				descriptors.erase(descriptor);
+			watched.erase(directory);
+		}
+		return true;
+	}
+	auto directory = watched.find(event.wd);
+	if (!event.len || directory == watched.end())
+		return true;
+	std::string path = directory->second.path + "/" + event.name;
+	bool linked = directory->second.linked;
+
+	// whatever the event, the name is described by the lstat after it, and a subtree it named before is gone
+	struct stat statbuf;
+	bool exists = lstat((root + path).data(), &statbuf) == 0;
+	if (exists && names_directory(root + path, statbuf))
+	{
+		// a directory only appears by creation or move, its attributes and contents changing are no news
+		if (!(event.mask & (IN_CREATE | IN_MOVED_TO)))
+			return true;
+
+		forget_subtree(path);
+		bool link = S_ISLNK(statbuf.st_mode);
+		for (tree_listener *listener: listeners)
+			listener->changed(path, link ? &statbuf : nullptr, linked);
+
+		tree_scan tree;
+		if (!scan_subtree(path, linked || link, tree))
+			return false;
+		for (tree_listener *listener: listeners)
+		{
+			for (const tree_file &i: tree.files)
+				listener->changed(i.path, &i.statbuf, i.linked);
+			for (const std::string &i: tree.unfollowed)
+				listener->unfollowed(i);
+		}
+		return true;
+	}
+
+	forget_subtree(path);
+	for (tree_listener *listener: listeners)
+		listener->changed(path, exists ? &statbuf : nullptr, linked);
+	return true;
+}
+
+void tree_watcher::distrust(const char *reason) noexcept
+{
+	for (tree_listener *listener: listeners)
+		listener->distrust(reason);
+}
+
+void tree_watcher::watching_loop()
+{
+	alignas(struct inotify_event) char buffer[64 * 1024];
+	while (true)
+	{
+		ssize_t got = read(inotify_fd, buffer, sizeof(buffer));
+		if (got == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_CERROR("failed to read inotify events");
+			distrust("inotify is unreadable");
+			return;
+		}
+
+		for (char *position = buffer; position < buffer + got; )
+		{
+			const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(position);
+			position += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				distrust("inotify events were lost");
+				return;
+			}
+
+			try
+			{
+				if (!apply(*event))
+				{
+					distrust("a new directory could not be scanned");
+					return;
+				}
+			}
+			catch (std::exception &e)
+			{
+				log_record{} << "Failed to follow an inotify event in " << root << ": " << e.what() << "\n";
+				distrust("an event could not be applied");
+				return;
+			}
+		}
+	}
+}
+
+void tree_watcher::start(const std::string &directory, size_t threads) noexcept
+{
+	try
+	{
+		root = directory;
+		while (!root.empty() && root.back() == '/')
+			root.pop_back();
+
+		inotify_fd = inotify_init1(IN_CLOEXEC);
+		if (inotify_fd == -1)
+		{
+			LOG_CERROR("failed to initialize inotify, the directory is not watched");
+			return;
+		}
+
+		std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+		tree_scan tree;
+		if (!scan_in_parallel(tree, threads))
+		{
+			log_record{} << "Directory " << directory << " could not be scanned completely, it is not watched\n";
+			return;
+		}
+		std::clog << "Directory " << directory << " holds " << tree.files.size() << " files in " << tree.directories
+			<< " directories, scanned in "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count()
+			<< " ms" << std::endl;
+
+		std::vector<tree_listener *> following;
+		for (tree_listener *listener: listeners)
+		{
+			if (listener->scanned(tree))
+				following.push_back(listener);
+		}
+		listeners.swap(following);
+		if (!listeners.empty())
+			start_helper_thread(&tree_watcher::watching_loop, this).detach();
+	}
+	catch (std::exception &e)
+	{
+		log_record{} << "Failed to watch " << directory << ": " << e.what() << "\n";
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef __TREE_WATCHER_H__
+#define __TREE_WATCHER_H__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct inotify_event;
+
+struct tree_file
+{
+	std::string path;				// URL path
+	struct stat statbuf;				// lstat, so a symbolic link is described as such
+	bool linked;					// below a symbolic link to a directory, whose target may change unseen
+};
+
+struct tree_scan
+{
+	std::vector<tree_file> files;
+	std::vector<std::string> unfollowed;		// symbolic links to a directory watched under another path already
+	size_t directories = 0;
+};
+
+class tree_listener
+{
+	// told what is under the directory; every call but scanned comes from the watching thread
+public:
+	virtual ~tree_listener() = default;
+
+	// the whole tree, before any change; false when the listener can not use it and wants no changes
+	virtual bool scanned(const tree_scan &tree) = 0;
+	// a file was created or changed, or is gone with nullptr as statbuf
+	virtual void changed(const std::string &path, const struct stat *statbuf, bool linked) = 0;
+	// the files of these directories are gone, they left the tree with their parent
+	virtual void removed(const std::vector<std::string> &directories) = 0;
+	// a symbolic link to a directory was created whose files are not reported
+	virtual void unfollowed(const std::string &link) = 0;
+	// an event may have been missed, no call follows
+	virtual void distrust(const char *reason) noexcept = 0;
+};
+
+class tree_watcher final
+{
+	// one scan at startup and one inotify instance for the directory, whatever number of listeners follows it
+private:
+	struct watched_directory
+	{
+		std::string path;				// URL path
+		bool linked;
+	};
+
+	std::string root;
+	int inotify_fd = -1;
+	std::vector<tree_listener *> listeners;
+	std::mutex watched_mutex;				// held only while the startup scan runs in several threads
+	std::unordered_map<int, watched_directory> watched;	// watch descriptor to directory
+	std::map<std::string, int> descriptors;		// URL path of the directory to its watch, ordered by subtree
+
+	tree_watcher() noexcept = default;
+
+	bool list_directory(const std::string &directory, bool linked, tree_scan &found,
+			std::vector<std::pair<std::string, bool>> &subdirectories);
+	bool scan_in_parallel(tree_scan &tree, size_t threads);
+	bool scan_subtree(const std::string &directory, bool linked, tree_scan &tree);
+	void forget_subtree(const std::string &directory);
+	bool apply(const struct inotify_event &event);		// false when a new directory could not be scanned
+	void distrust(const char *reason) noexcept;
+	void watching_loop();
+public:
+	static tree_watcher &instance();
+	tree_watcher(const tree_watcher &) = delete;
+	tree_watcher &operator=(const tree_watcher &) = delete;
+
+	// before start only; the listener lives for good
+	void listen(tree_listener &listener)
+	{
+		listeners.push_back(&listener);
+	}
+
+	// scans the directory with the given number of threads (0 for one per core) and starts following inotify
+	void start(const std::string &directory, size_t threads) noexcept;
+};
+
+#endif
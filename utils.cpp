@@ -20,7 +20,69 @@ void parse_program_options(int argc, char **argv) noexcept
 		options.add_options()
 			("host,h", boost::program_options::value<std::string>(&server_ip), "IP of server (i. e. 127.0.0.1)")
 			("port,p", boost::program_options::value<std::string>(&server_port), "Port (use in range 1024..65535)")
-			("directory,d", boost::program_options::value<std::string>(&server_directory), "Directory");
+			("directory,d", boost::program_options::value<std::string>(&server_directory), "Directory")
+			("worker-cpus", boost::program_options::value<std::string>(&server_worker_cpus),
+				"Optional CPU list to pin pool workers to, one worker per CPU (i. e. 1-3,6)")
+			("listener-cpus", boost::program_options::value<std::string>(&server_listener_cpus),
+				"Optional CPU list for the accepting thread, its first CPU is used")
+			("bulk-threshold", boost::program_options::value<size_t>(&server_bulk_threshold)->default_value(server_bulk_threshold),
+				"Files larger than this many bytes are sent on the bulk lane")
+			("bulk-share", boost::program_options::value<size_t>(&server_bulk_share)->default_value(server_bulk_share),
+				"Percent of pool workers allowed to serve the bulk lane at once")
+			("min-workers", boost::program_options::value<size_t>(&server_min_workers)->default_value(server_min_workers),
+				"Pool never shrinks below this many workers (0 for the maximum, a fixed size pool)")
+			("max-workers", boost::program_options::value<size_t>(&server_max_workers)->default_value(server_max_workers),
+				"Pool never grows above this many workers (0 for one per worker CPU or per core but one)")
+			("scale-latency-ms", boost::program_options::value<size_t>(&server_scale_latency_ms)->default_value(server_scale_latency_ms),
+				"Queue wait or blocking time that makes the pool grow by a worker")
+			("idle-timeout-ms", boost::program_options::value<size_t>(&server_idle_timeout_ms)->default_value(server_idle_timeout_ms),
+				"Workers above the minimum retire after idling this long")
+			("accept-batch", boost::program_options::value<size_t>(&server_accept_batch)->default_value(server_accept_batch),
+				"Connections accepted per burst and enqueued at once (1 disables batching)")
+			("dequeue-batch", boost::program_options::value<size_t>(&server_dequeue_batch)->default_value(server_dequeue_batch),
+				"Tasks a worker takes from the common queue at once (1 disables batching)")
+			("no-access-log", boost::program_options::bool_switch()->notifier([](bool off) { server_access_log = !off; }),
+				"Do not write the binary access log")
+			("status-path", boost::program_options::value<std::string>(&server_status_path)->default_value(server_status_path),
+				"Reserved address of the status page, its /prometheus suffix gives the Prometheus format (empty disables)")
+			("admin-port", boost::program_options::value<std::string>(&server_admin_port),
+				"Optional separate port serving only the status page")
+			("metrics-segment", boost::program_options::value<std::string>(&server_metrics_segment)->default_value(server_metrics_segment),
+				"Shared-memory segment with live counters for final_top (empty disables)")
+			("metadata-cache-entries", boost::program_options::value<size_t>(&server_metadata_cache_entries)->default_value(server_metadata_cache_entries),
+				"Files whose size, MIME type and ETag are kept between requests")
+			("precompressed", boost::program_options::bool_switch(&server_precompressed),
+				"Serve file.br or file.gz next to the requested file when Accept-Encoding allows it")
+			("compression-cache-mb", boost::program_options::value<size_t>(&server_compression_cache_mb)->default_value(server_compression_cache_mb),
+				"Memory for files gzipped on the fly, text files without a precompressed sibling are then compressed (0 disables)")
+			("compression-min-size", boost::program_options::value<size_t>(&server_compression_min_size)->default_value(server_compression_min_size),
+				"Files smaller than this many bytes are never compressed on the fly")
+			("negative-ttl-ms", boost::program_options::value<size_t>(&server_negative_ttl_ms)->default_value(server_negative_ttl_ms),
+				"Missing paths are answered 404 without a syscall for this long (0 disables)")
+			("negative-cache-entries", boost::program_options::value<size_t>(&server_negative_cache_entries)->default_value(server_negative_cache_entries),
+				"Missing paths remembered at most")
+			("path-filter", boost::program_options::bool_switch(&server_path_filter),
+				"Keep a Bloom filter of every file under the directory, scanned at startup and updated by inotify")
+			("path-index", boost::program_options::bool_switch(&server_path_index),
+				"Keep a hash table of every file under the directory, so requests for them need no stat")
+			("path-index-threads", boost::program_options::value<size_t>(&server_path_index_threads)->default_value(server_path_index_threads),
+				"Threads scanning the directory for the path filter and index at startup (0 for one per core)")
+			("connection-idle-ms", boost::program_options::value<size_t>(&server_connection_idle_ms)->default_value(server_connection_idle_ms),
+				"Connections sending nothing this long after accept are closed (0 never)")
+			("header-timeout-ms", boost::program_options::value<size_t>(&server_header_timeout_ms)->default_value(server_header_timeout_ms),
+				"Connections not done sending the request head this long after accept are closed (0 never)")
+			("min-send-rate", boost::program_options::value<size_t>(&server_min_send_rate)->default_value(server_min_send_rate),
+				"Responses sent slower than this many bytes per second, past the grace, are cut (0 never)")
+			("send-grace-ms", boost::program_options::value<size_t>(&server_send_grace_ms)->default_value(server_send_grace_ms),
+				"Time every response may take on top of its size at the minimum send rate")
+			("max-connections", boost::program_options::value<size_t>(&server_max_connections)->default_value(server_max_connections),
+				"Live connections above which new ones are shed (0 for half the descriptor limit, less a reserve)")
+			("max-queued", boost::program_options::value<size_t>(&server_max_queued)->default_value(server_max_queued),
+				"Queued pool tasks above which new connections are shed (0 never)")
+			("resume-percent", boost::program_options::value<size_t>(&server_resume_percent)->default_value(server_resume_percent),
+				"Percent of both limits the load must fall to before connections are admitted again")
+			("overload-pause", boost::program_options::bool_switch(&server_overload_pause),
+				"Leave connections pending in the backlog while overloaded instead of answering them with 503");
 
 		boost::program_options::variables_map map;
 		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, options), map);
@@ -34,6 +96,9 @@ void parse_program_options(int argc, char **argv) noexcept
 		}
 		if (server_ip.empty() || server_port.empty() || server_directory.empty())
 			throw std::runtime_error("Failed to parce given comand line arguemnts");
+
+		parse_cpu_list(server_worker_cpus);
+		parse_cpu_list(server_listener_cpus);
 	}
 	catch (std::exception &e)
 	{
@@ -83,11 +148,22 @@ void daemonize() noexcept
 		std::cerr << "Unknown error while redirecting output to log files.\n";
 	}
 
+	async_logger::instance().start();
+
+	if (server_access_log)
+		access_log::instance().open(access_log::file_name);
+
+	if (!server_metrics_segment.empty())
+		metrics_segment::instance().create(server_metrics_segment.data());
+
+	trace_recorder::start_writer();
+	// calibrated now rather than inside the first traced phase
+	nanoseconds_per_phase_tick();
+
 	pid_t sid = setsid();
 
 	if (sid == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("program terminates due to the setsid failure");
 		exit(EXIT_FAILURE);
 	}
@@ -95,7 +171,6 @@ void daemonize() noexcept
 	int chdir_res = chdir("/");
 	if (chdir_res == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("program terminates due to the chdir failure");
 		exit(EXIT_FAILURE);
 	}
@@ -114,7 +189,8 @@ void daemonize() noexcept
 	std::clog << "Daemoized successfully. " << time_t_to_string(current_time_t())
 		<< "\nMaster process id " << getpid()
 		<< "\nServer IP " << server_ip << "\nServer port " << server_port
-		<< "\nServer directory " << server_directory << std::endl;
+		<< "\nServer directory " << server_directory
+		<< "\nSIGUSR2 starts and stops tracing into " << trace_recorder::file_prefix << "<n>.json" << std::endl;
 }
 
 size_t get_file_size(const char *fpath)
@@ -136,7 +212,8 @@ int get_file_mime_type(const char *fpath, char *mimetype)
 	if(mf) fscanf(mf, "%*s %s", mimetype);
 	else { std::cerr << "Failed to popen to get " << fpath << " mime-type\n"; return -1; }
 
-	if(pclose(mf) == -1) { std::cerr << "Failed to close popened file (fd is " << fileno(mf) << ")\n"; return -1; }
+	int mfd = fileno(mf);
+	if(pclose(mf) == -1) { std::cerr << "Failed to close popened file (fd is " << mfd << ")\n"; return -1; }
 	if(VERBOSE) std::cerr << "Discovered that " << fpath << " has mime-type " << mimetype << "\n";
 	return 0;
 }
@@ -170,15 +247,18 @@ void signal_handler(int signal_number) noexcept
 
 		exit(EXIT_SUCCESS);
 	}
+	else if (signal_number == SIGUSR2)
+	{
+		trace_recorder::toggle();
+	}
 }
 
 void set_signal(int signal_number, struct sigaction &sa) noexcept
 {
 	if (sigaction(signal_number, &sa, nullptr) == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("sigaction failed");
-		std::cerr << "Failed to set handler for " << strsignal(signal_number) << "\n";
+		log_record{} << "Failed to set handler for " << strsignal(signal_number) << "\n";
 	}
 }
 
@@ -195,6 +275,13 @@ void set_signals() noexcept
 	set_signal(SIGQUIT, sa);
 	set_signal(SIGUSR1, sa);
 	set_signal(SIGUSR2, sa);
+
+	// a peer gone mid-response, or shut down by the timer wheel, fails sendfile with EPIPE instead of killing the server
+	struct sigaction ignored;
+	ignored.sa_handler = SIG_IGN;
+	ignored.sa_flags = 0;
+	sigemptyset(&ignored.sa_mask);
+	set_signal(SIGPIPE, ignored);
 }
 
 size_t set_maximal_avaliable_limit_of_fd() noexcept
@@ -202,7 +289,6 @@ size_t set_maximal_avaliable_limit_of_fd() noexcept
 	struct rlimit descriptors_limit;
 	if (getrlimit(RLIMIT_NOFILE, &descriptors_limit) == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("getrlimit failed");
 		return 0;
 	}
@@ -213,7 +299,6 @@ size_t set_maximal_avaliable_limit_of_fd() noexcept
 
 	if (setrlimit(RLIMIT_NOFILE, &descriptors_limit) == -1)
 	{
-		std::lock_guard<std::mutex> lock(cerr_mutex);
 		LOG_CERROR("setrlimit failed");
 		return previous;
 	}
@@ -223,6 +308,13 @@ size_t set_maximal_avaliable_limit_of_fd() noexcept
 
 void atexit_terminator() noexcept
 {
+	try
+	{
+		report_phase_timing(std::clog);
+	}
+	catch (...)
+	{
+	}
 	std::clog << "Exiting. " << time_t_to_string(current_time_t()) << std::endl;
 }
 
@@ -7,6 +7,10 @@
 #include <sys/resource.h>
 
 #include "logging.h"
+#include "access_log.h"
+#include "phase_timing.h"
+#include "metrics_segment.h"
+#include "tracing.h"
 #include "file_wrapper.h"
 #include "multithreading.h"
 